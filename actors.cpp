@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <cmath>
 #include <iostream>
 #include <Eigen/Geometry>
@@ -5,6 +6,7 @@
 
 #include "actors.h"
 #include "babel.h"
+#include "grid.h"
 
 
 namespace mrtp {
@@ -54,7 +56,7 @@ static Vector3d fill_vector(const Vector3d& vec) {
 
 
 ActorBase::ActorBase(const StandardBasis& local_basis,
-                     std::shared_ptr<TextureMapper> texture_mapper_ptr) :
+                     TextureMapper* texture_mapper_ptr) :
     local_basis_(local_basis),
     texture_mapper_(texture_mapper_ptr) {
 
@@ -66,10 +68,55 @@ MyPixel ActorBase::pick_pixel(const Vector3d& X, const Vector3d& N) const {
 }
 
 
+const TextureMapper* ActorBase::get_texture_mapper() const {
+    return texture_mapper_;
+}
+
+
+/*
+Spheres report their center and radius, so that they can
+be intersected in batches.
+*/
+bool ActorBase::get_sphere(Vector3d*, double*) const {
+    return false;
+}
+
+
+/*
+Planes and triangles report a point and the normal of their plane,
+so that they can be rasterized.
+*/
+bool ActorBase::get_plane(Vector3d*, Vector3d*) const {
+    return false;
+}
+
+
+/*
+Triangles report their three corners.
+*/
+bool ActorBase::get_triangle(Vector3d*) const {
+    return false;
+}
+
+
+/*
+Actor hit by the ray and its distance, or nullptr. Actors made
+of parts answer with the part that was hit.
+*/
+ActorBase* ActorBase::solve_hit(const Vector3d& O,
+                                const Vector3d& D,
+                                double min_dist,
+                                double max_dist,
+                                double* distance) {
+    *distance = solve_light_ray(O, D, min_dist, max_dist);
+    return (*distance > 0) ? this : nullptr;
+}
+
+
 class SimplePlane : public ActorBase {
 public:
     SimplePlane(const StandardBasis& local_basis,
-                std::shared_ptr<TextureMapper> texture_mapper_ptr) :
+                TextureMapper* texture_mapper_ptr) :
         ActorBase(local_basis, texture_mapper_ptr) {
     }
 
@@ -95,6 +142,17 @@ public:
     Vector3d calculate_normal_at_hit(const Vector3d& hit) const override {
         return local_basis_.vk;
     }
+
+    bool calculate_bounds(BoundingBox*) const override {
+        // Planes are infinite
+        return false;
+    }
+
+    bool get_plane(Vector3d* point, Vector3d* normal) const override {
+        *point = local_basis_.o;
+        *normal = local_basis_.vk;
+        return true;
+    }
 };
 
 
@@ -102,7 +160,7 @@ class SimpleTriangle : public ActorBase {
 public:
     SimpleTriangle(const StandardBasis& local_basis,
                    const Vector3d& A, const Vector3d& B, const Vector3d& C,
-                   std::shared_ptr<TextureMapper> texture_mapper_ptr) :
+                   TextureMapper* texture_mapper_ptr) :
         ActorBase(local_basis, texture_mapper_ptr),
         A_(A), B_(B), C_(C) {
 
@@ -136,6 +194,25 @@ public:
         return local_basis_.vk;
     }
 
+    bool calculate_bounds(BoundingBox* bounds) const override {
+        bounds->lower = A_.cwiseMin(B_).cwiseMin(C_);
+        bounds->upper = A_.cwiseMax(B_).cwiseMax(C_);
+        return true;
+    }
+
+    bool get_plane(Vector3d* point, Vector3d* normal) const override {
+        *point = local_basis_.o;
+        *normal = local_basis_.vk;
+        return true;
+    }
+
+    bool get_triangle(Vector3d* vertices) const override {
+        vertices[0] = A_;
+        vertices[1] = B_;
+        vertices[2] = C_;
+        return true;
+    }
+
 private:
     Vector3d A_;
     Vector3d B_;
@@ -150,7 +227,7 @@ class SimpleSphere : public ActorBase {
 public:
     SimpleSphere(const StandardBasis& local_basis,
                  double radius,
-                 std::shared_ptr<TextureMapper> texture_mapper_ptr) :
+                 TextureMapper* texture_mapper_ptr) :
         ActorBase(local_basis, texture_mapper_ptr),
         radius_(radius) {
     }
@@ -181,6 +258,23 @@ public:
         return t * (1 / t.norm());
     }
 
+    bool calculate_bounds(BoundingBox* bounds) const override {
+        Vector3d extent{radius_, radius_, radius_};
+        bounds->lower = local_basis_.o - extent;
+        bounds->upper = local_basis_.o + extent;
+        return true;
+    }
+
+    bool get_sphere(Vector3d* center, double* radius) const override {
+        *center = local_basis_.o;
+        *radius = radius_;
+        return true;
+    }
+
+    void move_to(const Vector3d& center) {
+        local_basis_.o = center;
+    }
+
 private:
     double radius_;
 };
@@ -190,7 +284,7 @@ class SimpleCylinder : public ActorBase {
 public:
     SimpleCylinder(const StandardBasis& local_basis,
                    double radius, double length,
-                   std::shared_ptr<TextureMapper> texture_mapper_ptr) :
+                   TextureMapper* texture_mapper_ptr) :
         ActorBase(local_basis, texture_mapper_ptr),
         radius_(radius),
         length_(length) {
@@ -269,13 +363,113 @@ public:
         return normal * (1 / normal.norm());
     }
 
-private:
+    bool calculate_bounds(BoundingBox* bounds) const override {
+        if (length_ <= 0) {
+            return false;
+        }
+        // Caps are discs perpendicular to the axis
+        const Vector3d& k = local_basis_.vk;
+        Vector3d extent{
+            radius_ * std::sqrt(std::max(0., 1 - k[0] * k[0])),
+            radius_ * std::sqrt(std::max(0., 1 - k[1] * k[1])),
+            radius_ * std::sqrt(std::max(0., 1 - k[2] * k[2]))
+        };
+        Vector3d end_a = local_basis_.o - length_ * k;
+        Vector3d end_b = local_basis_.o + length_ * k;
+        bounds->lower = end_a.cwiseMin(end_b) - extent;
+        bounds->upper = end_a.cwiseMax(end_b) + extent;
+        return true;
+    }
+
+    void move_to(const StandardBasis& local_basis, double length) {
+        local_basis_ = local_basis;
+        length_ = length;
+    }
+
+protected:
     double radius_;
     double length_;
 };
 
 
+/*
+Cylinder closed by half spheres of its radius at both ends, one
+test instead of a cylinder and two spheres. The nearest hit on the
+infinite cylinder tells which part the ray meets first: the side if
+it lies between the ends, else the sphere at that end. Finite only.
+*/
+class SimpleCapsule : public SimpleCylinder {
+public:
+    SimpleCapsule(const StandardBasis& local_basis,
+                  double radius, double length,
+                  TextureMapper* texture_mapper_ptr) :
+        SimpleCylinder(local_basis, radius, length, texture_mapper_ptr) {
+    }
+
+    ~SimpleCapsule() override = default;
+
+    double solve_light_ray(const Vector3d& O, const Vector3d& D,
+                           double min_dist, double max_dist) const override {
+        const Vector3d& k = local_basis_.vk;
+        Vector3d vec = O - local_basis_.o;
+
+        // Components of the ray across the axis
+        double dk = D.dot(k);
+        double ok = vec.dot(k);
+        Vector3d n = D - dk * k;
+        Vector3d m = vec - ok * k;
+
+        double a = n.dot(n);
+        double b = 2 * m.dot(n);
+        double c = m.dot(m) - radius_ * radius_;
+        double alpha;
+        if (a > 0) {
+            // Missing the infinite cylinder misses the capsule inside it
+            if (b * b - 4 * a * c < 0) {
+                return -1;
+            }
+            double t = solve_quadratic(a, b, c);
+            alpha = ok + t * dk;
+            if (alpha >= -length_ && alpha <= length_) {
+                return (t > min_dist && t < max_dist) ? t : -1;
+            }
+        } else {
+            // Along the axis, only the near end can be hit first
+            if (c > 0) {
+                return -1;
+            }
+            alpha = -dk;
+        }
+
+        Vector3d end_vec = vec - ((alpha < 0) ? -length_ : length_) * k;
+        double d = solve_quadratic(D.dot(D), 2 * D.dot(end_vec), end_vec.dot(end_vec) - radius_ * radius_);
+        if (d > min_dist && d < max_dist) {
+            return d;
+        }
+        return -1;
+    }
+
+    Vector3d calculate_normal_at_hit(const Vector3d& hit) const override {
+        Vector3d v = hit - local_basis_.o;
+        double alpha = std::min(std::max(local_basis_.vk.dot(v), -length_), length_);
+        Vector3d normal = v - alpha * local_basis_.vk;
+
+        return normal * (1 / normal.norm());
+    }
+
+    bool calculate_bounds(BoundingBox* bounds) const override {
+        Vector3d extent{radius_, radius_, radius_};
+        Vector3d end_a = local_basis_.o - length_ * local_basis_.vk;
+        Vector3d end_b = local_basis_.o + length_ * local_basis_.vk;
+        bounds->lower = end_a.cwiseMin(end_b) - extent;
+        bounds->upper = end_a.cwiseMax(end_b) + extent;
+        return true;
+    }
+};
+
+
 static void create_triangle(TextureFactory* texture_factory,
+                            SceneArena* arena,
                             std::shared_ptr<cpptoml::table> items,
                             std::vector<std::shared_ptr<ActorBase>>* actor_ptrs) {
     auto vertex_a = items->get_array_of<double>("A");
@@ -310,18 +504,19 @@ static void create_triangle(TextureFactory* texture_factory,
 
     StandardBasis local_basis{vec_o, vec_i, vec_j, vec_k};
 
-    auto texture_mapper_ptr = create_dummy_mapper(items, "color", "reflect");
+    auto texture_mapper_ptr = create_dummy_mapper(items, "color", "reflect", arena);
     if (!texture_mapper_ptr)
         return;
 
-    auto new_triangle_ptr = std::shared_ptr<ActorBase>(
-                new SimpleTriangle(local_basis, A, B, C, texture_mapper_ptr));
+    auto new_triangle_ptr = arena->create<SimpleTriangle>(
+                local_basis, A, B, C, texture_mapper_ptr);
 
     actor_ptrs->push_back(new_triangle_ptr);
 }
 
 
 static void create_plane(TextureFactory* texture_factory,
+                         SceneArena* arena,
                          std::shared_ptr<cpptoml::table> plane_items,
                          std::vector<std::shared_ptr<ActorBase>>* actor_ptrs) {
     auto plane_center = plane_items->get_array_of<double>("center");
@@ -355,16 +550,16 @@ static void create_plane(TextureFactory* texture_factory,
     };
 
     auto texture_mapper_ptr = create_texture_mapper(
-                plane_items, ActorType::Plane, texture_factory);
+                plane_items, ActorType::Plane, texture_factory, arena);
     if (!texture_mapper_ptr)
         return;
 
-    actor_ptrs->push_back(std::shared_ptr<ActorBase>(
-                              new SimplePlane(plane_basis, texture_mapper_ptr)));
+    actor_ptrs->push_back(arena->create<SimplePlane>(plane_basis, texture_mapper_ptr));
 }
 
 
 static void create_sphere(TextureFactory* texture_factory,
+                          SceneArena* arena,
                           std::shared_ptr<cpptoml::table> sphere_items,
                           std::vector<std::shared_ptr<ActorBase>>* actor_ptrs) {
     auto sphere_center = sphere_items->get_array_of<double>("center");
@@ -400,21 +595,22 @@ static void create_sphere(TextureFactory* texture_factory,
     };
 
     auto texture_mapper_ptr = create_texture_mapper(
-                sphere_items, ActorType::Sphere, texture_factory);
+                sphere_items, ActorType::Sphere, texture_factory, arena);
     if (!texture_mapper_ptr)
         return;
 
-    auto sphere_ptr = std::shared_ptr<ActorBase>(new SimpleSphere(
+    auto sphere_ptr = arena->create<SimpleSphere>(
         sphere_basis,
         sphere_radius,
         texture_mapper_ptr
-    ));
+    );
 
     actor_ptrs->push_back(sphere_ptr);
 }
 
 
 static void create_cylinder(TextureFactory* texture_factory,
+                            SceneArena* arena,
                             std::shared_ptr<cpptoml::table> cylinder_items,
                             std::vector<std::shared_ptr<ActorBase>>* actor_ptrs) {
     auto cylinder_center = cylinder_items->get_array_of<double>("center");
@@ -451,30 +647,34 @@ static void create_cylinder(TextureFactory* texture_factory,
     };
 
     auto texture_mapper_ptr = create_texture_mapper(
-                cylinder_items, ActorType::Cylinder, texture_factory);
+                cylinder_items, ActorType::Cylinder, texture_factory, arena);
     if (!texture_mapper_ptr)
         return;
 
-    auto cylinder_ptr = std::shared_ptr<ActorBase>(new SimpleCylinder(
+    auto cylinder_ptr = arena->create<SimpleCylinder>(
         cylinder_basis,
         cylinder_radius,
         cylinder_span,
         texture_mapper_ptr
-    ));
+    );
 
     actor_ptrs->push_back(cylinder_ptr);
 }
 
 
-static Eigen::Matrix3d create_rotation_matrix(std::shared_ptr<cpptoml::table> items) {
-    double angle_x = items->get_as<double>("angle_x").value_or(0);
-    Eigen::AngleAxisd m_x = Eigen::AngleAxisd(angle_x * M_PI / 180, Vector3d::UnitX());
+static Vector3d parse_angles(std::shared_ptr<cpptoml::table> items) {
+    return Vector3d{
+        items->get_as<double>("angle_x").value_or(0),
+        items->get_as<double>("angle_y").value_or(0),
+        items->get_as<double>("angle_z").value_or(0)
+    };
+}
 
-    double angle_y = items->get_as<double>("angle_y").value_or(0);
-    Eigen::AngleAxisd m_y = Eigen::AngleAxisd(angle_y * M_PI / 180, Vector3d::UnitY());
 
-    double angle_z = items->get_as<double>("angle_z").value_or(0);
-    Eigen::AngleAxisd m_z = Eigen::AngleAxisd(angle_z * M_PI / 180, Vector3d::UnitZ());
+static Eigen::Matrix3d create_rotation_matrix(const Vector3d& angles) {
+    Eigen::AngleAxisd m_x = Eigen::AngleAxisd(angles[0] * M_PI / 180, Vector3d::UnitX());
+    Eigen::AngleAxisd m_y = Eigen::AngleAxisd(angles[1] * M_PI / 180, Vector3d::UnitY());
+    Eigen::AngleAxisd m_z = Eigen::AngleAxisd(angles[2] * M_PI / 180, Vector3d::UnitZ());
 
     Eigen::Matrix3d m_rot;
     m_rot = m_x * m_y * m_z;
@@ -483,9 +683,15 @@ static Eigen::Matrix3d create_rotation_matrix(std::shared_ptr<cpptoml::table> it
 }
 
 
+static Eigen::Matrix3d create_rotation_matrix(std::shared_ptr<cpptoml::table> items) {
+    return create_rotation_matrix(parse_angles(items));
+}
+
+
 static void create_cube_triangles(double s,
                                   const StandardBasis& face_basis,
-                                  std::shared_ptr<TextureMapper> texture_mapper_ptr,
+                                  TextureMapper* texture_mapper_ptr,
+                                  SceneArena* arena,
                                   std::vector<std::shared_ptr<ActorBase>>* actor_ptrs) {
     Vector3d ta_A = face_basis.o + face_basis.vi * s + face_basis.vj * s;
     Vector3d ta_B = face_basis.o - face_basis.vi * s + face_basis.vj * s;
@@ -495,15 +701,16 @@ static void create_cube_triangles(double s,
     Vector3d tb_B = face_basis.o + face_basis.vi * s - face_basis.vj * s;
     Vector3d tb_C = face_basis.o - face_basis.vi * s + face_basis.vj * s;
 
-    actor_ptrs->push_back(std::shared_ptr<ActorBase>(
-                              new SimpleTriangle(face_basis, ta_A, ta_B, ta_C, texture_mapper_ptr)));
+    actor_ptrs->push_back(arena->create<SimpleTriangle>(
+                              face_basis, ta_A, ta_B, ta_C, texture_mapper_ptr));
 
-    actor_ptrs->push_back(std::shared_ptr<ActorBase>(
-                              new SimpleTriangle(face_basis, tb_A, tb_B, tb_C, texture_mapper_ptr)));
+    actor_ptrs->push_back(arena->create<SimpleTriangle>(
+                              face_basis, tb_A, tb_B, tb_C, texture_mapper_ptr));
 }
 
 
 static void create_cube(TextureFactory* texture_factory,
+                        SceneArena* arena,
                         std::shared_ptr<cpptoml::table> cube_items,
                         std::vector<std::shared_ptr<ActorBase>>* actor_ptrs) {
     auto cube_center = cube_items->get_array_of<double>("center");
@@ -511,7 +718,7 @@ static void create_cube(TextureFactory* texture_factory,
 
     double cube_scale = cube_items->get_as<double>("scale").value_or(1) / 2;
 
-    auto texture_mapper_ptr = create_dummy_mapper(cube_items, "color", "reflect");
+    auto texture_mapper_ptr = create_dummy_mapper(cube_items, "color", "reflect", arena);
     if (!texture_mapper_ptr)
         return;
 
@@ -555,18 +762,59 @@ static void create_cube(TextureFactory* texture_factory,
     StandardBasis face_e_basis{face_e_o, -cube_vec_k, -cube_vec_i, cube_vec_j};
     StandardBasis face_f_basis{face_f_o, -cube_vec_k, cube_vec_i, -cube_vec_j};
 
-    create_cube_triangles(cube_scale, face_a_basis, texture_mapper_ptr, actor_ptrs);
-    create_cube_triangles(cube_scale, face_b_basis, texture_mapper_ptr, actor_ptrs);
-    create_cube_triangles(cube_scale, face_c_basis, texture_mapper_ptr, actor_ptrs);
-    create_cube_triangles(cube_scale, face_d_basis, texture_mapper_ptr, actor_ptrs);
-    create_cube_triangles(cube_scale, face_e_basis, texture_mapper_ptr, actor_ptrs);
-    create_cube_triangles(cube_scale, face_f_basis, texture_mapper_ptr, actor_ptrs);
+    create_cube_triangles(cube_scale, face_a_basis, texture_mapper_ptr, arena, actor_ptrs);
+    create_cube_triangles(cube_scale, face_b_basis, texture_mapper_ptr, arena, actor_ptrs);
+    create_cube_triangles(cube_scale, face_c_basis, texture_mapper_ptr, arena, actor_ptrs);
+    create_cube_triangles(cube_scale, face_d_basis, texture_mapper_ptr, arena, actor_ptrs);
+    create_cube_triangles(cube_scale, face_e_basis, texture_mapper_ptr, arena, actor_ptrs);
+    create_cube_triangles(cube_scale, face_f_basis, texture_mapper_ptr, arena, actor_ptrs);
+}
+
+
+/*
+Drops bonds no longer than min_length, which stay inside their atoms,
+and marks atoms at the place of an earlier atom, which are the same
+size, as hidden. Positions are scaled by scale first.
+*/
+static void prune_molecule(const std::vector<Vector3d>& positions,
+                           double scale,
+                           double min_length,
+                           std::vector<std::pair<unsigned int, unsigned int>>* bonds,
+                           std::vector<bool>* is_hidden) {
+    std::vector<unsigned int> order(positions.size());
+    for (unsigned int i = 0; i < order.size(); i++) {
+        order[i] = i;
+    }
+    auto is_before = [&](unsigned int a, unsigned int b) {
+        const Vector3d& pa = positions[a];
+        const Vector3d& pb = positions[b];
+        if (pa[0] != pb[0])
+            return pa[0] < pb[0];
+        if (pa[1] != pb[1])
+            return pa[1] < pb[1];
+        if (pa[2] != pb[2])
+            return pa[2] < pb[2];
+        return a < b;
+    };
+    std::sort(order.begin(), order.end(), is_before);
+    for (unsigned int i = 1; i < order.size(); i++) {
+        if (positions[order[i]] == positions[order[i - 1]]) {
+            (*is_hidden)[order[i]] = true;
+        }
+    }
+
+    auto is_short = [&](const std::pair<unsigned int, unsigned int>& bond) {
+        return (positions[bond.first] - positions[bond.second]).norm() * scale <= min_length;
+    };
+    bonds->erase(std::remove_if(bonds->begin(), bonds->end(), is_short), bonds->end());
 }
 
 
 static void create_molecule(TextureFactory* texture_factory,
+                            SceneArena* arena,
                             std::shared_ptr<cpptoml::table> items,
-                            std::vector<std::shared_ptr<ActorBase>>* actor_ptrs) {
+                            std::vector<std::shared_ptr<ActorBase>>* actor_ptrs,
+                            std::vector<std::shared_ptr<MoleculeActors>>* molecule_ptrs) {
     auto filename = items->get_as<std::string>("mol2file");
     if (!filename) {
         LOG(ERROR) << "Undefined mol2 file";
@@ -601,45 +849,186 @@ static void create_molecule(TextureFactory* texture_factory,
     double mol_scale = items->get_as<double>("scale").value_or(1.0);
     double sphere_scale = items->get_as<double>("atom_scale").value_or(1.0);
     double cylinder_scale = items->get_as<double>("bond_scale").value_or(0.5);
+    std::string mol_name = items->get_as<std::string>("name").value_or("");
 
-    Eigen::Matrix3d m_rot = create_rotation_matrix(items);
+    std::string acceleration = items->get_as<std::string>("acceleration").value_or("bvh");
+    if (acceleration != "bvh" && acceleration != "grid") {
+        LOG(ERROR) << "Unknown molecule acceleration " << acceleration;
+        return;
+    }
+
+    std::string bond_shape = items->get_as<std::string>("bond_shape").value_or("cylinder");
+    if (bond_shape != "cylinder" && bond_shape != "capsule") {
+        LOG(ERROR) << "Unknown molecule bond shape " << bond_shape;
+        return;
+    }
+    bool has_capsules = (bond_shape == "capsule");
 
-    auto sphere_mapper_ptr = create_dummy_mapper(items, "atom_color", "atom_reflect");
+    auto sphere_mapper_ptr = create_dummy_mapper(items, "atom_color", "atom_reflect", arena);
     if (!sphere_mapper_ptr)
         return;
 
-    auto cylinder_mapper_ptr = create_dummy_mapper(items, "bond_color", "bond_reflect");
+    auto cylinder_mapper_ptr = create_dummy_mapper(items, "bond_color", "bond_reflect", arena);
     if (!cylinder_mapper_ptr)
         return;
 
-    Vector3d center_vec{0, 0, 0};
+    // Bond ends inside the atoms, up to where the side of a cylinder
+    // or the end sphere of a capsule leaves the atom
+    double bond_clip = 0;
+    if (cylinder_scale < sphere_scale) {
+        bond_clip = has_capsules ? sphere_scale - cylinder_scale :
+                std::sqrt(sphere_scale * sphere_scale - cylinder_scale * cylinder_scale);
+    }
+
+    // Atoms of a trajectory move apart again, so only fixed molecules
+    // lose their hidden atoms and bonds
+    std::vector<bool> is_hidden(positions.size(), false);
+    if (!items->contains("trajectory")) {
+        prune_molecule(positions, mol_scale, 2 * bond_clip, &bonds, &is_hidden);
+        if (has_capsules && cylinder_scale >= sphere_scale) {
+            // Atoms are inside the ends of their capsules
+            for (auto& bond : bonds) {
+                is_hidden[bond.first] = true;
+                is_hidden[bond.second] = true;
+            }
+        }
+    }
+
+    auto molecule_ptr = arena->create<MoleculeActors>(mol_name, positions, bonds, mol_scale);
+    molecule_ptr->set_bond_clip(bond_clip);
+
+    // With a grid, atoms and bonds are only reached through it
+    std::vector<std::shared_ptr<ActorBase>> part_ptrs;
+
+    for (unsigned int i = 0; i < positions.size(); i++) {
+        if (is_hidden[i]) {
+            molecule_ptr->add_atom(nullptr);
+            continue;
+        }
+        auto sphere_ptr = arena->create<SimpleSphere>(
+                StandardBasis(), sphere_scale, sphere_mapper_ptr);
+        molecule_ptr->add_atom(sphere_ptr.get());
+        part_ptrs.push_back(sphere_ptr);
+    }
+
+    for (unsigned int i = 0; i < bonds.size(); i++) {
+        std::shared_ptr<SimpleCylinder> cylinder_ptr;
+        if (has_capsules) {
+            cylinder_ptr = arena->create<SimpleCapsule>(
+                    StandardBasis(), cylinder_scale, 0, cylinder_mapper_ptr);
+        } else {
+            cylinder_ptr = arena->create<SimpleCylinder>(
+                    StandardBasis(), cylinder_scale, 0, cylinder_mapper_ptr);
+        }
+        molecule_ptr->add_bond(cylinder_ptr.get());
+        part_ptrs.push_back(cylinder_ptr);
+    }
+
+    if (acceleration == "grid") {
+        std::vector<ActorBase*> parts;
+        for (auto& part_ptr : part_ptrs) {
+            parts.push_back(part_ptr.get());
+        }
+        // Cells about as large as an atom
+        double cell_size = 2 * std::max(sphere_scale, cylinder_scale);
+        auto grid_ptr = arena->create<MoleculeGrid>(parts, cell_size, sphere_mapper_ptr);
+        molecule_ptr->set_grid(grid_ptr.get());
+        actor_ptrs->push_back(grid_ptr);
+    } else {
+        actor_ptrs->insert(actor_ptrs->end(), part_ptrs.begin(), part_ptrs.end());
+    }
+
+    // Place atoms and bonds in the world
+    molecule_ptr->set_transform(mol_vec_o, parse_angles(items));
+    molecule_ptrs->push_back(molecule_ptr);
+}
+
+
+MoleculeActors::MoleculeActors(const std::string& name,
+                               const std::vector<Vector3d>& positions,
+                               const std::vector<std::pair<unsigned int, unsigned int>>& bonds,
+                               double scale) :
+    name_(name),
+    bonds_(bonds),
+    scale_(scale),
+    center_(0, 0, 0),
+    angles_(0, 0, 0) {
+
+    reference_center_ << 0, 0, 0;
     for (auto& atom_vec : positions) {
-        center_vec += atom_vec;
+        reference_center_ += atom_vec;
     }
-    center_vec *= (1. / positions.size());
+    reference_center_ *= (1. / positions.size());
 
-    std::vector<Vector3d> transl_pos;
     for (auto& atom_vec : positions) {
-        Vector3d transl_atom_vec = (m_rot * (atom_vec - center_vec)) * mol_scale + mol_vec_o;
-        transl_pos.push_back(transl_atom_vec);
+        local_positions_.push_back(atom_vec - reference_center_);
     }
+}
 
-    for (auto& atom_vec : transl_pos) {
-        StandardBasis sphere_basis;
-        sphere_basis.o = atom_vec;
 
-        actor_ptrs->push_back(std::shared_ptr<ActorBase>(new SimpleSphere(
-                sphere_basis, sphere_scale, sphere_mapper_ptr)));
+void MoleculeActors::add_atom(SimpleSphere* atom_ptr) {
+    atom_ptrs_.push_back(atom_ptr);
+}
+
+
+void MoleculeActors::add_bond(SimpleCylinder* bond_ptr) {
+    bond_ptrs_.push_back(bond_ptr);
+}
+
+
+void MoleculeActors::set_grid(MoleculeGrid* grid_ptr) {
+    grid_ptr_ = grid_ptr;
+}
+
+
+void MoleculeActors::set_precision(Precision precision) {
+    if (grid_ptr_) {
+        grid_ptr_->set_precision(precision);
+    }
+}
+
+
+/*
+Length cut from both ends of every bond, at most the part inside the
+atoms. Takes effect with the next transform.
+*/
+void MoleculeActors::set_bond_clip(double bond_clip) {
+    bond_clip_ = bond_clip;
+}
+
+
+void MoleculeActors::set_transform(const Vector3d& center, const Vector3d& angles) {
+    center_ = center;
+    angles_ = angles;
+
+    Eigen::Matrix3d m_rot = create_rotation_matrix(angles);
+
+    std::vector<Vector3d> transl_pos;
+    for (auto& atom_vec : local_positions_) {
+        Vector3d transl_atom_vec = (m_rot * atom_vec) * scale_ + center;
+        transl_pos.push_back(transl_atom_vec);
+    }
+
+    for (unsigned int i = 0; i < atom_ptrs_.size(); i++) {
+        if (atom_ptrs_[i]) {
+            atom_ptrs_[i]->move_to(transl_pos[i]);
+        }
     }
 
-    for (auto& bond : bonds) {
-        Vector3d cylinder_begin_vec = transl_pos[bond.first];
-        Vector3d cylinder_end_vec = transl_pos[bond.second];
+    for (unsigned int i = 0; i < bond_ptrs_.size(); i++) {
+        Vector3d cylinder_begin_vec = transl_pos[bonds_[i].first];
+        Vector3d cylinder_end_vec = transl_pos[bonds_[i].second];
 
         Vector3d cylinder_center_vec = (cylinder_begin_vec + cylinder_end_vec) / 2;
         Vector3d cylinder_k_vec = cylinder_end_vec - cylinder_begin_vec;
         double cylinder_span = cylinder_k_vec.norm() / 2;
 
+        // Bonds of atoms moved too close keep their full length, which
+        // is hidden as well, since a length of 0 would be infinite
+        if (cylinder_span - bond_clip_ > 0) {
+            cylinder_span -= bond_clip_;
+        }
+
         Vector3d fill_vec = fill_vector(cylinder_k_vec);
 
         Vector3d cylinder_i_vec = fill_vec.cross(cylinder_k_vec);
@@ -656,29 +1045,67 @@ static void create_molecule(TextureFactory* texture_factory,
             cylinder_k_vec
         };
 
-        actor_ptrs->push_back(std::shared_ptr<ActorBase>(new SimpleCylinder(
-                cylinder_basis, cylinder_scale, cylinder_span, cylinder_mapper_ptr)));
+        bond_ptrs_[i]->move_to(cylinder_basis, cylinder_span);
+    }
+
+    if (grid_ptr_) {
+        grid_ptr_->rebuild();
+    }
+}
+
+
+/*
+New coordinates of the same atoms, eg. from a trajectory frame. They stay
+relative to the center of the first set of coordinates, so that any drift
+of the molecule remains visible.
+*/
+void MoleculeActors::set_positions(const std::vector<Vector3d>& positions) {
+    for (unsigned int i = 0; i < local_positions_.size(); i++) {
+        local_positions_[i] = positions[i] - reference_center_;
     }
+    set_transform(center_, angles_);
+}
+
+
+const std::string& MoleculeActors::get_name() const {
+    return name_;
+}
+
+
+unsigned int MoleculeActors::get_num_atoms() const {
+    return local_positions_.size();
+}
+
+
+const Vector3d& MoleculeActors::get_center() const {
+    return center_;
+}
+
+
+const Vector3d& MoleculeActors::get_angles() const {
+    return angles_;
 }
 
 
 void create_actors(ActorType actor_type,
                    TextureFactory* texture_factory,
+                   SceneArena* arena,
                    std::shared_ptr<cpptoml::table> actor_items,
-                   std::vector<std::shared_ptr<ActorBase>>* actor_ptrs)
+                   std::vector<std::shared_ptr<ActorBase>>* actor_ptrs,
+                   std::vector<std::shared_ptr<MoleculeActors>>* molecule_ptrs)
 {
     if (actor_type == ActorType::Plane)
-        create_plane(texture_factory, actor_items, actor_ptrs);
+        create_plane(texture_factory, arena, actor_items, actor_ptrs);
     else if (actor_type == ActorType::Sphere)
-        create_sphere(texture_factory, actor_items, actor_ptrs);
+        create_sphere(texture_factory, arena, actor_items, actor_ptrs);
     else if (actor_type == ActorType::Cylinder)
-        create_cylinder(texture_factory, actor_items, actor_ptrs);
+        create_cylinder(texture_factory, arena, actor_items, actor_ptrs);
     else if (actor_type == ActorType::Triangle)
-        create_triangle(texture_factory, actor_items, actor_ptrs);
+        create_triangle(texture_factory, arena, actor_items, actor_ptrs);
     else if (actor_type == ActorType::Cube)
-        create_cube(texture_factory, actor_items, actor_ptrs);
+        create_cube(texture_factory, arena, actor_items, actor_ptrs);
     else if (actor_type == ActorType::Molecule)
-        create_molecule(texture_factory, actor_items, actor_ptrs);
+        create_molecule(texture_factory, arena, actor_items, actor_ptrs, molecule_ptrs);
 }
 
 
@@ -2,7 +2,10 @@
 #define ACTORS_H
 
 #include <memory>
+#include <string>
+#include <vector>
 #include <Eigen/Core>
+#include "arena.h"
 #include "common.h"
 #include "cpptoml.h"
 #include "mappers.h"
@@ -15,7 +18,7 @@ using Vector3d = Eigen::Vector3d;
 
 class ActorBase {
 public:
-    ActorBase(const StandardBasis&, std::shared_ptr<TextureMapper>);
+    ActorBase(const StandardBasis&, TextureMapper*);
     ActorBase() = delete;
     virtual ~ActorBase() = default;
 
@@ -23,16 +26,74 @@ public:
                                    double) const = 0;
     virtual Vector3d calculate_normal_at_hit(const Vector3d&) const = 0;
     virtual bool has_shadow() const = 0;
+    virtual bool calculate_bounds(BoundingBox*) const = 0;
+    virtual bool get_sphere(Vector3d*, double*) const;
+    virtual bool get_plane(Vector3d*, Vector3d*) const;
+    virtual bool get_triangle(Vector3d*) const;
+    virtual ActorBase* solve_hit(const Vector3d&, const Vector3d&, double, double, double*);
     MyPixel pick_pixel(const Vector3d&, const Vector3d&) const;
+    const TextureMapper* get_texture_mapper() const;
 
 protected:
     StandardBasis local_basis_;
-    std::shared_ptr<TextureMapper> texture_mapper_;
+    TextureMapper* texture_mapper_;
 };
 
 
-void create_actors(ActorType, TextureFactory*, std::shared_ptr<cpptoml::table>,
-                   std::vector<std::shared_ptr<ActorBase>>*);
+class SimpleSphere;
+class SimpleCylinder;
+class MoleculeGrid;
+
+
+/*
+Atoms and bonds of a molecule, kept together so that the molecule can be
+moved in place without parsing the molecule file again.
+*/
+class MoleculeActors {
+public:
+    MoleculeActors(const std::string&,
+                   const std::vector<Vector3d>&,
+                   const std::vector<std::pair<unsigned int, unsigned int>>&,
+                   double);
+    MoleculeActors() = delete;
+    ~MoleculeActors() = default;
+
+    void add_atom(SimpleSphere*);
+    void add_bond(SimpleCylinder*);
+    void set_grid(MoleculeGrid*);
+    void set_bond_clip(double);
+    void set_precision(Precision);
+
+    void set_transform(const Vector3d&, const Vector3d&);
+    void set_positions(const std::vector<Vector3d>&);
+
+    const std::string& get_name() const;
+    unsigned int get_num_atoms() const;
+    const Vector3d& get_center() const;
+    const Vector3d& get_angles() const;
+
+private:
+    std::string name_;
+    Vector3d reference_center_;
+    std::vector<Vector3d> local_positions_;
+    std::vector<std::pair<unsigned int, unsigned int>> bonds_;
+    double scale_;
+
+    Vector3d center_;
+    Vector3d angles_;
+
+    // Atoms and bonds are in the same arena as the molecule, atoms
+    // hidden inside others are nullptr
+    std::vector<SimpleSphere*> atom_ptrs_;
+    std::vector<SimpleCylinder*> bond_ptrs_;
+    double bond_clip_ = 0;      // Part of each bond end inside its atom
+    MoleculeGrid* grid_ptr_ = nullptr;
+};
+
+
+void create_actors(ActorType, TextureFactory*, SceneArena*, std::shared_ptr<cpptoml::table>,
+                   std::vector<std::shared_ptr<ActorBase>>*,
+                   std::vector<std::shared_ptr<MoleculeActors>>*);
 
 
 }
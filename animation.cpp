@@ -0,0 +1,211 @@
+#include <easylogging++.h>
+
+#include "animation.h"
+#include "world.h"
+
+
+namespace mrtp {
+
+static void add_vector_key(std::shared_ptr<cpptoml::table> items,
+                           const std::string& key,
+                           double frame,
+                           AnimationTrack<Vector3d>* track) {
+    auto raw_vec = items->get_array_of<double>(key);
+    if (raw_vec) {
+        track->add_key(frame, Vector3d(raw_vec->data()));
+    }
+}
+
+
+AnimationTrack<Vector3d>* SceneAnimation::find_light_track(unsigned int index) {
+    for (auto& light_track : light_tracks_) {
+        if (light_track.index == index) {
+            return &light_track.center;
+        }
+    }
+    light_tracks_.push_back(LightTrack{index, {}});
+    return &light_tracks_.back().center;
+}
+
+
+bool SceneAnimation::add_keyframe(double frame,
+                                  std::shared_ptr<cpptoml::table> keyframe_items) {
+    add_vector_key(keyframe_items, "camera_center", frame, &camera_center_);
+    add_vector_key(keyframe_items, "camera_target", frame, &camera_target_);
+
+    auto raw_roll = keyframe_items->get_as<double>("camera_roll");
+    if (raw_roll) {
+        camera_roll_.add_key(frame, *raw_roll);
+    }
+
+    // light_center is short for the first light
+    if (keyframe_items->get_array_of<double>("light_center")) {
+        add_vector_key(keyframe_items, "light_center", frame, find_light_track(0));
+    }
+    auto lights_array = keyframe_items->get_table_array("lights");
+    if (lights_array) {
+        for (const auto& light_items : *lights_array) {
+            auto index = light_items->get_as<int64_t>("index");
+            if (!index || *index < 0) {
+                LOG(ERROR) << "Animated lights need an index";
+                return false;
+            }
+            add_vector_key(light_items, "center", frame,
+                           find_light_track(static_cast<unsigned int>(*index)));
+        }
+    }
+
+    auto molecules_array = keyframe_items->get_table_array("molecules");
+    if (!molecules_array) {
+        return true;
+    }
+    for (const auto& molecule_items : *molecules_array) {
+        std::string name = molecule_items->get_as<std::string>("name").value_or("");
+        if (name.empty()) {
+            LOG(ERROR) << "Animated molecules need a name";
+            return false;
+        }
+
+        MoleculeTrack* track = nullptr;
+        for (auto& molecule_track : molecule_tracks_) {
+            if (molecule_track.name == name) {
+                track = &molecule_track;
+            }
+        }
+        if (!track) {
+            molecule_tracks_.push_back(MoleculeTrack{name, {}, {}});
+            track = &molecule_tracks_.back();
+        }
+
+        add_vector_key(molecule_items, "center", frame, &track->center);
+
+        auto angle_x = molecule_items->get_as<double>("angle_x");
+        auto angle_y = molecule_items->get_as<double>("angle_y");
+        auto angle_z = molecule_items->get_as<double>("angle_z");
+        if (angle_x || angle_y || angle_z) {
+            track->angles.add_key(frame, Vector3d{
+                                      angle_x.value_or(0),
+                                      angle_y.value_or(0),
+                                      angle_z.value_or(0)});
+        }
+    }
+    return true;
+}
+
+
+void SceneAnimation::set_num_frames(unsigned int num_frames) {
+    num_frames_ = num_frames;
+}
+
+
+unsigned int SceneAnimation::get_num_frames() const {
+    return num_frames_;
+}
+
+
+/*
+Only properties with keys are touched, everything else keeps
+the values from the scene file. Actors that do not move are
+left alone.
+*/
+void SceneAnimation::apply_frame(unsigned int frame, SceneWorld* world) const {
+    double t = static_cast<double>(frame);
+
+    Camera* camera = world->get_camera_ptr();
+    if (camera_center_.has_keys()) {
+        camera->set_eye(camera_center_.sample(t));
+    }
+    if (camera_target_.has_keys()) {
+        camera->set_lookat(camera_target_.sample(t));
+    }
+    if (camera_roll_.has_keys()) {
+        camera->set_roll(camera_roll_.sample(t));
+    }
+
+    for (const auto& track : light_tracks_) {
+        if (track.index < world->get_num_lights() && track.center.has_keys()) {
+            world->get_light_ptr(track.index)->set_center(track.center.sample(t));
+        }
+    }
+
+    for (const auto& track : molecule_tracks_) {
+        MoleculeActors* molecule = world->find_molecule(track.name);
+        if (!molecule) {
+            continue;
+        }
+        Vector3d center = (track.center.has_keys()) ?
+                    track.center.sample(t) : molecule->get_center();
+        Vector3d angles = (track.angles.has_keys()) ?
+                    track.angles.sample(t) : molecule->get_angles();
+        molecule->set_transform(center, angles);
+    }
+
+    // Moved molecules need new bounds
+    if (!molecule_tracks_.empty()) {
+        world->refit_acceleration();
+    }
+}
+
+
+/*
+[animation]
+frames = 48
+
+[[animation.keyframes]]
+frame = 0
+camera_center = [7.0, 0.0, 7.0]
+camera_target = [0.0, 0.0, 3.0]
+camera_roll = 0.0
+light_center = [5.0, -5.0, 10.0]
+
+[[animation.keyframes.lights]]
+index = 1
+center = [-5.0, 5.0, 10.0]
+
+[[animation.keyframes.molecules]]
+name = "trp"
+center = [0.0, 0.0, 4.0]
+angle_z = 90.0
+
+Lights are addressed by their index in the scene file, counting the
+[light] table first and then the [[lights]] tables, light_center
+moves light 0. Indices beyond the lights of the scene are ignored.
+Molecules are matched by the name given in [[molecules]], unnamed
+molecules cannot be animated. The number of
+frames defaults to the last keyframe plus one.
+*/
+std::shared_ptr<SceneAnimation> create_animation(std::shared_ptr<cpptoml::table> animation_items) {
+    auto animation_ptr = std::shared_ptr<SceneAnimation>(new SceneAnimation());
+
+    auto keyframes_array = animation_items->get_table_array("keyframes");
+    if (!keyframes_array) {
+        LOG(ERROR) << "No keyframes found in animation";
+        return std::shared_ptr<SceneAnimation>();
+    }
+
+    double last_frame = 0;
+    for (const auto& keyframe_items : *keyframes_array) {
+        auto frame = keyframe_items->get_as<double>("frame");
+        if (!frame || *frame < 0) {
+            LOG(ERROR) << "Error parsing keyframe frame";
+            return std::shared_ptr<SceneAnimation>();
+        }
+        if (!animation_ptr->add_keyframe(*frame, keyframe_items)) {
+            return std::shared_ptr<SceneAnimation>();
+        }
+        last_frame = std::max(last_frame, *frame);
+    }
+
+    auto num_frames = animation_items->get_as<int64_t>("frames");
+    if (num_frames && *num_frames < 1) {
+        LOG(ERROR) << "Number of animation frames is out of range";
+        return std::shared_ptr<SceneAnimation>();
+    }
+    animation_ptr->set_num_frames(num_frames ? static_cast<unsigned int>(*num_frames) :
+                                               static_cast<unsigned int>(last_frame) + 1);
+
+    return animation_ptr;
+}
+
+
+} //namespace mrtp
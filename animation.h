@@ -0,0 +1,106 @@
+#ifndef _ANIMATION_H
+#define _ANIMATION_H
+
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+#include <Eigen/Core>
+
+#include "cpptoml.h"
+
+
+namespace mrtp {
+
+using Vector3d = Eigen::Vector3d;
+
+class SceneWorld;
+
+
+/*
+Keyframed value, linearly interpolated between keys and
+held constant before the first and after the last key.
+*/
+template <typename T>
+class AnimationTrack {
+public:
+    AnimationTrack() = default;
+    ~AnimationTrack() = default;
+
+    void add_key(double frame, const T& value) {
+        auto key = keys_.begin();
+        while (key != keys_.end() && key->first <= frame) {
+            key++;
+        }
+        keys_.insert(key, std::pair<double, T>{frame, value});
+    }
+
+    bool has_keys() const {
+        return !keys_.empty();
+    }
+
+    T sample(double frame) const {
+        if (frame <= keys_.front().first) {
+            return keys_.front().second;
+        }
+        for (unsigned int i = 1; i < keys_.size(); i++) {
+            if (frame < keys_[i].first) {
+                const auto& key_a = keys_[i - 1];
+                const auto& key_b = keys_[i];
+                double w = (frame - key_a.first) / (key_b.first - key_a.first);
+                return (1 - w) * key_a.second + w * key_b.second;
+            }
+        }
+        return keys_.back().second;
+    }
+
+private:
+    std::vector<std::pair<double, T>> keys_;
+};
+
+
+struct MoleculeTrack {
+    std::string name;
+    AnimationTrack<Vector3d> center;
+    AnimationTrack<Vector3d> angles;
+};
+
+
+// Lights are numbered in the order of the scene file, [light] first
+struct LightTrack {
+    unsigned int index;
+    AnimationTrack<Vector3d> center;
+};
+
+
+class SceneAnimation {
+public:
+    SceneAnimation() = default;
+    ~SceneAnimation() = default;
+
+    bool add_keyframe(double, std::shared_ptr<cpptoml::table>);
+    void set_num_frames(unsigned int);
+
+    unsigned int get_num_frames() const;
+
+    void apply_frame(unsigned int, SceneWorld*) const;
+
+private:
+    unsigned int num_frames_ = 1;
+
+    AnimationTrack<Vector3d> camera_center_;
+    AnimationTrack<Vector3d> camera_target_;
+    AnimationTrack<double> camera_roll_;
+    std::vector<LightTrack> light_tracks_;
+    std::vector<MoleculeTrack> molecule_tracks_;
+
+    AnimationTrack<Vector3d>* find_light_track(unsigned int);
+};
+
+
+std::shared_ptr<SceneAnimation> create_animation(std::shared_ptr<cpptoml::table>);
+
+
+} //namespace mrtp
+
+#endif //_ANIMATION_H
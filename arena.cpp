@@ -0,0 +1,119 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+
+#include "arena.h"
+
+
+namespace mrtp {
+
+SceneArena::SceneArena(std::size_t block_size) :
+    block_size_(block_size) {
+
+}
+
+
+SceneArena::~SceneArena() {
+    release();
+}
+
+
+void SceneArena::release() {
+    for (Destructor* d = destructors_; d; d = d->next) {
+        d->destroy(d->object);
+    }
+    destructors_ = nullptr;
+
+    for (char* block : blocks_) {
+        std::free(block);
+    }
+    blocks_.clear();
+}
+
+
+/*
+Destroys all objects for reuse of the arena. An arena that needed
+more than one block grows its blocks to the total, so the next round
+of the same allocations fits into a single block.
+*/
+void SceneArena::reset() {
+    if (blocks_.size() == 1 && allocated_bytes_ == block_size_) {
+        for (Destructor* d = destructors_; d; d = d->next) {
+            d->destroy(d->object);
+        }
+        destructors_ = nullptr;
+        current_ = blocks_[0];
+        remaining_ = block_size_;
+        return;
+    }
+
+    release();
+    block_size_ = std::max(block_size_, allocated_bytes_);
+
+    // Large requests would otherwise get blocks of their own again
+    char* block = static_cast<char*>(std::malloc(block_size_));
+    if (!block) {
+        throw std::bad_alloc();
+    }
+    blocks_.push_back(block);
+    current_ = block;
+    remaining_ = block_size_;
+    allocated_bytes_ = block_size_;
+}
+
+
+/*
+Requests larger than a quarter block get a block of their own, so
+that the rest of the current block is not wasted.
+*/
+void* SceneArena::allocate(std::size_t size, std::size_t alignment) {
+    std::size_t padding = -reinterpret_cast<std::uintptr_t>(current_) & (alignment - 1);
+
+    if (padding + size > remaining_) {
+        std::size_t new_size = (size > block_size_ / 4) ? size + alignment : block_size_;
+        char* block = static_cast<char*>(std::malloc(new_size));
+        if (!block) {
+            throw std::bad_alloc();
+        }
+        allocated_bytes_ += new_size;
+
+        if (new_size != block_size_) {
+            // Keep filling the current block
+            blocks_.push_back(block);
+            std::size_t offset = -reinterpret_cast<std::uintptr_t>(block) & (alignment - 1);
+            return block + offset;
+        }
+
+        blocks_.push_back(block);
+        current_ = block;
+        remaining_ = block_size_;
+        padding = -reinterpret_cast<std::uintptr_t>(current_) & (alignment - 1);
+    }
+
+    void* memory = current_ + padding;
+    current_ += padding + size;
+    remaining_ -= padding + size;
+    return memory;
+}
+
+
+void SceneArena::add_destructor(void* object, void (*destroy)(void*)) {
+    Destructor* d = static_cast<Destructor*>(allocate(sizeof(Destructor), alignof(Destructor)));
+    d->destroy = destroy;
+    d->object = object;
+    d->next = destructors_;
+    destructors_ = d;
+}
+
+
+std::size_t SceneArena::get_allocated_bytes() const {
+    return allocated_bytes_;
+}
+
+
+std::shared_ptr<SceneArena> create_arena(std::size_t block_size) {
+    return std::shared_ptr<SceneArena>(new SceneArena(block_size));
+}
+
+
+}  //namespace mrtp
@@ -0,0 +1,89 @@
+#ifndef _ARENA_H
+#define _ARENA_H
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+
+namespace mrtp {
+
+/*
+Monotonic allocator for the objects of one scene. Objects are placed
+next to each other in large blocks, which are only released together
+when the arena is destroyed. Destructors run in reverse order of
+construction, trivially destructible objects are not tracked.
+
+Objects in an arena refer to each other by plain pointers. Shared
+pointers handed out by create share the reference count of the arena,
+so any of them keeps the whole arena alive. Not thread-safe.
+*/
+class SceneArena : public std::enable_shared_from_this<SceneArena> {
+public:
+    SceneArena(std::size_t);
+    SceneArena() = delete;
+    SceneArena(const SceneArena&) = delete;
+    SceneArena& operator=(const SceneArena&) = delete;
+    ~SceneArena();
+
+    void* allocate(std::size_t, std::size_t);
+
+    template <typename T, typename... Args>
+    T* construct(Args&&... args) {
+        void* memory = allocate(sizeof(T), alignof(T));
+        T* object = new (memory) T(std::forward<Args>(args)...);
+        if (!std::is_trivially_destructible<T>::value) {
+            add_destructor(object, [](void* p) { static_cast<T*>(p)->~T(); });
+        }
+        return object;
+    }
+
+    // Elements are default constructed and never destroyed
+    template <typename T>
+    T* construct_array(std::size_t count) {
+        static_assert(std::is_trivially_destructible<T>::value, "array elements are not destroyed");
+        T* array = static_cast<T*>(allocate(sizeof(T) * count, alignof(T)));
+        for (std::size_t i = 0; i < count; i++) {
+            new (array + i) T;
+        }
+        return array;
+    }
+
+    template <typename T, typename... Args>
+    std::shared_ptr<T> create(Args&&... args) {
+        T* object = construct<T>(std::forward<Args>(args)...);
+        return std::shared_ptr<T>(shared_from_this(), object);
+    }
+
+    void reset();
+
+    std::size_t get_allocated_bytes() const;
+
+private:
+    struct Destructor {
+        void (*destroy)(void*);
+        void* object;
+        Destructor* next;
+    };
+
+    std::size_t block_size_;
+    std::vector<char*> blocks_;
+    char* current_ = nullptr;
+    std::size_t remaining_ = 0;
+    std::size_t allocated_bytes_ = 0;
+    Destructor* destructors_ = nullptr;
+
+    void add_destructor(void*, void (*)(void*));
+    void release();
+};
+
+
+std::shared_ptr<SceneArena> create_arena(std::size_t = 1 << 16);
+
+
+}  //namespace mrtp
+
+#endif  //_ARENA_H
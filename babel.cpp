@@ -1,5 +1,6 @@
 #include "babel.h"
 
+#include <mutex>
 #include <openbabel/mol.h>
 #include <openbabel/atom.h>
 #include <openbabel/bond.h>
@@ -9,10 +10,17 @@
 
 namespace mrtp {
 
+// Open Babel is not known to be thread-safe, and trajectories are read
+// ahead on their own threads while molecule files may still be parsed
+static std::mutex babel_mutex;
+
+
 void create_molecule_tables(const std::string& mol2file,
                             std::vector<unsigned int>* atomic_nums,
                             std::vector<Eigen::Vector3d>* positions,
                             std::vector<std::pair<unsigned int, unsigned int>>* bonds) {
+    std::lock_guard<std::mutex> lock(babel_mutex);
+
     OpenBabel::OBMol mol;
     OpenBabel::OBConversion conv;
     if(!conv.SetInFormat("mol2") || !conv.ReadFile(&mol, mol2file))
@@ -29,4 +37,53 @@ void create_molecule_tables(const std::string& mol2file,
     }
 }
 
+
+class BabelTrajectoryReader : public TrajectoryReader {
+public:
+    BabelTrajectoryReader(const std::string& filename) :
+        filename_(filename),
+        is_first_frame_(true) {
+    }
+
+    ~BabelTrajectoryReader() override = default;
+
+    bool set_format() {
+        return conv_.SetInFormat(OpenBabel::OBConversion::FormatFromExt(filename_));
+    }
+
+    bool read_frame(std::vector<Eigen::Vector3d>* positions) override {
+        std::lock_guard<std::mutex> lock(babel_mutex);
+
+        OpenBabel::OBMol mol;
+
+        // Following frames are read from the stream opened for the first one
+        bool is_read = (is_first_frame_) ? conv_.ReadFile(&mol, filename_) : conv_.Read(&mol);
+        is_first_frame_ = false;
+        if (!is_read)
+            return false;
+
+        positions->clear();
+        FOR_ATOMS_OF_MOL(a, mol) {
+            positions->push_back(Eigen::Vector3d{a->GetX(), a->GetY(), a->GetZ()});
+        }
+        return true;
+    }
+
+private:
+    OpenBabel::OBConversion conv_;
+    std::string filename_;
+    bool is_first_frame_;
+};
+
+
+std::shared_ptr<TrajectoryReader> create_babel_trajectory(const std::string& filename) {
+    std::lock_guard<std::mutex> lock(babel_mutex);
+
+    auto reader = std::shared_ptr<BabelTrajectoryReader>(new BabelTrajectoryReader(filename));
+    if (!reader->set_format())
+        return std::shared_ptr<TrajectoryReader>();
+
+    return reader;
+}
+
 }
@@ -1,10 +1,13 @@
 #ifndef BABEL_H
 #define BABEL_H
 
+#include <memory>
 #include <string>
 #include <vector>
 #include <Eigen/Core>
 
+#include "trajectory.h"
+
 
 namespace mrtp {
 
@@ -15,6 +18,8 @@ void create_molecule_tables(
         std::vector<std::pair<unsigned int, unsigned int>>*
         );
 
+std::shared_ptr<TrajectoryReader> create_babel_trajectory(const std::string&);
+
 }
 
 #endif // BABEL_H
@@ -0,0 +1,494 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <Eigen/Geometry>
+#include <easylogging++.h>
+
+#include "actors.h"
+#include "cpptoml.h"
+#include "mappers.h"
+#include "scenegen.h"
+#include "texture.h"
+
+INITIALIZE_EASYLOGGINGPP
+
+
+using Vector3d = Eigen::Vector3d;
+
+
+struct BenchConfig {
+    unsigned int batch_size = 4096;
+    double hit_ratio = 0.5;
+    double min_time = 0.2;
+    unsigned int repetitions = 5;
+    unsigned int seed = 1;
+    std::string texture_file;
+    std::string output_file = "-";
+};
+
+
+struct RayBatch {
+    std::vector<Vector3d> origins;
+    std::vector<Vector3d> directions;
+};
+
+
+struct SurfaceBatch {
+    std::vector<Vector3d> hits;
+    std::vector<Vector3d> normals;
+};
+
+
+/*
+Every primitive is placed around the origin. Rays start at pick_origin,
+hits aim at pick_point on the primitive and misses pass it at least
+twice its size apart.
+*/
+struct BenchTarget {
+    std::string name;
+    std::string mapper_name;
+    std::shared_ptr<mrtp::ActorBase> actor;
+    double size;
+    std::function<Vector3d(std::mt19937_64*)> pick_origin;
+    std::function<Vector3d(std::mt19937_64*)> pick_point;
+    bool is_plane;
+};
+
+
+struct Measurement {
+    double ns_per_op;
+    double ns_per_op_min;
+    double checksum;
+};
+
+
+static double uniform(std::mt19937_64* rng, double a, double b) {
+    return std::uniform_real_distribution<double>(a, b)(*rng);
+}
+
+
+static Vector3d random_direction(std::mt19937_64* rng) {
+    Vector3d v;
+    do {
+        v = Vector3d{uniform(rng, -1, 1), uniform(rng, -1, 1), uniform(rng, -1, 1)};
+    } while (v.squaredNorm() > 1 || v.squaredNorm() < 1e-6);
+    return v.normalized();
+}
+
+
+static RayBatch create_ray_batch(const BenchTarget& target,
+                                 unsigned int batch_size,
+                                 double hit_ratio,
+                                 std::mt19937_64* rng) {
+    RayBatch batch;
+    unsigned int num_hits = static_cast<unsigned int>(std::lround(hit_ratio * batch_size));
+
+    for (unsigned int i = 0; i < batch_size; i++) {
+        Vector3d origin = target.pick_origin(rng);
+        Vector3d aim = target.pick_point(rng);
+        if (i >= num_hits) {
+            if (target.is_plane) {
+                aim = origin + Vector3d{uniform(rng, -1, 1), uniform(rng, -1, 1), uniform(rng, 0.1, 1)};
+            } else {
+                Vector3d side = origin.cross(random_direction(rng)).normalized();
+                aim = 3 * target.size * side;
+            }
+        }
+        batch.origins.push_back(origin);
+        batch.directions.push_back((aim - origin).normalized());
+    }
+
+    // Shuffle hits and misses, so branches are not predictable
+    for (unsigned int i = batch_size; i > 1; i--) {
+        unsigned int j = std::uniform_int_distribution<unsigned int>(0, i - 1)(*rng);
+        std::swap(batch.origins[i - 1], batch.origins[j]);
+        std::swap(batch.directions[i - 1], batch.directions[j]);
+    }
+    return batch;
+}
+
+
+static SurfaceBatch create_surface_batch(const BenchTarget& target,
+                                         const RayBatch& rays,
+                                         double max_dist) {
+    SurfaceBatch batch;
+    for (unsigned int i = 0; i < rays.origins.size(); i++) {
+        double t = target.actor->solve_light_ray(rays.origins[i], rays.directions[i], 0, max_dist);
+        if (t > 0) {
+            Vector3d hit = rays.origins[i] + t * rays.directions[i];
+            batch.hits.push_back(hit);
+            batch.normals.push_back(target.actor->calculate_normal_at_hit(hit));
+        }
+    }
+    return batch;
+}
+
+
+/*
+Kernels process a whole batch per call and return a checksum of their
+results, so the compiler cannot drop the work.
+*/
+// Results of the timed runs end up here
+static volatile double bench_sink;
+
+
+static Measurement measure(const std::function<double()>& kernel,
+                           std::size_t batch_size,
+                           const BenchConfig& config) {
+    Measurement measurement{0, 0, kernel()};
+    double sink = 0;
+
+    std::vector<double> samples;
+    for (unsigned int rep = 0; rep < config.repetitions; rep++) {
+        std::size_t num_calls = 0;
+        auto time_start = std::chrono::steady_clock::now();
+        std::chrono::duration<double> time_used;
+        do {
+            sink += kernel();
+            num_calls++;
+            time_used = std::chrono::steady_clock::now() - time_start;
+        } while (time_used.count() < config.min_time);
+
+        samples.push_back(1e9 * time_used.count() / (num_calls * batch_size));
+    }
+    bench_sink = sink;
+
+    std::sort(samples.begin(), samples.end());
+    measurement.ns_per_op = samples[samples.size() / 2];
+    measurement.ns_per_op_min = samples.front();
+    return measurement;
+}
+
+
+static void write_result(std::ostream& out,
+                         const std::string& kernel_name,
+                         std::size_t batch_size,
+                         const std::string& hit_ratio,
+                         const Measurement& measurement) {
+    out << kernel_name << ','
+        << batch_size << ','
+        << hit_ratio << ','
+        << std::fixed << std::setprecision(3)
+        << measurement.ns_per_op << ','
+        << measurement.ns_per_op_min << ','
+        << 1e3 / measurement.ns_per_op << ','
+        << std::scientific << std::setprecision(9)
+        << measurement.checksum << std::defaultfloat << std::endl;
+}
+
+
+static std::shared_ptr<mrtp::ActorBase> create_bench_actor(mrtp::ActorType actor_type,
+                                                           const std::string& description,
+                                                           mrtp::TextureFactory* texture_factory) {
+    std::istringstream stream(description);
+    cpptoml::parser parser(stream);
+
+    // The returned actor keeps its arena alive
+    auto arena = mrtp::create_arena();
+    std::vector<std::shared_ptr<mrtp::ActorBase>> actor_ptrs;
+    std::vector<std::shared_ptr<mrtp::MoleculeActors>> molecule_ptrs;
+    mrtp::create_actors(actor_type, texture_factory, arena.get(), parser.parse(),
+                        &actor_ptrs, &molecule_ptrs);
+
+    if (actor_ptrs.size() != 1) {
+        return std::shared_ptr<mrtp::ActorBase>();
+    }
+    return actor_ptrs[0];
+}
+
+
+static bool create_targets(const std::string& texture_file,
+                           mrtp::TextureFactory* texture_factory,
+                           std::vector<BenchTarget>* targets) {
+    std::string texture = "texture = \"" + texture_file + "\"\n";
+
+    auto pick_around = [](std::mt19937_64* rng) -> Vector3d {
+        return 4 * random_direction(rng);
+    };
+
+    BenchTarget plane{
+        "plane", "PlaneTextureMapper",
+        create_bench_actor(mrtp::ActorType::Plane,
+                           "center = [0.0, 0.0, 0.0]\nnormal = [0.0, 0.0, 1.0]\n" + texture,
+                           texture_factory),
+        1,
+        [](std::mt19937_64* rng) -> Vector3d {
+            // Stay above the plane
+            Vector3d origin = 4 * random_direction(rng);
+            origin[2] = std::abs(origin[2]) + 1;
+            return origin;
+        },
+        [](std::mt19937_64* rng) -> Vector3d {
+            return Vector3d{uniform(rng, -1, 1), uniform(rng, -1, 1), 0};
+        },
+        true
+    };
+
+    BenchTarget triangle{
+        "triangle", "DummyTextureMapper",
+        create_bench_actor(mrtp::ActorType::Triangle,
+                           "A = [1.0, 0.0, 0.0]\nB = [-0.5, 0.866, 0.0]\nC = [-0.5, -0.866, 0.0]\n"
+                           "color = [0.5, 0.5, 0.5]\n",
+                           texture_factory),
+        1,
+        pick_around,
+        [](std::mt19937_64* rng) -> Vector3d {
+            double a = uniform(rng, 0, 1);
+            double b = uniform(rng, 0, 1);
+            if (a + b > 1) {
+                a = 1 - a;
+                b = 1 - b;
+            }
+            // Keep away from the edges, the centroid is at the origin
+            Vector3d point = Vector3d{1, 0, 0} * (1 - a - b) + Vector3d{-0.5, 0.866, 0} * a +
+                    Vector3d{-0.5, -0.866, 0} * b;
+            return 0.95 * point;
+        },
+        false
+    };
+
+    BenchTarget sphere{
+        "sphere", "SphereTextureMapper",
+        create_bench_actor(mrtp::ActorType::Sphere,
+                           "center = [0.0, 0.0, 0.0]\nradius = 1.0\n" + texture,
+                           texture_factory),
+        1,
+        pick_around,
+        [](std::mt19937_64* rng) -> Vector3d {
+            return uniform(rng, 0, 0.9) * random_direction(rng);
+        },
+        false
+    };
+
+    BenchTarget cylinder{
+        "cylinder", "CylinderTextureMapper",
+        create_bench_actor(mrtp::ActorType::Cylinder,
+                           "center = [0.0, 0.0, 0.0]\ndirection = [0.0, 0.0, 1.0]\n"
+                           "radius = 0.5\nspan = 1.0\n" + texture,
+                           texture_factory),
+        std::sqrt(1.25),
+        [](std::mt19937_64* rng) -> Vector3d {
+            // The caps are open, so come from the side
+            Vector3d origin = 4 * std::sqrt(1.25) * random_direction(rng);
+            origin[2] = uniform(rng, -0.5, 0.5);
+            return origin;
+        },
+        [](std::mt19937_64* rng) -> Vector3d {
+            return Vector3d{0, 0, uniform(rng, -0.9, 0.9)};
+        },
+        false
+    };
+
+    for (const auto& target : {plane, triangle, sphere, cylinder}) {
+        if (!target.actor) {
+            LOG(ERROR) << "Cannot create " << target.name;
+            return false;
+        }
+        targets->push_back(target);
+    }
+    return true;
+}
+
+
+static void run_benchmarks(const BenchConfig& config,
+                           const std::vector<BenchTarget>& targets,
+                           const mrtp::TextureSharedState& texture_state,
+                           std::ostream& out) {
+    const double max_dist = 1000;
+    std::mt19937_64 rng(config.seed);
+
+    out << "kernel,batch,hit_ratio,ns_per_op,ns_per_op_min,mops_per_s,checksum" << std::endl;
+
+    for (const auto& target : targets) {
+        mrtp::ActorBase* actor = target.actor.get();
+
+        RayBatch rays = create_ray_batch(target, config.batch_size, config.hit_ratio, &rng);
+        auto solve_kernel = [&]() {
+            double sum = 0;
+            for (unsigned int i = 0; i < rays.origins.size(); i++) {
+                sum += actor->solve_light_ray(rays.origins[i], rays.directions[i], 0, max_dist);
+            }
+            return sum;
+        };
+
+        // Report the ratio that was achieved, not the one requested
+        SurfaceBatch surface = create_surface_batch(target, rays, max_dist);
+        std::stringstream hit_ratio;
+        hit_ratio << std::fixed << std::setprecision(3)
+                  << static_cast<double>(surface.hits.size()) / rays.origins.size();
+
+        write_result(out, target.name + ".solve_light_ray", rays.origins.size(),
+                     hit_ratio.str(), measure(solve_kernel, rays.origins.size(), config));
+
+        // Shading kernels only see hits
+        RayBatch hit_rays = create_ray_batch(target, config.batch_size, 1, &rng);
+        surface = create_surface_batch(target, hit_rays, max_dist);
+        if (surface.hits.empty()) {
+            continue;
+        }
+
+        auto normal_kernel = [&]() {
+            double sum = 0;
+            for (const auto& hit : surface.hits) {
+                sum += actor->calculate_normal_at_hit(hit).sum();
+            }
+            return sum;
+        };
+        write_result(out, target.name + ".calculate_normal_at_hit", surface.hits.size(),
+                     "", measure(normal_kernel, surface.hits.size(), config));
+
+        auto mapper_kernel = [&]() {
+            double sum = 0;
+            for (unsigned int i = 0; i < surface.hits.size(); i++) {
+                mrtp::MyPixel pick = actor->pick_pixel(surface.hits[i], surface.normals[i]);
+                sum += pick.pixel.red + pick.pixel.green + pick.pixel.blue;
+            }
+            return sum;
+        };
+        write_result(out, target.mapper_name + ".pick_pixel", surface.hits.size(),
+                     "", measure(mapper_kernel, surface.hits.size(), config));
+    }
+
+    std::vector<std::pair<double, double>> fracs;
+    for (unsigned int i = 0; i < config.batch_size; i++) {
+        fracs.push_back(std::make_pair(uniform(&rng, 0, 1), uniform(&rng, 0, 1)));
+    }
+    auto texture_kernel = [&]() {
+        double sum = 0;
+        for (const auto& frac : fracs) {
+            mrtp::TexturePixel pixel = texture_state.pick_pixel(frac.first, frac.second, 1);
+            sum += pixel.red + pixel.green + pixel.blue;
+        }
+        return sum;
+    };
+    write_result(out, "TextureSharedState.pick_pixel", fracs.size(),
+                 "", measure(texture_kernel, fracs.size(), config));
+}
+
+
+void display_help() {
+    std::cout << R"(Usage: mrtp_bench [OPTION]...
+  Options:
+    -b   rays per batch (default 4096)
+    -H   fraction of rays hitting the primitive, 0 to 1 (default 0.5)
+    -h   print this help screen
+    -m   minimum seconds per repetition (default 0.2)
+    -o   output filename for CSV results, - for stdout (default)
+    -r   repetitions, the median is reported (default 5)
+    -s   random seed (default 1)
+    -T   texture file in PNG format (default generated)
+
+Output columns:
+  kernel,batch,hit_ratio,ns_per_op,ns_per_op_min,mops_per_s,checksum
+
+Example:
+  mrtp_bench -H 0.9 -o bench.csv)" << std::endl;
+}
+
+
+template <typename T>
+bool parse_value(const std::string& s, T* value) {
+    std::stringstream convert(s);
+    convert >> *value;
+    return !convert.fail() && convert.eof();
+}
+
+
+bool process_command_line(int argc, char** argv, BenchConfig* config) {
+    int c;
+    bool is_parsed = true;
+
+    while ((c = getopt(argc, argv, "b:H:hm:o:r:s:T:")) != -1) {
+        if (c == 'h') {
+            display_help();
+            return false;
+        }
+        else if (c == 'b') {
+            is_parsed = parse_value(optarg, &config->batch_size) && config->batch_size > 0;
+        }
+        else if (c == 'H') {
+            is_parsed = parse_value(optarg, &config->hit_ratio) &&
+                    config->hit_ratio >= 0 && config->hit_ratio <= 1;
+        }
+        else if (c == 'm') {
+            is_parsed = parse_value(optarg, &config->min_time) && config->min_time > 0;
+        }
+        else if (c == 'o') {
+            config->output_file = std::string(optarg);
+        }
+        else if (c == 'r') {
+            is_parsed = parse_value(optarg, &config->repetitions) && config->repetitions > 0;
+        }
+        else if (c == 's') {
+            is_parsed = parse_value(optarg, &config->seed);
+        }
+        else if (c == 'T') {
+            config->texture_file = std::string(optarg);
+        }
+        else {
+            return false;
+        }
+
+        if (!is_parsed) {
+            LOG(ERROR) << "Invalid value for option -" << static_cast<char>(c);
+            return false;
+        }
+    }
+    return true;
+}
+
+
+int main(int argc, char** argv) {
+    BenchConfig config;
+    if (!process_command_line(argc, argv, &config)) {
+        return 1;
+    }
+
+    // Generated textures only live until they are loaded
+    std::string texture_file = config.texture_file;
+    if (texture_file.empty()) {
+        std::stringstream convert;
+        convert << "/tmp/mrtp_bench_" << getpid() << ".png";
+        texture_file = convert.str();
+        // Big enough to miss the cache
+        if (!mrtp::write_checker_texture(texture_file, 1024)) {
+            LOG(ERROR) << "Cannot create texture file " << texture_file;
+            return 1;
+        }
+    }
+
+    mrtp::TextureFactory texture_factory;
+    std::vector<BenchTarget> targets;
+    bool is_created = create_targets(texture_file, &texture_factory, &targets);
+    mrtp::TextureSharedState texture_state(texture_file);
+
+    if (config.texture_file.empty()) {
+        std::remove(texture_file.c_str());
+    }
+    if (!is_created) {
+        return 1;
+    }
+
+    if (config.output_file == "-") {
+        run_benchmarks(config, targets, texture_state, std::cout);
+    } else {
+        std::ofstream out(config.output_file.c_str());
+        if (!out.good()) {
+            LOG(ERROR) << "Cannot open output file " << config.output_file;
+            return 1;
+        }
+        run_benchmarks(config, targets, texture_state, out);
+    }
+    return 0;
+}
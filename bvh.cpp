@@ -0,0 +1,638 @@
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <type_traits>
+
+#include "bvh.h"
+#include "kernels.h"
+
+
+namespace mrtp {
+
+const unsigned int kMaxLeafSize = 4;
+const unsigned int kMaxStackSize = 64;
+const unsigned int kMaxCullNodes = 16;
+const unsigned int kSphereOccluder = 1u << 31;
+
+
+static void pad_bounds(BoundingBox* bounds) {
+    // Keep grazing hits inside the boxes
+    Vector3d pad = 1e-7 * (bounds->upper - bounds->lower).cwiseAbs() +
+            Vector3d{1e-9, 1e-9, 1e-9};
+    bounds->lower -= pad;
+    bounds->upper += pad;
+}
+
+
+static void merge_bounds(BoundingBox* bounds, const BoundingBox& other) {
+    bounds->lower = bounds->lower.cwiseMin(other.lower);
+    bounds->upper = bounds->upper.cwiseMax(other.upper);
+}
+
+
+template <typename T>
+static void merge_bounds(BVHBox<T>* bounds, const BVHBox<T>& other) {
+    bounds->lower = bounds->lower.cwiseMin(other.lower);
+    bounds->upper = bounds->upper.cwiseMax(other.upper);
+}
+
+
+/*
+Rounds outwards, so that a float box still contains the double one.
+*/
+template <typename T>
+static BVHBox<T> convert_bounds(const BoundingBox& bounds) {
+    const T lowest = -std::numeric_limits<T>::infinity();
+    const T highest = std::numeric_limits<T>::infinity();
+
+    BVHBox<T> box;
+    for (unsigned int axis = 0; axis < 3; axis++) {
+        T lower = static_cast<T>(bounds.lower[axis]);
+        T upper = static_cast<T>(bounds.upper[axis]);
+        box.lower[axis] = (lower > bounds.lower[axis]) ? std::nextafter(lower, lowest) : lower;
+        box.upper[axis] = (upper < bounds.upper[axis]) ? std::nextafter(upper, highest) : upper;
+    }
+    box.lower[3] = box.upper[3] = 0;
+    return box;
+}
+
+
+// Only for entries known to have bounds, when the tree is built
+static BoundingBox calculate_entry_bounds(const BVHEntry& entry) {
+    BoundingBox bounds;
+    entry.actor->calculate_bounds(&bounds);
+    return bounds;
+}
+
+
+template <typename T>
+static bool intersect_box(const BVHBox<T>& bounds,
+                          const Vector4<T>& O,
+                          const Vector4<T>& inv_D,
+                          T max_dist) {
+    T t_near = 0;
+    T t_far = max_dist;
+
+    for (unsigned int axis = 0; axis < 3; axis++) {
+        T ta = (bounds.lower[axis] - O[axis]) * inv_D[axis];
+        T tb = (bounds.upper[axis] - O[axis]) * inv_D[axis];
+        if (ta > tb) {
+            std::swap(ta, tb);
+        }
+        // NaN from rays parallel to a face fails both tests and keeps the box
+        t_near = (ta > t_near) ? ta : t_near;
+        t_far = (tb < t_far) ? tb : t_far;
+        if (t_near > t_far) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+/*
+Returns -1 for boxes outside of the frustum, 1 for boxes inside
+and 0 for boxes crossing one of its planes.
+*/
+template <typename T>
+static int classify_box(const BVHBox<T>& bounds, const Frustum& frustum) {
+    int result = 1;
+    for (const Eigen::Vector4d& plane : frustum.planes) {
+        Vector3d inner;
+        Vector3d outer;
+        for (unsigned int axis = 0; axis < 3; axis++) {
+            bool is_positive = plane[axis] >= 0;
+            inner[axis] = static_cast<double>(is_positive ? bounds.upper[axis] : bounds.lower[axis]);
+            outer[axis] = static_cast<double>(is_positive ? bounds.lower[axis] : bounds.upper[axis]);
+        }
+        if (plane.head<3>().dot(inner) + plane[3] < 0) {
+            return -1;
+        }
+        if (plane.head<3>().dot(outer) + plane[3] < 0) {
+            result = 0;
+        }
+    }
+    return result;
+}
+
+
+static void intersect_spheres(const KernelTable& kernels,
+                              const double* O,
+                              const double* D,
+                              const double* x,
+                              const double* y,
+                              const double* z,
+                              const double* r,
+                              unsigned int count,
+                              double max_dist,
+                              double* distances) {
+    kernels.intersect_spheres(O, D, x, y, z, r, count, 0, max_dist, distances);
+}
+
+
+static void intersect_spheres(const KernelTable& kernels,
+                              const float* O,
+                              const float* D,
+                              const float* x,
+                              const float* y,
+                              const float* z,
+                              const float* r,
+                              unsigned int count,
+                              float max_dist,
+                              float* distances) {
+    kernels.intersect_spheres_float(O, D, x, y, z, r, count, 0, max_dist, distances);
+}
+
+
+template <typename T>
+static Vector4<T> convert_vector(const Vector3d& v) {
+    return Vector4<T>{static_cast<T>(v[0]), static_cast<T>(v[1]), static_cast<T>(v[2]), 0};
+}
+
+
+template <typename T>
+ActorBVH<T>::ActorBVH(const std::vector<ActorBase*>& actor_ptrs) {
+    BoundingBox bounds;
+
+    for (unsigned int i = 0; i < actor_ptrs.size(); i++) {
+        BVHEntry entry{actor_ptrs[i], i};
+        if (actor_ptrs[i]->calculate_bounds(&bounds)) {
+            entries_.push_back(entry);
+        } else {
+            unbounded_entries_.push_back(entry);
+        }
+    }
+
+    sphere_x_.resize(entries_.size());
+    sphere_y_.resize(entries_.size());
+    sphere_z_.resize(entries_.size());
+    sphere_r_.resize(entries_.size());
+
+    if (!entries_.empty()) {
+        nodes_.reserve(2 * entries_.size());
+        nodes_.push_back(BVHNode<T>{});
+        build_node(0, 0, entries_.size());
+    }
+}
+
+
+/*
+Nodes are split at the median of actor centers along the longest axis.
+Children of a node are always stored next to each other.
+*/
+template <typename T>
+void ActorBVH<T>::build_node(unsigned int node_index,
+                          unsigned int first,
+                          unsigned int count) {
+    BVHNode<T> node{BVHBox<T>(), first, count, 0, 0};
+
+    if (count <= kMaxLeafSize) {
+        // Spheres go first, the kernel takes them in one call
+        Vector3d center;
+        double radius;
+        auto is_sphere = [&](const BVHEntry& entry) {
+            return entry.actor->get_sphere(&center, &radius);
+        };
+        auto spheres_end = std::stable_partition(
+                    entries_.begin() + first, entries_.begin() + first + count, is_sphere);
+        node.num_spheres = spheres_end - (entries_.begin() + first);
+
+        update_leaf_bounds(&node);
+        update_leaf_spheres(node);
+        nodes_[node_index] = node;
+        return;
+    }
+
+    BoundingBox center_bounds;
+    center_bounds.lower = center_bounds.upper =
+            calculate_entry_bounds(entries_[first]).lower;
+    for (unsigned int i = first; i < first + count; i++) {
+        BoundingBox actor_bounds = calculate_entry_bounds(entries_[i]);
+        Vector3d center = (actor_bounds.lower + actor_bounds.upper) / 2;
+        center_bounds.lower = center_bounds.lower.cwiseMin(center);
+        center_bounds.upper = center_bounds.upper.cwiseMax(center);
+    }
+
+    Vector3d extent = center_bounds.upper - center_bounds.lower;
+    unsigned int axis = 0;
+    if (extent[1] > extent[axis])
+        axis = 1;
+    if (extent[2] > extent[axis])
+        axis = 2;
+
+    unsigned int half = count / 2;
+    std::nth_element(
+                entries_.begin() + first,
+                entries_.begin() + first + half,
+                entries_.begin() + first + count,
+                [axis](const BVHEntry& a, const BVHEntry& b) {
+        BoundingBox bounds_a = calculate_entry_bounds(a);
+        BoundingBox bounds_b = calculate_entry_bounds(b);
+        return bounds_a.lower[axis] + bounds_a.upper[axis] <
+                bounds_b.lower[axis] + bounds_b.upper[axis];
+    });
+
+    unsigned int left_index = nodes_.size();
+    nodes_.push_back(BVHNode<T>{});
+    nodes_.push_back(BVHNode<T>{});
+
+    build_node(left_index, first, half);
+    build_node(left_index + 1, first + half, count - half);
+
+    node.first = left_index;
+    node.count = 0;
+    node.axis = axis;
+    update_inner_node(&node);
+    nodes_[node_index] = node;
+}
+
+
+template <typename T>
+static T calculate_surface(const BVHBox<T>& bounds) {
+    Vector4<T> extent = bounds.upper - bounds.lower;
+    return extent[0] * extent[1] + extent[1] * extent[2] + extent[2] * extent[0];
+}
+
+
+/*
+Bounds of an inner node from its children, and which child shadow
+rays visit first. A larger box is more likely to hold an occluder.
+*/
+template <typename T>
+void ActorBVH<T>::update_inner_node(BVHNode<T>* node) const {
+    const BVHBox<T>& left = nodes_[node->first].bounds;
+    const BVHBox<T>& right = nodes_[node->first + 1].bounds;
+    node->bounds = left;
+    merge_bounds(&node->bounds, right);
+
+    node->axis &= kAxisMask;
+    if (calculate_surface(right) > calculate_surface(left)) {
+        node->axis |= kLargerRight;
+    }
+}
+
+
+/*
+Returns false if an actor of the leaf has no bounds any more.
+*/
+template <typename T>
+bool ActorBVH<T>::update_leaf_bounds(BVHNode<T>* node) const {
+    BoundingBox bounds;
+    BoundingBox actor_bounds;
+    for (unsigned int i = node->first; i < node->first + node->count; i++) {
+        if (!entries_[i].actor->calculate_bounds(&actor_bounds)) {
+            return false;
+        }
+        if (i == node->first) {
+            bounds = actor_bounds;
+        } else {
+            merge_bounds(&bounds, actor_bounds);
+        }
+    }
+    pad_bounds(&bounds);
+    node->bounds = convert_bounds<T>(bounds);
+    return true;
+}
+
+
+template <typename T>
+void ActorBVH<T>::update_leaf_spheres(const BVHNode<T>& node) {
+    Vector3d center;
+    double radius;
+    for (unsigned int i = node.first; i < node.first + node.num_spheres; i++) {
+        entries_[i].actor->get_sphere(&center, &radius);
+        sphere_x_[i] = static_cast<T>(center[0]);
+        sphere_y_[i] = static_cast<T>(center[1]);
+        sphere_z_[i] = static_cast<T>(center[2]);
+        sphere_r_[i] = static_cast<T>(radius);
+    }
+}
+
+
+/*
+Children are stored after their parents, so walking the nodes
+backwards updates every child before its parent. Returns false if
+an actor lost its bounds, such as a bond between atoms moved onto
+each other, and the tree has to be built again.
+*/
+template <typename T>
+bool ActorBVH<T>::refit() {
+    for (unsigned int i = nodes_.size(); i-- > 0;) {
+        BVHNode<T>* node = &nodes_[i];
+        if (node->count) {
+            if (!update_leaf_bounds(node)) {
+                return false;
+            }
+            update_leaf_spheres(*node);
+        } else {
+            update_inner_node(node);
+        }
+    }
+    return true;
+}
+
+
+template <typename T>
+ActorBase* ActorBVH<T>::solve_hits(const Vector3d& O,
+                                   const Vector3d& D,
+                                   double max_dist,
+                                   double* curr_dist) const {
+    unsigned int root = 0;
+    return solve_hits(O, D, max_dist, curr_dist, &root, nodes_.empty() ? 0 : 1);
+}
+
+
+/*
+Nearest hit within the subtrees of the given nodes, which must not
+overlap. Equal hits are resolved in scene order, so the result does
+not depend on the order of the subtrees.
+*/
+template <typename T>
+ActorBase* ActorBVH<T>::solve_hits(const Vector3d& O,
+                                   const Vector3d& D,
+                                   double max_dist,
+                                   double* curr_dist,
+                                   const unsigned int* roots,
+                                   unsigned int num_roots) const {
+    ActorBase* hit_actor = nullptr;
+    unsigned int hit_order = 0;
+    bool is_kernel_hit = false;
+
+    // Equally distant actors are resolved in scene order
+    auto test_distance = [&](const BVHEntry& entry, ActorBase* actor, double distance, bool is_kernel) {
+        if (distance > 0 && (distance < *curr_dist ||
+                             (distance == *curr_dist && hit_actor && entry.order < hit_order))) {
+            *curr_dist = distance;
+            hit_actor = actor;
+            hit_order = entry.order;
+            is_kernel_hit = is_kernel;
+        }
+    };
+
+    // Actors made of parts, like molecule grids, name the part that was hit
+    auto test_entry = [&](const BVHEntry& entry) {
+        double distance;
+        ActorBase* actor = entry.actor->solve_hit(O, D, 0, max_dist, &distance);
+        test_distance(entry, actor, distance, false);
+    };
+
+    for (const auto& entry : unbounded_entries_) {
+        test_entry(entry);
+    }
+
+    if (!num_roots) {
+        return hit_actor;
+    }
+
+    const KernelTable& kernels = get_kernels();
+    Vector4<T> O_t = convert_vector<T>(O);
+    Vector4<T> D_t = convert_vector<T>(D);
+    Vector4<T> inv_D = convert_vector<T>(D.cwiseInverse());
+    T distances[kMaxLeafSize];
+
+    unsigned int stack[kMaxStackSize];
+    unsigned int stack_size = 0;
+
+    for (unsigned int r = 0; r < num_roots; r++) {
+        stack[stack_size++] = roots[r];
+
+        while (stack_size) {
+            const BVHNode<T>& node = nodes_[stack[--stack_size]];
+            if (!intersect_box(node.bounds, O_t, inv_D, static_cast<T>(*curr_dist))) {
+                continue;
+            }
+            if (node.count) {
+                unsigned int first = node.first;
+                intersect_spheres(kernels, O_t.data(), D_t.data(),
+                                  &sphere_x_[first], &sphere_y_[first],
+                                  &sphere_z_[first], &sphere_r_[first],
+                                  node.num_spheres, static_cast<T>(max_dist), distances);
+                for (unsigned int i = 0; i < node.num_spheres; i++) {
+                    test_distance(entries_[first + i], entries_[first + i].actor, distances[i], true);
+                }
+                for (unsigned int i = first + node.num_spheres; i < first + node.count; i++) {
+                    test_entry(entries_[i]);
+                }
+            } else {
+                // Visit the nearer child first
+                bool is_reversed = D[node.axis & kAxisMask] < 0;
+                stack[stack_size++] = node.first + (is_reversed ? 0 : 1);
+                stack[stack_size++] = node.first + (is_reversed ? 1 : 0);
+            }
+        }
+    }
+
+    // Hits are shaded in double, so a float sphere distance is solved again
+    if (std::is_same<T, float>::value && is_kernel_hit) {
+        double distance = hit_actor->solve_light_ray(O, D, 0, max_dist);
+        if (distance > 0) {
+            *curr_dist = distance;
+        }
+    }
+    return hit_actor;
+}
+
+
+/*
+Tests a single occluder, numbered as solve_shadows numbers them.
+Spheres go through the kernel, as they do in the tree.
+*/
+template <typename T>
+bool ActorBVH<T>::solve_occluder(unsigned int occluder,
+                                 const Vector4<T>& O_t,
+                                 const Vector4<T>& D_t,
+                                 const Vector3d& O,
+                                 const Vector3d& D,
+                                 double max_dist) const {
+    if (occluder & kSphereOccluder) {
+        unsigned int i = occluder & ~kSphereOccluder;
+        T distance;
+        intersect_spheres(get_kernels(), O_t.data(), D_t.data(),
+                          &sphere_x_[i], &sphere_y_[i], &sphere_z_[i], &sphere_r_[i],
+                          1, static_cast<T>(max_dist), &distance);
+        return distance > 0;
+    }
+    if (occluder >= entries_.size()) {
+        ActorBase* actor = unbounded_entries_[occluder - entries_.size()].actor;
+        return actor->solve_light_ray(O, D, 0, max_dist) > 0;
+    }
+    return entries_[occluder].actor->solve_light_ray(O, D, 0, max_dist) > 0;
+}
+
+
+/*
+True if any actor with a shadow blocks the ray within max_dist. The
+actor that blocked the last ray is tried first, as neighbouring rays
+mostly hit the same one. occluder is updated to the blocking entry:
+unbounded entries are numbered after the bounded ones, and spheres
+are marked with kSphereOccluder.
+*/
+template <typename T>
+bool ActorBVH<T>::solve_shadows(const Vector3d& O,
+                                const Vector3d& D,
+                                double max_dist,
+                                unsigned int* occluder) const {
+    Vector4<T> O_t = convert_vector<T>(O);
+    Vector4<T> D_t = convert_vector<T>(D);
+    if (*occluder != kNoOccluder && solve_occluder(*occluder, O_t, D_t, O, D, max_dist)) {
+        return true;
+    }
+
+    for (unsigned int i = 0; i < unbounded_entries_.size(); i++) {
+        ActorBase* actor = unbounded_entries_[i].actor;
+        if (actor->has_shadow() && actor->solve_light_ray(O, D, 0, max_dist) > 0) {
+            *occluder = entries_.size() + i;
+            return true;
+        }
+    }
+
+    if (nodes_.empty()) {
+        return false;
+    }
+
+    const KernelTable& kernels = get_kernels();
+    Vector4<T> inv_D = convert_vector<T>(D.cwiseInverse());
+    T max_dist_t = static_cast<T>(max_dist);
+    T distances[kMaxLeafSize];
+
+    unsigned int stack[kMaxStackSize];
+    unsigned int stack_size = 0;
+    stack[stack_size++] = 0;
+
+    while (stack_size) {
+        const BVHNode<T>& node = nodes_[stack[--stack_size]];
+        if (!intersect_box(node.bounds, O_t, inv_D, max_dist_t)) {
+            continue;
+        }
+        if (node.count) {
+            unsigned int first = node.first;
+            intersect_spheres(kernels, O_t.data(), D_t.data(),
+                              &sphere_x_[first], &sphere_y_[first],
+                              &sphere_z_[first], &sphere_r_[first],
+                              node.num_spheres, max_dist_t, distances);
+            for (unsigned int i = 0; i < node.num_spheres; i++) {
+                if (distances[i] > 0 && entries_[first + i].actor->has_shadow()) {
+                    *occluder = (first + i) | kSphereOccluder;
+                    return true;
+                }
+            }
+            for (unsigned int i = first + node.num_spheres; i < first + node.count; i++) {
+                ActorBase* actor = entries_[i].actor;
+                if (actor->has_shadow() && actor->solve_light_ray(O, D, 0, max_dist) > 0) {
+                    *occluder = i;
+                    return true;
+                }
+            }
+        } else {
+            bool is_right_first = node.axis & kLargerRight;
+            stack[stack_size++] = node.first + (is_right_first ? 0 : 1);
+            stack[stack_size++] = node.first + (is_right_first ? 1 : 0);
+        }
+    }
+    return false;
+}
+
+
+/*
+True if an actor without bounds blocks the ray, for callers
+that know none of the others does.
+*/
+template <typename T>
+bool ActorBVH<T>::solve_unbounded_shadows(const Vector3d& O,
+                                          const Vector3d& D,
+                                          double max_dist) const {
+    for (const auto& entry : unbounded_entries_) {
+        if (entry.actor->has_shadow() && entry.actor->solve_light_ray(O, D, 0, max_dist) > 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/*
+Collects subtrees that cover every actor possibly inside the frustum.
+Boxes inside it are kept whole, boxes crossing it are split as long
+as there are at most kMaxCullNodes subtrees. nodes must hold
+get_num_nodes() entries, returns the number of subtrees.
+*/
+template <typename T>
+unsigned int ActorBVH<T>::cull_nodes(const Frustum& frustum, unsigned int* nodes) const {
+    if (nodes_.empty()) {
+        return 0;
+    }
+
+    unsigned int num_nodes = 0;
+    unsigned int stack[kMaxStackSize];
+    unsigned int stack_size = 0;
+    stack[stack_size++] = 0;
+
+    while (stack_size) {
+        unsigned int node_index = stack[--stack_size];
+        const BVHNode<T>& node = nodes_[node_index];
+        int inside = classify_box(node.bounds, frustum);
+        if (inside < 0) {
+            continue;
+        }
+        // Rays walk each subtree from its root, so their number is capped
+        if (inside > 0 || node.count || num_nodes + stack_size + 2 > kMaxCullNodes) {
+            nodes[num_nodes++] = node_index;
+        } else {
+            // Nearer subtrees first, so rays find their hits early
+            bool is_reversed = frustum.direction[node.axis & kAxisMask] < 0;
+            stack[stack_size++] = node.first + (is_reversed ? 0 : 1);
+            stack[stack_size++] = node.first + (is_reversed ? 1 : 0);
+        }
+    }
+    return num_nodes;
+}
+
+
+/*
+Unbounded actors and the actors in the subtrees of the given nodes.
+actors must hold get_num_actors() entries, returns their number.
+*/
+template <typename T>
+unsigned int ActorBVH<T>::collect_actors(const unsigned int* roots,
+                                         unsigned int num_roots,
+                                         ActorBase** actors) const {
+    unsigned int num_actors = 0;
+    for (const auto& entry : unbounded_entries_) {
+        actors[num_actors++] = entry.actor;
+    }
+
+    // Subtrees cover the entries from their leftmost to their rightmost leaf
+    for (unsigned int r = 0; r < num_roots; r++) {
+        const BVHNode<T>* left = &nodes_[roots[r]];
+        const BVHNode<T>* right = left;
+        while (!left->count) {
+            left = &nodes_[left->first];
+        }
+        while (!right->count) {
+            right = &nodes_[right->first + 1];
+        }
+        for (unsigned int i = left->first; i < right->first + right->count; i++) {
+            actors[num_actors++] = entries_[i].actor;
+        }
+    }
+    return num_actors;
+}
+
+
+template <typename T>
+unsigned int ActorBVH<T>::get_num_nodes() const {
+    return nodes_.size();
+}
+
+
+template <typename T>
+unsigned int ActorBVH<T>::get_num_actors() const {
+    return entries_.size() + unbounded_entries_.size();
+}
+
+
+template class ActorBVH<float>;
+template class ActorBVH<double>;
+
+
+}  //namespace mrtp
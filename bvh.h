@@ -0,0 +1,97 @@
+#ifndef _BVH_H
+#define _BVH_H
+
+#include <vector>
+#include <Eigen/Core>
+
+#include "actors.h"
+#include "common.h"
+
+
+namespace mrtp {
+
+using Vector3d = Eigen::Vector3d;
+
+
+template <typename T>
+struct BVHBox {
+    Vector4<T> lower;     // Fourth components are unused
+    Vector4<T> upper;
+};
+
+
+template <typename T>
+struct BVHNode {
+    BVHBox<T> bounds;
+    unsigned int first;   // Left child for inner nodes, first entry for leaves
+    unsigned int count;   // Number of entries, zero for inner nodes
+    unsigned int axis;    // Split axis of inner nodes, and kLargerRight
+    unsigned int num_spheres;  // Leading entries of leaves that are spheres
+};
+
+
+// Shadow rays visit the child with the larger surface first
+const unsigned int kAxisMask = 3;
+const unsigned int kLargerRight = 4;
+
+// Entry that blocked the last shadow ray, none yet
+const unsigned int kNoOccluder = ~0u;
+
+
+struct BVHEntry {
+    ActorBase* actor;
+    unsigned int order;   // Position of the actor in the scene
+};
+
+
+/*
+Bounding volume hierarchy over the actors of a scene. Actors without
+bounds, such as planes, are kept aside and tested for every ray.
+The tree is built once, moving actors only requires a refit, unless
+an actor loses its bounds. Actors that gain bounds stay aside.
+Boxes and spheres are stored and traversed in T, float or double,
+hits on other actors are always solved in double.
+*/
+template <typename T>
+class ActorBVH {
+public:
+    ActorBVH(const std::vector<ActorBase*>&);
+    ActorBVH() = delete;
+    ~ActorBVH() = default;
+
+    bool refit();
+
+    ActorBase* solve_hits(const Vector3d&, const Vector3d&, double, double*) const;
+    ActorBase* solve_hits(const Vector3d&, const Vector3d&, double, double*,
+                          const unsigned int*, unsigned int) const;
+    bool solve_shadows(const Vector3d&, const Vector3d&, double, unsigned int*) const;
+    bool solve_unbounded_shadows(const Vector3d&, const Vector3d&, double) const;
+
+    unsigned int cull_nodes(const Frustum&, unsigned int*) const;
+    unsigned int collect_actors(const unsigned int*, unsigned int, ActorBase**) const;
+    unsigned int get_num_nodes() const;
+    unsigned int get_num_actors() const;
+
+private:
+    std::vector<BVHNode<T>> nodes_;
+    std::vector<BVHEntry> entries_;
+    std::vector<BVHEntry> unbounded_entries_;
+
+    // Centers and radii of sphere entries, for the sphere kernel
+    std::vector<T> sphere_x_;
+    std::vector<T> sphere_y_;
+    std::vector<T> sphere_z_;
+    std::vector<T> sphere_r_;
+
+    void build_node(unsigned int, unsigned int, unsigned int);
+    void update_inner_node(BVHNode<T>*) const;
+    bool update_leaf_bounds(BVHNode<T>*) const;
+    void update_leaf_spheres(const BVHNode<T>&);
+    bool solve_occluder(unsigned int, const Vector4<T>&, const Vector4<T>&,
+                        const Vector3d&, const Vector3d&, double) const;
+};
+
+
+}  //namespace mrtp
+
+#endif  //_BVH_H
@@ -1,6 +1,9 @@
 #include <Eigen/Geometry>
+#include <algorithm>
 #include <cmath>
+#include <limits>
 #include "camera.h"
+#include "kernels.h"
 
 
 namespace mrtp {
@@ -11,6 +14,26 @@ Camera::Camera(const Eigen::Vector3d& eye, const Eigen::Vector3d& lookat, double
 }
 
 
+void Camera::set_eye(const Eigen::Vector3d& eye) {
+    eye_ = eye;
+}
+
+
+void Camera::set_lookat(const Eigen::Vector3d& lookat) {
+    lookat_ = lookat;
+}
+
+
+void Camera::set_roll(double roll) {
+    roll_ = roll;
+}
+
+
+const Eigen::Vector3d& Camera::get_eye() const {
+    return eye_;
+}
+
+
 void Camera::calculate_window(unsigned int width,
                               unsigned int height,
                               double perspective) {
@@ -64,4 +87,123 @@ Eigen::Vector3d Camera::calculate_direction(const Eigen::Vector3d& origin) const
     return direction * (1 / direction.norm());
 }
 
+
+// Ray through any point of the window, eg. between pixel centers
+void Camera::calculate_ray(double windowx,
+                           double windowy,
+                           Eigen::Vector3d* origin,
+                           Eigen::Vector3d* direction) const {
+    *origin = wo_ + windowx * wh_ + windowy * wv_;
+    *direction = calculate_direction(*origin);
+}
+
+
+/*
+Rays through count neighbouring pixels of one window row,
+same as calculate_origin and calculate_direction for each pixel.
+*/
+void Camera::calculate_rays(unsigned int windowx,
+                            unsigned int windowy,
+                            unsigned int count,
+                            Eigen::Vector3d* origins,
+                            Eigen::Vector3d* directions) const {
+    get_kernels().generate_rays(wo_.data(), wh_.data(), wv_.data(), eye_.data(),
+                                windowx, windowy, count,
+                                origins->data(), directions->data());
+}
+
+
+/*
+Region reached by the rays of a block of pixels within max_distance:
+four planes through the eye and the edges of the block, widened by
+half a pixel, the window itself and a far plane.
+*/
+void Camera::calculate_frustum(unsigned int windowx,
+                               unsigned int windowy,
+                               unsigned int width,
+                               unsigned int height,
+                               double max_distance,
+                               Frustum* frustum) const {
+    double x0 = windowx - 0.5;
+    double x1 = windowx + width - 0.5;
+    double y0 = windowy - 0.5;
+    double y1 = windowy + height - 0.5;
+    Eigen::Vector3d corners[4] = {
+        wo_ + x0 * wh_ + y0 * wv_,
+        wo_ + x1 * wh_ + y0 * wv_,
+        wo_ + x1 * wh_ + y1 * wv_,
+        wo_ + x0 * wh_ + y1 * wv_
+    };
+    Eigen::Vector3d middle = 0.25 * (corners[0] + corners[1] + corners[2] + corners[3]);
+
+    for (unsigned int c = 0; c < 4; c++) {
+        Eigen::Vector3d n = (corners[c] - eye_).cross(corners[(c + 1) % 4] - eye_);
+        if (n.dot(middle - eye_) < 0) {
+            n = -n;
+        }
+        frustum->planes[c] << n, -n.dot(eye_);
+    }
+
+    // Rays start on the window, which is normal to the view direction
+    Eigen::Vector3d view = wh_.cross(wv_);
+    view *= (1 / view.norm());
+    if (view.dot(wo_ - eye_) < 0) {
+        view = -view;
+    }
+    frustum->planes[4] << view, -view.dot(wo_);
+    frustum->planes[5] << -view, view.dot(wo_) + max_distance;
+    frustum->direction = calculate_direction(middle);
+}
+
+
+/*
+Window coordinates of a point, false if it is not clearly in front
+of the eye.
+*/
+bool Camera::project_point(const Eigen::Vector3d& point, double* windowx, double* windowy) const {
+    Eigen::Vector3d view = wh_.cross(wv_);
+    if (view.dot(wo_ - eye_) < 0) {
+        view = -view;
+    }
+    double window_depth = view.dot(wo_ - eye_);
+    double depth = view.dot(point - eye_);
+    if (depth < 1e-3 * window_depth) {
+        return false;
+    }
+
+    // Point where the line from the eye to the point meets the window
+    Eigen::Vector3d q = (window_depth / depth) * (point - eye_) + eye_ - wo_;
+    *windowx = q.dot(wh_) / wh_.squaredNorm();
+    *windowy = q.dot(wv_) / wv_.squaredNorm();
+    return true;
+}
+
+
+/*
+Window coordinates x0, y0, x1, y1 of a rectangle that contains the
+projection of the box, false if the box is not wholly in front of
+the eye.
+*/
+bool Camera::project_bounds(const BoundingBox& bounds, double* window) const {
+    window[0] = window[1] = std::numeric_limits<double>::infinity();
+    window[2] = window[3] = -std::numeric_limits<double>::infinity();
+    for (unsigned int c = 0; c < 8; c++) {
+        Eigen::Vector3d corner{
+            (c & 1) ? bounds.upper[0] : bounds.lower[0],
+            (c & 2) ? bounds.upper[1] : bounds.lower[1],
+            (c & 4) ? bounds.upper[2] : bounds.lower[2]
+        };
+        double x;
+        double y;
+        if (!project_point(corner, &x, &y)) {
+            return false;
+        }
+        window[0] = std::min(window[0], x);
+        window[1] = std::min(window[1], y);
+        window[2] = std::max(window[2], x);
+        window[3] = std::max(window[3], y);
+    }
+    return true;
+}
+
 } //namespace mrtp
@@ -3,6 +3,8 @@
 
 #include <Eigen/Core>
 
+#include "common.h"
+
 
 namespace mrtp {
 
@@ -12,10 +14,27 @@ public:
 
     ~Camera() = default;
 
+    void set_eye(const Eigen::Vector3d& eye);
+    void set_lookat(const Eigen::Vector3d& lookat);
+    void set_roll(double roll);
+
+    const Eigen::Vector3d& get_eye() const;
+
     void calculate_window(unsigned int width, unsigned int height, double perspective);
 
     Eigen::Vector3d calculate_origin(unsigned int windowx, unsigned int windowy) const;
     Eigen::Vector3d calculate_direction(const Eigen::Vector3d& origin) const;
+    void calculate_ray(double windowx, double windowy,
+                       Eigen::Vector3d* origin, Eigen::Vector3d* direction) const;
+
+    void calculate_rays(unsigned int windowx, unsigned int windowy, unsigned int count,
+                        Eigen::Vector3d* origins, Eigen::Vector3d* directions) const;
+
+    void calculate_frustum(unsigned int windowx, unsigned int windowy,
+                           unsigned int width, unsigned int height,
+                           double max_distance, Frustum* frustum) const;
+    bool project_point(const Eigen::Vector3d& point, double* windowx, double* windowy) const;
+    bool project_bounds(const BoundingBox& bounds, double* window) const;
 
 private:
     double roll_;
@@ -0,0 +1,260 @@
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <easylogging++.h>
+
+#include "checkpoint.h"
+
+
+namespace mrtp {
+
+const char kCheckpointMagic[8] = {'M', 'R', 'T', 'P', 'C', 'K', 'P', '1'};
+
+
+struct CheckpointHeader {
+    char magic[8];
+    std::uint64_t scene_hash;
+    std::uint32_t buffer_width;
+    std::uint32_t buffer_height;
+    std::uint32_t tile_size;
+    std::uint32_t num_tiles;
+};
+
+
+/*
+Layout of the checkpoint file:
+  header, padded to 64 bytes
+  tile bitmap, padded to 64 bytes
+  framebuffer, same pixel format as the renderer
+*/
+static std::size_t align_up(std::size_t size) {
+    return (size + 63) & ~static_cast<std::size_t>(63);
+}
+
+
+static unsigned int count_config_tiles(const RendererConfig& config) {
+    unsigned int tile_size = std::max(config.tile_size, 1u);
+    unsigned int tiles_x = (config.buffer_width + tile_size - 1) / tile_size;
+    unsigned int tiles_y = (config.buffer_height + tile_size - 1) / tile_size;
+    return tiles_x * tiles_y;
+}
+
+
+static std::size_t bitmap_offset() {
+    return align_up(sizeof(CheckpointHeader));
+}
+
+
+static std::size_t framebuffer_offset(unsigned int num_tiles) {
+    return bitmap_offset() + align_up((num_tiles + 7) / 8);
+}
+
+
+RenderCheckpoint::RenderCheckpoint(int file_descriptor,
+                                   void* mapping,
+                                   std::size_t mapping_size,
+                                   const RendererConfig& config) :
+    file_descriptor_(file_descriptor),
+    mapping_(mapping),
+    mapping_size_(mapping_size),
+    page_size_(sysconf(_SC_PAGESIZE)),
+    buffer_width_(config.buffer_width) {
+
+    std::uint8_t* base = static_cast<std::uint8_t*>(mapping_);
+    tile_bitmap_ = base + bitmap_offset();
+    framebuffer_ = reinterpret_cast<Pixel*>(
+                base + framebuffer_offset(count_config_tiles(config)));
+}
+
+
+RenderCheckpoint::~RenderCheckpoint() {
+    munmap(mapping_, mapping_size_);
+    close(file_descriptor_);
+}
+
+
+bool RenderCheckpoint::restore_tile(const RenderTile& tile, Pixel* framebuffer) const {
+    std::uint8_t mask = 1 << (tile.index % 8);
+    if (!(__atomic_load_n(&tile_bitmap_[tile.index / 8], __ATOMIC_ACQUIRE) & mask)) {
+        return false;
+    }
+
+    for (unsigned int j = tile.y0; j < tile.y0 + tile.height; j++) {
+        std::size_t offset = j * buffer_width_ + tile.x0;
+        std::copy(&framebuffer_[offset], &framebuffer_[offset + tile.width], &framebuffer[offset]);
+    }
+    return true;
+}
+
+
+/*
+Writes the pages holding the bytes from begin to end back to the file
+and waits for them, so they survive a crash of the whole machine.
+*/
+void RenderCheckpoint::flush(const void* begin, const void* end) const {
+    std::uintptr_t first = reinterpret_cast<std::uintptr_t>(begin) & ~(page_size_ - 1);
+    std::uintptr_t last = reinterpret_cast<std::uintptr_t>(end);
+    if (msync(reinterpret_cast<void*>(first), last - first, MS_SYNC) != 0) {
+        LOG(ERROR) << "Cannot flush checkpoint file";
+    }
+}
+
+
+/*
+Only the pages holding the rows of the tile are flushed, rows whose
+pages touch or overlap are flushed together.
+*/
+void RenderCheckpoint::store_tile(const RenderTile& tile, const Pixel* framebuffer) {
+    const Pixel* flush_begin = nullptr;
+    const Pixel* flush_end = nullptr;
+    for (unsigned int j = tile.y0; j < tile.y0 + tile.height; j++) {
+        std::size_t offset = j * buffer_width_ + tile.x0;
+        std::copy(&framebuffer[offset], &framebuffer[offset + tile.width], &framebuffer_[offset]);
+
+        const Pixel* row_begin = &framebuffer_[offset];
+        const Pixel* row_end = row_begin + tile.width;
+        std::uintptr_t row_page = reinterpret_cast<std::uintptr_t>(row_begin) & ~(page_size_ - 1);
+        std::uintptr_t end_page = (reinterpret_cast<std::uintptr_t>(flush_end) + page_size_ - 1) &
+                ~(page_size_ - 1);
+        if (flush_begin && row_page > end_page) {
+            flush(flush_begin, flush_end);
+            flush_begin = nullptr;
+        }
+        if (!flush_begin) {
+            flush_begin = row_begin;
+        }
+        flush_end = row_end;
+    }
+    if (flush_begin) {
+        flush(flush_begin, flush_end);
+    }
+
+    // Mark the tile only after its pixels are on disk. Neighbouring
+    // tiles share bitmap bytes, so the update has to be atomic.
+    std::uint8_t mask = 1 << (tile.index % 8);
+    __atomic_fetch_or(&tile_bitmap_[tile.index / 8], mask, __ATOMIC_RELEASE);
+    flush(&tile_bitmap_[tile.index / 8], &tile_bitmap_[tile.index / 8 + 1]);
+}
+
+
+unsigned int RenderCheckpoint::count_tiles() const {
+    const CheckpointHeader* header = static_cast<const CheckpointHeader*>(mapping_);
+
+    unsigned int num_done = 0;
+    for (unsigned int i = 0; i < header->num_tiles; i++) {
+        if (tile_bitmap_[i / 8] & (1 << (i % 8))) {
+            num_done++;
+        }
+    }
+    return num_done;
+}
+
+
+/*
+FNV-1a hash of the scene file, the files it refers to, the precision
+of the world and all renderer settings that change the image. A
+checkpoint with a different hash is stale.
+*/
+std::uint64_t hash_scene(const std::string& world_filename,
+                         const SceneWorld& world,
+                         const RendererConfig& config) {
+    std::ifstream world_file(world_filename.c_str(), std::ios::binary);
+    std::stringstream contents;
+    contents << world_file.rdbuf();
+
+    contents << '\0' << world.describe_sources()
+             << '\0' << static_cast<int>(world.get_precision())
+             << ' ' << config.field_of_vision
+             << ' ' << config.max_distance
+             << ' ' << config.shadow_bias
+             << ' ' << config.ray_bias
+             << ' ' << config.buffer_width
+             << ' ' << config.buffer_height
+             << ' ' << config.max_ray_depth
+             << ' ' << config.tile_size
+             << ' ' << config.aa_samples
+             << ' ' << config.aa_threshold
+             << ' ' << config.min_contribution
+             << ' ' << config.russian_roulette
+             << ' ' << config.max_shadow_lights;
+
+    std::uint64_t hash = 14695981039346656037ULL;
+    for (char c : contents.str()) {
+        hash ^= static_cast<unsigned char>(c);
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+
+std::shared_ptr<RenderCheckpoint> open_checkpoint(const std::string& checkpoint_filename,
+                                                  std::uint64_t scene_hash,
+                                                  const RendererConfig& config,
+                                                  bool resume) {
+    unsigned int num_tiles = count_config_tiles(config);
+    std::size_t mapping_size = framebuffer_offset(num_tiles) +
+            sizeof(Pixel) * config.buffer_width * config.buffer_height;
+
+    int fd = open(checkpoint_filename.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        LOG(ERROR) << "Cannot open checkpoint file " << checkpoint_filename;
+        return std::shared_ptr<RenderCheckpoint>();
+    }
+
+    CheckpointHeader expected;
+    std::memcpy(expected.magic, kCheckpointMagic, sizeof(expected.magic));
+    expected.scene_hash = scene_hash;
+    expected.buffer_width = config.buffer_width;
+    expected.buffer_height = config.buffer_height;
+    expected.tile_size = config.tile_size;
+    expected.num_tiles = num_tiles;
+
+    bool is_valid = false;
+    if (resume) {
+        CheckpointHeader found;
+        struct stat file_stat;
+        if (fstat(fd, &file_stat) == 0 &&
+                static_cast<std::size_t>(file_stat.st_size) == mapping_size &&
+                pread(fd, &found, sizeof(found), 0) == sizeof(found)) {
+            is_valid = std::memcmp(&found, &expected, sizeof(found)) == 0;
+        }
+        if (!is_valid) {
+            LOG(WARNING) << "Ignoring stale checkpoint " << checkpoint_filename;
+        }
+    }
+
+    if (!is_valid) {
+        // Start a fresh journal with an empty bitmap
+        if (ftruncate(fd, 0) != 0 || ftruncate(fd, mapping_size) != 0 ||
+                pwrite(fd, &expected, sizeof(expected), 0) != sizeof(expected) ||
+                fsync(fd) != 0) {
+            LOG(ERROR) << "Cannot initialize checkpoint file " << checkpoint_filename;
+            close(fd);
+            return std::shared_ptr<RenderCheckpoint>();
+        }
+    }
+
+    void* mapping = mmap(nullptr, mapping_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mapping == MAP_FAILED) {
+        LOG(ERROR) << "Cannot map checkpoint file " << checkpoint_filename;
+        close(fd);
+        return std::shared_ptr<RenderCheckpoint>();
+    }
+
+    auto checkpoint_ptr = std::shared_ptr<RenderCheckpoint>(
+                new RenderCheckpoint(fd, mapping, mapping_size, config));
+
+    if (is_valid) {
+        LOG(INFO) << "Resuming with " << checkpoint_ptr->count_tiles()
+                  << " of " << num_tiles << " tiles done";
+    }
+    return checkpoint_ptr;
+}
+
+
+}  //namespace mrtp
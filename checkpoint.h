@@ -0,0 +1,57 @@
+#ifndef _CHECKPOINT_H
+#define _CHECKPOINT_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "pixel.h"
+#include "renderer.h"
+
+
+namespace mrtp {
+
+/*
+Tile completion journal. The file holds a header, a bitmap with one bit
+per tile and a copy of the framebuffer. It is mapped into memory and
+every tile is flushed to disk before it is marked, so stored tiles
+survive if the process or the machine goes down.
+*/
+class RenderCheckpoint {
+public:
+    RenderCheckpoint(int, void*, std::size_t, const RendererConfig&);
+    RenderCheckpoint() = delete;
+    RenderCheckpoint(const RenderCheckpoint&) = delete;
+    RenderCheckpoint& operator=(const RenderCheckpoint&) = delete;
+    ~RenderCheckpoint();
+
+    bool restore_tile(const RenderTile&, Pixel*) const;
+    void store_tile(const RenderTile&, const Pixel*);
+
+    unsigned int count_tiles() const;
+
+private:
+    int file_descriptor_;
+    void* mapping_;
+    std::size_t mapping_size_;
+    std::uintptr_t page_size_;
+
+    unsigned int buffer_width_;
+    std::uint8_t* tile_bitmap_;
+    Pixel* framebuffer_;
+
+    void flush(const void*, const void*) const;
+};
+
+
+std::uint64_t hash_scene(const std::string&, const SceneWorld&, const RendererConfig&);
+
+std::shared_ptr<RenderCheckpoint> open_checkpoint(const std::string&,
+                                                  std::uint64_t,
+                                                  const RendererConfig&,
+                                                  bool);
+
+
+}  //namespace mrtp
+
+#endif  //_CHECKPOINT_H
@@ -8,6 +8,10 @@ namespace mrtp {
 
 using Vector3d = Eigen::Vector3d;
 
+// Padded to four components, so that rows of them stay aligned
+template <typename T>
+using Vector4 = Eigen::Matrix<T, 4, 1>;
+
 struct StandardBasis {
     Vector3d o{0, 0, 0};
     Vector3d vi{1, 0, 0};
@@ -15,6 +19,25 @@ struct StandardBasis {
     Vector3d vk{0, 0, 1};
 };
 
+struct BoundingBox {
+    Vector3d lower{0, 0, 0};
+    Vector3d upper{0, 0, 0};
+};
+
+// Points p with n.dot(p) + d >= 0 for every plane (n, d)
+struct Frustum {
+    Eigen::Vector4d planes[6];
+    Vector3d direction;     // Mean direction of the rays inside
+};
+
+
+// Scalar type of ray traversal, shading is always done in double
+enum class Precision {
+    Float,
+    Double
+};
+
+
 enum class ActorType {
     Plane,
     Sphere,
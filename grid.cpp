@@ -0,0 +1,404 @@
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <easylogging++.h>
+
+#include "grid.h"
+#include "kernels.h"
+
+
+namespace mrtp {
+
+// Cells per part at most, larger molecules get larger cells
+const double kMaxCellsPerPart = 8;
+const double kMaxCellsPerAxis = 256;
+
+// Spheres handed to the kernel at once
+const unsigned int kSphereBatch = 16;
+
+
+static void pad_bounds(BoundingBox* bounds) {
+    // Keep grazing hits inside their cells
+    Vector3d pad = 1e-7 * (bounds->upper - bounds->lower).cwiseAbs() +
+            Vector3d{1e-9, 1e-9, 1e-9};
+    bounds->lower -= pad;
+    bounds->upper += pad;
+}
+
+
+MoleculeGrid::MoleculeGrid(const std::vector<ActorBase*>& parts,
+                           double cell_size,
+                           TextureMapper* texture_mapper_ptr) :
+    ActorBase(StandardBasis(), texture_mapper_ptr),
+    parts_(parts),
+    cell_size_(cell_size),
+    step_(cell_size) {
+
+    rebuild();
+}
+
+
+/*
+Cells start at cell_size and grow until there are at most
+kMaxCellsPerPart cells per part. Parts without bounds, such as
+bonds between atoms at the same place, are left out.
+*/
+void MoleculeGrid::rebuild() {
+    std::vector<BoundingBox> part_bounds(parts_.size());
+    std::vector<bool> is_bounded(parts_.size());
+    bool has_bounds = false;
+    for (unsigned int i = 0; i < parts_.size(); i++) {
+        is_bounded[i] = parts_[i]->calculate_bounds(&part_bounds[i]);
+        if (!is_bounded[i]) {
+            continue;
+        }
+        pad_bounds(&part_bounds[i]);
+        if (!has_bounds) {
+            bounds_ = part_bounds[i];
+            has_bounds = true;
+        }
+        bounds_.lower = bounds_.lower.cwiseMin(part_bounds[i].lower);
+        bounds_.upper = bounds_.upper.cwiseMax(part_bounds[i].upper);
+    }
+    if (!has_bounds) {
+        bounds_ = BoundingBox();
+    }
+
+    Vector3d extent = bounds_.upper - bounds_.lower;
+    step_ = std::max(cell_size_, extent.maxCoeff() / kMaxCellsPerAxis);
+    if (!(step_ > 0)) {
+        step_ = 1;
+    }
+    double max_cells = kMaxCellsPerPart * std::max<std::size_t>(parts_.size(), 1);
+    while (true) {
+        double num_cells = 1;
+        for (unsigned int axis = 0; axis < 3; axis++) {
+            dims_[axis] = std::max(1u, static_cast<unsigned int>(std::ceil(extent[axis] / step_)));
+            num_cells *= dims_[axis];
+        }
+        if (num_cells <= max_cells) {
+            break;
+        }
+        step_ *= std::cbrt(num_cells / max_cells) * 1.01;
+    }
+
+    unsigned int num_cells = dims_[0] * dims_[1] * dims_[2];
+    std::vector<unsigned int> num_others(num_cells, 0);
+    cell_spheres_.assign(num_cells, 0);
+
+    Vector3d center;
+    double radius;
+    std::vector<bool> is_sphere(parts_.size());
+    std::vector<unsigned int> cells;
+    unsigned int lower[3];
+    unsigned int upper[3];
+
+    auto collect_cells = [&](unsigned int i) {
+        cells.clear();
+        calculate_cell_range(part_bounds[i], lower, upper);
+        for (unsigned int z = lower[2]; z <= upper[2]; z++) {
+            for (unsigned int y = lower[1]; y <= upper[1]; y++) {
+                for (unsigned int x = lower[0]; x <= upper[0]; x++) {
+                    cells.push_back((z * dims_[1] + y) * dims_[0] + x);
+                }
+            }
+        }
+    };
+
+    for (unsigned int i = 0; i < parts_.size(); i++) {
+        if (!is_bounded[i]) {
+            continue;
+        }
+        is_sphere[i] = parts_[i]->get_sphere(&center, &radius);
+        collect_cells(i);
+        for (unsigned int c : cells) {
+            if (is_sphere[i]) {
+                cell_spheres_[c]++;
+            } else {
+                num_others[c]++;
+            }
+        }
+    }
+
+    cell_offsets_.resize(num_cells + 1);
+    cell_offsets_[0] = 0;
+    for (unsigned int c = 0; c < num_cells; c++) {
+        cell_offsets_[c + 1] = cell_offsets_[c] + cell_spheres_[c] + num_others[c];
+    }
+
+    unsigned int num_entries = cell_offsets_[num_cells];
+    cell_parts_.resize(num_entries);
+    bool is_float = (precision_ == Precision::Float);
+    sphere_x_.assign(is_float ? 0 : num_entries, 0);
+    sphere_y_.assign(is_float ? 0 : num_entries, 0);
+    sphere_z_.assign(is_float ? 0 : num_entries, 0);
+    sphere_r_.assign(is_float ? 0 : num_entries, 0);
+    float_sphere_x_.assign(is_float ? num_entries : 0, 0);
+    float_sphere_y_.assign(is_float ? num_entries : 0, 0);
+    float_sphere_z_.assign(is_float ? num_entries : 0, 0);
+    float_sphere_r_.assign(is_float ? num_entries : 0, 0);
+
+    // Spheres fill each cell from its start, the others after them
+    std::vector<unsigned int> next_sphere(cell_offsets_.begin(), cell_offsets_.end() - 1);
+    std::vector<unsigned int> next_other(num_cells);
+    for (unsigned int c = 0; c < num_cells; c++) {
+        next_other[c] = cell_offsets_[c] + cell_spheres_[c];
+    }
+
+    for (unsigned int i = 0; i < parts_.size(); i++) {
+        if (!is_bounded[i]) {
+            continue;
+        }
+        if (is_sphere[i]) {
+            parts_[i]->get_sphere(&center, &radius);
+        }
+        collect_cells(i);
+        for (unsigned int c : cells) {
+            if (!is_sphere[i]) {
+                cell_parts_[next_other[c]++] = i;
+                continue;
+            }
+            unsigned int k = next_sphere[c]++;
+            cell_parts_[k] = i;
+            if (is_float) {
+                float_sphere_x_[k] = static_cast<float>(center[0]);
+                float_sphere_y_[k] = static_cast<float>(center[1]);
+                float_sphere_z_[k] = static_cast<float>(center[2]);
+                float_sphere_r_[k] = static_cast<float>(radius);
+            } else {
+                sphere_x_[k] = center[0];
+                sphere_y_[k] = center[1];
+                sphere_z_[k] = center[2];
+                sphere_r_[k] = radius;
+            }
+        }
+    }
+}
+
+
+/*
+Keeps the spheres in the precision of the BVH, so that a grid finds
+the same hits as the tree would.
+*/
+void MoleculeGrid::set_precision(Precision precision) {
+    if (precision != precision_) {
+        precision_ = precision;
+        rebuild();
+    }
+}
+
+
+void MoleculeGrid::calculate_cell_range(const BoundingBox& bounds,
+                                        unsigned int* lower,
+                                        unsigned int* upper) const {
+    for (unsigned int axis = 0; axis < 3; axis++) {
+        double last = dims_[axis] - 1;
+        double a = std::floor((bounds.lower[axis] - bounds_.lower[axis]) / step_);
+        double b = std::floor((bounds.upper[axis] - bounds_.lower[axis]) / step_);
+        lower[axis] = static_cast<unsigned int>(std::min(std::max(a, 0.0), last));
+        upper[axis] = static_cast<unsigned int>(std::min(std::max(b, 0.0), last));
+    }
+}
+
+
+/*
+Walks the cells along the ray from where it enters the grid, the
+nearest hit is final once it lies before the far side of the cell
+it was found in. Equal hits go to the part added first, as in the
+BVH. Returns the distance and sets hit_part, or returns -1.
+*/
+double MoleculeGrid::solve_cells(const Vector3d& O,
+                                 const Vector3d& D,
+                                 double min_dist,
+                                 double max_dist,
+                                 unsigned int* hit_part) const {
+    if (cell_parts_.empty()) {
+        return -1;
+    }
+
+    double t_near = min_dist;
+    double t_far = max_dist;
+    for (unsigned int axis = 0; axis < 3; axis++) {
+        double inv_D = 1 / D[axis];
+        double ta = (bounds_.lower[axis] - O[axis]) * inv_D;
+        double tb = (bounds_.upper[axis] - O[axis]) * inv_D;
+        if (ta > tb) {
+            std::swap(ta, tb);
+        }
+        // NaN from rays parallel to a face fails both tests and keeps the box
+        t_near = (ta > t_near) ? ta : t_near;
+        t_far = (tb < t_far) ? tb : t_far;
+        if (t_near > t_far) {
+            return -1;
+        }
+    }
+
+    const double highest = std::numeric_limits<double>::infinity();
+    Vector3d start = O + t_near * D;
+    int cell[3];
+    int step[3];
+    double t_next[3];
+    double t_delta[3];
+    for (unsigned int axis = 0; axis < 3; axis++) {
+        double c = std::floor((start[axis] - bounds_.lower[axis]) / step_);
+        cell[axis] = static_cast<int>(std::min(std::max(c, 0.0), dims_[axis] - 1.0));
+        double boundary = bounds_.lower[axis] + cell[axis] * step_;
+        if (D[axis] > 0) {
+            step[axis] = 1;
+            t_next[axis] = (boundary + step_ - O[axis]) / D[axis];
+            t_delta[axis] = step_ / D[axis];
+        } else if (D[axis] < 0) {
+            step[axis] = -1;
+            t_next[axis] = (boundary - O[axis]) / D[axis];
+            t_delta[axis] = -step_ / D[axis];
+        } else {
+            step[axis] = 0;
+            t_next[axis] = highest;
+            t_delta[axis] = highest;
+        }
+    }
+
+    const KernelTable& kernels = get_kernels();
+    bool is_float = (precision_ == Precision::Float);
+    float float_O[3] = {static_cast<float>(O[0]), static_cast<float>(O[1]), static_cast<float>(O[2])};
+    float float_D[3] = {static_cast<float>(D[0]), static_cast<float>(D[1]), static_cast<float>(D[2])};
+    double distances[kSphereBatch];
+    float float_distances[kSphereBatch];
+    double best_dist = -1;
+    unsigned int best_part = 0;
+    bool is_kernel_hit = false;
+
+    auto test_distance = [&](unsigned int part, double distance, bool is_kernel) {
+        if (distance > 0 && (best_dist < 0 || distance < best_dist ||
+                             (distance == best_dist && part < best_part))) {
+            best_dist = distance;
+            best_part = part;
+            is_kernel_hit = is_kernel;
+        }
+    };
+
+    while (true) {
+        unsigned int c = (cell[2] * dims_[1] + cell[1]) * dims_[0] + cell[0];
+        unsigned int first = cell_offsets_[c];
+        unsigned int spheres_end = first + cell_spheres_[c];
+
+        for (unsigned int k = first; k < spheres_end; k += kSphereBatch) {
+            unsigned int count = std::min(kSphereBatch, spheres_end - k);
+            if (is_float) {
+                kernels.intersect_spheres_float(float_O, float_D, &float_sphere_x_[k],
+                                                &float_sphere_y_[k], &float_sphere_z_[k],
+                                                &float_sphere_r_[k], count,
+                                                static_cast<float>(min_dist),
+                                                static_cast<float>(max_dist), float_distances);
+                for (unsigned int i = 0; i < count; i++) {
+                    test_distance(cell_parts_[k + i], float_distances[i], true);
+                }
+            } else {
+                kernels.intersect_spheres(O.data(), D.data(), &sphere_x_[k], &sphere_y_[k],
+                                          &sphere_z_[k], &sphere_r_[k], count,
+                                          min_dist, max_dist, distances);
+                for (unsigned int i = 0; i < count; i++) {
+                    test_distance(cell_parts_[k + i], distances[i], false);
+                }
+            }
+        }
+        for (unsigned int k = spheres_end; k < cell_offsets_[c + 1]; k++) {
+            unsigned int part = cell_parts_[k];
+            test_distance(part, parts_[part]->solve_light_ray(O, D, min_dist, max_dist), false);
+        }
+
+        unsigned int axis = 0;
+        if (t_next[1] < t_next[axis])
+            axis = 1;
+        if (t_next[2] < t_next[axis])
+            axis = 2;
+
+        // Parts reaching into later cells may still be hit before best_dist
+        if ((best_dist > 0 && best_dist <= t_next[axis]) || t_next[axis] > t_far) {
+            break;
+        }
+        cell[axis] += step[axis];
+        if (cell[axis] < 0 || cell[axis] >= static_cast<int>(dims_[axis])) {
+            break;
+        }
+        t_next[axis] += t_delta[axis];
+    }
+
+    // Hits are shaded in double, so a float sphere distance is solved again
+    if (is_kernel_hit) {
+        double distance = parts_[best_part]->solve_light_ray(O, D, min_dist, max_dist);
+        if (distance > 0) {
+            best_dist = distance;
+        }
+    }
+    *hit_part = best_part;
+    return best_dist;
+}
+
+
+double MoleculeGrid::solve_light_ray(const Vector3d& O,
+                                     const Vector3d& D,
+                                     double min_dist,
+                                     double max_dist) const {
+    unsigned int part;
+    return solve_cells(O, D, min_dist, max_dist, &part);
+}
+
+
+ActorBase* MoleculeGrid::solve_hit(const Vector3d& O,
+                                   const Vector3d& D,
+                                   double min_dist,
+                                   double max_dist,
+                                   double* distance) {
+    unsigned int part;
+    *distance = solve_cells(O, D, min_dist, max_dist, &part);
+    return (*distance > 0) ? parts_[part] : nullptr;
+}
+
+
+/*
+Only for callers that hold the grid instead of the part that was
+hit: the normal of a part in the cell of the hit whose bounds hold it.
+Points on no part are an error.
+*/
+Vector3d MoleculeGrid::calculate_normal_at_hit(const Vector3d& hit) const {
+    BoundingBox point{hit, hit};
+    unsigned int lower[3];
+    unsigned int upper[3];
+    calculate_cell_range(point, lower, upper);
+    unsigned int c = (lower[2] * dims_[1] + lower[1]) * dims_[0] + lower[0];
+
+    BoundingBox bounds;
+    for (unsigned int k = cell_offsets_[c]; k < cell_offsets_[c + 1]; k++) {
+        ActorBase* part = parts_[cell_parts_[k]];
+        part->calculate_bounds(&bounds);
+        pad_bounds(&bounds);
+        if ((hit.array() >= bounds.lower.array()).all() && (hit.array() <= bounds.upper.array()).all()) {
+            return part->calculate_normal_at_hit(hit);
+        }
+    }
+    LOG(ERROR) << "No part of the molecule grid at the hit";
+    return Vector3d{0, 0, 1};
+}
+
+
+bool MoleculeGrid::has_shadow() const {
+    return true;
+}
+
+
+bool MoleculeGrid::calculate_bounds(BoundingBox* bounds) const {
+    if (cell_parts_.empty()) {
+        return false;
+    }
+    *bounds = bounds_;
+    return true;
+}
+
+
+unsigned int MoleculeGrid::get_num_cells() const {
+    return dims_[0] * dims_[1] * dims_[2];
+}
+
+
+}  //namespace mrtp
@@ -0,0 +1,77 @@
+#ifndef _GRID_H
+#define _GRID_H
+
+#include <vector>
+#include <Eigen/Core>
+
+#include "actors.h"
+#include "common.h"
+
+
+namespace mrtp {
+
+using Vector3d = Eigen::Vector3d;
+
+
+/*
+Uniform grid over the atoms and bonds of one molecule, which stands
+in the world as a single actor. Cells list the parts whose bounds
+reach into them, spheres first, in one index array with an offset
+per cell. Rays walk the cells in order and stop in the first cell
+that holds a hit before its far side. Hits are reported on the parts,
+so shading never asks the grid itself. Suits molecules with atoms
+of similar size, packed evenly. In float precision spheres are kept
+and intersected as floats, as in the BVH.
+*/
+class MoleculeGrid : public ActorBase {
+public:
+    MoleculeGrid(const std::vector<ActorBase*>&, double, TextureMapper*);
+    MoleculeGrid() = delete;
+    ~MoleculeGrid() override = default;
+
+    double solve_light_ray(const Vector3d&, const Vector3d&, double, double) const override;
+    ActorBase* solve_hit(const Vector3d&, const Vector3d&, double, double, double*) override;
+    Vector3d calculate_normal_at_hit(const Vector3d&) const override;
+    bool has_shadow() const override;
+    bool calculate_bounds(BoundingBox*) const override;
+
+    // Sorts the parts into the cells again, after they moved
+    void rebuild();
+    void set_precision(Precision);
+
+    unsigned int get_num_cells() const;
+
+private:
+    std::vector<ActorBase*> parts_;
+    double cell_size_;
+    Precision precision_ = Precision::Double;
+
+    BoundingBox bounds_;
+    double step_;               // Edge of the cells, at least cell_size_
+    unsigned int dims_[3];
+
+    // Parts of cell c are cell_parts_[cell_offsets_[c]] up to the
+    // offset of c + 1, the first cell_spheres_[c] of them are spheres
+    std::vector<unsigned int> cell_offsets_;
+    std::vector<unsigned int> cell_spheres_;
+    std::vector<unsigned int> cell_parts_;
+
+    // Centers and radii of the sphere entries in cell_parts_, only
+    // the arrays of the current precision are filled
+    std::vector<double> sphere_x_;
+    std::vector<double> sphere_y_;
+    std::vector<double> sphere_z_;
+    std::vector<double> sphere_r_;
+    std::vector<float> float_sphere_x_;
+    std::vector<float> float_sphere_y_;
+    std::vector<float> float_sphere_z_;
+    std::vector<float> float_sphere_r_;
+
+    double solve_cells(const Vector3d&, const Vector3d&, double, double, unsigned int*) const;
+    void calculate_cell_range(const BoundingBox&, unsigned int*, unsigned int*) const;
+};
+
+
+}  //namespace mrtp
+
+#endif  //_GRID_H
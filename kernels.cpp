@@ -0,0 +1,88 @@
+#include <easylogging++.h>
+
+#include "kernels.h"
+
+
+namespace mrtp {
+
+struct KernelLevel {
+    const KernelTable* table;
+    bool (*is_supported)();
+};
+
+
+static bool supports_base() {
+    return true;
+}
+
+
+static bool supports_sse42() {
+    return __builtin_cpu_supports("sse4.2");
+}
+
+
+static bool supports_avx2() {
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+}
+
+
+static bool supports_avx512() {
+    return supports_avx2() && __builtin_cpu_supports("avx512f");
+}
+
+
+// Best level first
+static const KernelLevel kKernelLevels[] = {
+    {&kernels_avx512, supports_avx512},
+    {&kernels_avx2, supports_avx2},
+    {&kernels_sse42, supports_sse42},
+    {&kernels_base, supports_base}
+};
+
+
+static const KernelTable* detect_kernels() {
+    __builtin_cpu_init();
+    for (const auto& level : kKernelLevels) {
+        if (level.is_supported()) {
+            return level.table;
+        }
+    }
+    return &kernels_base;
+}
+
+
+static const KernelTable* active_kernels = detect_kernels();
+
+
+const KernelTable& get_kernels() {
+    return *active_kernels;
+}
+
+
+/*
+Forces one of base, sse4.2, avx2 or avx512, or auto for the best level
+of this CPU. Call it before rendering starts.
+*/
+bool select_kernels(const std::string& name) {
+    if (name == "auto") {
+        active_kernels = detect_kernels();
+        return true;
+    }
+
+    __builtin_cpu_init();
+    for (const auto& level : kKernelLevels) {
+        if (name == level.table->name) {
+            if (!level.is_supported()) {
+                LOG(ERROR) << "Kernels for " << name << " are not supported by this CPU";
+                return false;
+            }
+            active_kernels = level.table;
+            return true;
+        }
+    }
+    LOG(ERROR) << "Unknown kernel level " << name;
+    return false;
+}
+
+
+}  //namespace mrtp
@@ -0,0 +1,51 @@
+#ifndef _KERNELS_H
+#define _KERNELS_H
+
+#include <cstddef>
+#include <string>
+
+
+namespace mrtp {
+
+/*
+Hot loops compiled once per instruction set. All variants are built
+from kernels_impl.h without floating point contraction, so they give
+the same results and only differ in speed. Vectors are passed as
+pointers to three doubles, like the data of an Eigen::Vector3d.
+*/
+struct KernelTable {
+    const char* name;
+
+    // Distances to count spheres, or -1 for spheres that are missed
+    void (*intersect_spheres)(const double*, const double*,
+                              const double*, const double*, const double*, const double*,
+                              unsigned int, double, double, double*);
+
+    // Same in single precision
+    void (*intersect_spheres_float)(const float*, const float*,
+                                    const float*, const float*, const float*, const float*,
+                                    unsigned int, float, float, float*);
+
+    // Origins and directions of the primary rays in one window row
+    void (*generate_rays)(const double*, const double*, const double*, const double*,
+                          unsigned int, unsigned int, unsigned int, double*, double*);
+
+    // Color channels to bytes, clamped to 0..1
+    void (*convert_pixels)(const double*, std::size_t, unsigned char*);
+};
+
+
+extern const KernelTable kernels_base;
+extern const KernelTable kernels_sse42;
+extern const KernelTable kernels_avx2;
+extern const KernelTable kernels_avx512;
+
+
+const KernelTable& get_kernels();
+
+bool select_kernels(const std::string&);
+
+
+}  //namespace mrtp
+
+#endif  //_KERNELS_H
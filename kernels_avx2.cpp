@@ -0,0 +1,4 @@
+#define MRTP_KERNEL_TABLE kernels_avx2
+#define MRTP_KERNEL_NAME "avx2"
+
+#include "kernels_impl.h"
@@ -0,0 +1,4 @@
+#define MRTP_KERNEL_TABLE kernels_avx512
+#define MRTP_KERNEL_NAME "avx512"
+
+#include "kernels_impl.h"
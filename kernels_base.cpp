@@ -0,0 +1,4 @@
+#define MRTP_KERNEL_TABLE kernels_base
+#define MRTP_KERNEL_NAME "base"
+
+#include "kernels_impl.h"
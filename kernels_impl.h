@@ -0,0 +1,126 @@
+/*
+Kernel bodies, included once by every kernels_<isa>.cpp with
+MRTP_KERNEL_TABLE set to the name of the table to define.
+No Eigen or other inline library code may be used here, or the linker
+could pick an instance built for a newer instruction set.
+*/
+#include <cmath>
+#include <cstddef>
+
+#include "kernels.h"
+
+#ifndef MRTP_KERNEL_TABLE
+#error "MRTP_KERNEL_TABLE must be defined"
+#endif
+
+
+namespace mrtp {
+
+namespace {
+
+/*
+Same arithmetic as SimpleSphere::solve_light_ray, written without
+branches so the loop can be vectorized. The float version does the
+same steps in single precision.
+*/
+template <typename T>
+void intersect_spheres(const T* O,
+                       const T* D,
+                       const T* x,
+                       const T* y,
+                       const T* z,
+                       const T* r,
+                       unsigned int count,
+                       T min_dist,
+                       T max_dist,
+                       T* distances) {
+    const T zero = static_cast<T>(0.0001);
+
+    T a = (D[0] * D[0] + D[1] * D[1]) + D[2] * D[2];
+    T h = static_cast<T>(0.5) / a;
+    T a2 = 2 * a;
+
+    for (unsigned int k = 0; k < count; k++) {
+        T tx = O[0] - x[k];
+        T ty = O[1] - y[k];
+        T tz = O[2] - z[k];
+
+        T b = 2 * ((D[0] * tx + D[1] * ty) + D[2] * tz);
+        T c = ((tx * tx + ty * ty) + tz * tz) - r[k] * r[k];
+
+        T delta = b * b - 4 * a * c;
+        T sq = std::sqrt(delta < 0 ? 0 : delta);
+        T ta = (-b - sq) * h;
+        T tb = (-b + sq) * h;
+
+        T d = (ta < tb) ? ta : tb;
+        d = (delta < zero) ? -b / a2 : d;
+        d = (delta < 0) ? -1 : d;
+        distances[k] = (d > min_dist && d < max_dist) ? d : -1;
+    }
+}
+
+
+/*
+Same arithmetic as Camera::calculate_origin and
+Camera::calculate_direction.
+*/
+void generate_rays(const double* window_origin,
+                   const double* window_h,
+                   const double* window_v,
+                   const double* eye,
+                   unsigned int x0,
+                   unsigned int y,
+                   unsigned int count,
+                   double* origins,
+                   double* directions) {
+    double fy = static_cast<double>(y);
+
+    for (unsigned int k = 0; k < count; k++) {
+        double fx = static_cast<double>(x0 + k);
+
+        double ox = window_origin[0] + fx * window_h[0] + fy * window_v[0];
+        double oy = window_origin[1] + fx * window_h[1] + fy * window_v[1];
+        double oz = window_origin[2] + fx * window_h[2] + fy * window_v[2];
+
+        double dx = ox - eye[0];
+        double dy = oy - eye[1];
+        double dz = oz - eye[2];
+        double inv = 1 / std::sqrt((dx * dx + dy * dy) + dz * dz);
+
+        origins[3 * k] = ox;
+        origins[3 * k + 1] = oy;
+        origins[3 * k + 2] = oz;
+        directions[3 * k] = dx * inv;
+        directions[3 * k + 1] = dy * inv;
+        directions[3 * k + 2] = dz * inv;
+    }
+}
+
+
+/*
+Channels are clamped to 0..1 first, reflections scaled up by the
+roulette may add up to more than 1.
+*/
+void convert_pixels(const double* values, std::size_t count, unsigned char* bytes) {
+    for (std::size_t i = 0; i < count; i++) {
+        double v = (values[i] < 0) ? 0 : values[i];
+        v = (v > 1) ? 1 : v;
+        bytes[i] = static_cast<unsigned char>(255 * v);
+    }
+}
+
+
+}  //namespace
+
+
+extern const KernelTable MRTP_KERNEL_TABLE = {
+    MRTP_KERNEL_NAME,
+    intersect_spheres<double>,
+    intersect_spheres<float>,
+    generate_rays,
+    convert_pixels
+};
+
+
+}  //namespace mrtp
@@ -0,0 +1,4 @@
+#define MRTP_KERNEL_TABLE kernels_sse42
+#define MRTP_KERNEL_NAME "sse4.2"
+
+#include "kernels_impl.h"
@@ -1,10 +1,30 @@
+#include <algorithm>
+
 #include "light.h"
 
 
 namespace mrtp {
 
-Light::Light(const Eigen::Vector3d& center) : center_(center) {
+// Extent of a cluster over its distance up to which it shines as one light
+const double kClusterAngle = 0.5;
+
+
+Light::Light(const Eigen::Vector3d& center, double intensity) :
+  center_(center),
+  intensity_(intensity) {
+
+}
+
+void Light::set_center(const Eigen::Vector3d& center) {
+  center_ = center;
+}
+
+const Eigen::Vector3d& Light::get_center() const {
+  return center_;
+}
 
+double Light::get_intensity() const {
+  return intensity_;
 }
 
 Eigen::Vector3d Light::calculate_ray(const Eigen::Vector3d& hit) const {
@@ -12,4 +32,129 @@ Eigen::Vector3d Light::calculate_ray(const Eigen::Vector3d& hit) const {
 }
 
 
+void LightTree::build(const std::vector<const Light*>& lights) {
+  lights_ = lights;
+  nodes_.clear();
+  if (lights_.empty()) {
+    return;
+  }
+  // Children are stored next to each other, the right one at first + 1
+  nodes_.reserve(2 * lights_.size());
+  nodes_.push_back(LightNode());
+  build_node(0, 0, lights_.size());
+}
+
+void LightTree::build_node(unsigned int index, unsigned int first, unsigned int count) {
+  Eigen::Vector3d lower = lights_[first]->get_center();
+  Eigen::Vector3d upper = lower;
+  Eigen::Vector3d center = Eigen::Vector3d::Zero();
+  double intensity = 0;
+  for (unsigned int i = first; i < first + count; i++) {
+    lower = lower.cwiseMin(lights_[i]->get_center());
+    upper = upper.cwiseMax(lights_[i]->get_center());
+    center += lights_[i]->get_intensity() * lights_[i]->get_center();
+    intensity += lights_[i]->get_intensity();
+  }
+
+  LightNode& node = nodes_[index];
+  node.lower = lower;
+  node.upper = upper;
+  node.center = (intensity > 0) ? Eigen::Vector3d(center / intensity) : Eigen::Vector3d(0.5 * (lower + upper));
+  node.intensity = intensity;
+  node.extent = (upper - lower).norm();
+
+  // Leaves keep the light as it is
+  if (count == 1) {
+    node.center = lights_[first]->get_center();
+    node.first = first;
+    node.is_leaf = true;
+    return;
+  }
+
+  int axis;
+  (upper - lower).maxCoeff(&axis);
+  unsigned int half = count / 2;
+  std::nth_element(lights_.begin() + first, lights_.begin() + first + half, lights_.begin() + first + count,
+                   [axis](const Light* a, const Light* b) {
+    return a->get_center()(axis) < b->get_center()(axis);
+  });
+
+  unsigned int left = nodes_.size();
+  node.first = left;
+  node.is_leaf = false;
+  nodes_.push_back(LightNode());
+  nodes_.push_back(LightNode());
+  build_node(left, first, half);
+  build_node(left + 1, first + half, count - half);
+}
+
+/*
+A node is reachable if part of its box is in front of the hit and
+nearer than max_distance. It is wide if it is a cluster that looks
+too large from the hit to shine as one light.
+*/
+bool LightTree::is_reachable(const LightNode& node,
+                             const Eigen::Vector3d& hit,
+                             const Eigen::Vector3d& normal,
+                             double max_distance,
+                             bool* is_wide) const {
+  Eigen::Vector3d nearest = hit.cwiseMax(node.lower).cwiseMin(node.upper);
+  double distance = (nearest - hit).norm();
+  if (distance >= max_distance) {
+    return false;
+  }
+  // Corner farthest along the normal
+  Eigen::Vector3d front = (normal.array() > 0).select(node.upper, node.lower);
+  if ((front - hit).dot(normal) <= 0) {
+    return false;
+  }
+  *is_wide = !node.is_leaf && node.extent > kClusterAngle * distance;
+  return true;
+}
+
+unsigned int LightTree::collect_lights(const Eigen::Vector3d& hit,
+                                       const Eigen::Vector3d& normal,
+                                       double max_distance,
+                                       LightPoint* lights) const {
+  if (nodes_.empty()) {
+    return 0;
+  }
+
+  unsigned int num_lights = 0;
+  unsigned int stack[kMaxLightCut];
+  unsigned int stack_size = 0;
+  stack[stack_size++] = 0;
+
+  while (stack_size > 0) {
+    unsigned int node_index = stack[--stack_size];
+    const LightNode& node = nodes_[node_index];
+    bool is_wide;
+    if (!is_reachable(node, hit, normal, max_distance, &is_wide)) {
+      continue;
+    }
+    // Children are only visited while every node in the stack can
+    // still take an entry in the cut
+    if (is_wide && num_lights + stack_size + 2 <= kMaxLightCut) {
+      stack[stack_size++] = node.first;
+      stack[stack_size++] = node.first + 1;
+      continue;
+    }
+    lights[num_lights].center = node.center;
+    lights[num_lights].intensity = node.intensity;
+    lights[num_lights].index = node_index;
+    num_lights++;
+  }
+  return num_lights;
+}
+
+const Light* LightTree::get_light(unsigned int node_index) const {
+  const LightNode& node = nodes_[node_index];
+  return node.is_leaf ? lights_[node.first] : nullptr;
+}
+
+unsigned int LightTree::get_num_nodes() const {
+  return nodes_.size();
+}
+
+
 } //namespace mrtp
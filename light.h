@@ -1,6 +1,7 @@
 #ifndef _LIGHT_H
 #define _LIGHT_H
 
+#include <vector>
 #include <Eigen/Core>
 
 
@@ -8,13 +9,78 @@ namespace mrtp {
 
 class Light {
 public:
-    Light(const Eigen::Vector3d& center);
+    Light(const Eigen::Vector3d& center, double intensity = 1);
     ~Light() = default;
 
+    void set_center(const Eigen::Vector3d& center);
+
+    const Eigen::Vector3d& get_center() const;
+    double get_intensity() const;
+
     Eigen::Vector3d calculate_ray(const Eigen::Vector3d& hit) const;
 
 private:
     Eigen::Vector3d center_;
+    double intensity_;
+};
+
+
+/*
+Light or cluster of lights seen from a hit, a cluster shines with
+the summed intensity of its lights from their weighted center.
+*/
+struct LightPoint {
+    Eigen::Vector3d center;
+    double intensity;
+    unsigned int index;   // Node of the tree, the same for all hits
+};
+
+
+const unsigned int kMaxLightCut = 32;
+
+
+/*
+Binary tree over the lights of a world, split at the median of the
+longest axis. A hit sees a cut through the tree: subtrees behind its
+surface or out of reach are dropped, and clusters that look small
+from the hit shine as one light. Scenes with any number of lights
+cost at most kMaxLightCut lights per hit.
+*/
+class LightTree {
+public:
+    LightTree() = default;
+    ~LightTree() = default;
+
+    void build(const std::vector<const Light*>&);
+
+    // Writes up to kMaxLightCut lights and clusters in front of the
+    // hit and nearer than max_distance
+    unsigned int collect_lights(const Eigen::Vector3d& hit,
+                                const Eigen::Vector3d& normal,
+                                double max_distance,
+                                LightPoint* lights) const;
+
+    // Light of a leaf node, nullptr for clusters
+    const Light* get_light(unsigned int) const;
+    unsigned int get_num_nodes() const;
+
+private:
+    struct LightNode {
+        Eigen::Vector3d lower;
+        Eigen::Vector3d upper;
+        Eigen::Vector3d center;
+        double intensity;
+        double extent;
+        unsigned int first;   // Light of leaves, left child of inner nodes
+        bool is_leaf;
+    };
+
+    void build_node(unsigned int, unsigned int, unsigned int);
+    bool is_reachable(const LightNode&, const Eigen::Vector3d&, const Eigen::Vector3d&,
+                      double, bool*) const;
+
+    std::vector<LightNode> nodes_;
+    std::vector<const Light*> lights_;
 };
 
 
@@ -1,16 +1,25 @@
+#include <algorithm>
 #include <memory>
 #include <vector>
 #include <string>
 #include <sstream>
 #include <iostream>
 #include <cstdlib>
+#include <cstdio>
+#include <getopt.h>
 #include <unistd.h>
 #include <iomanip>
 #include <easylogging++.h>
 
+#include "animation.h"
+#include "checkpoint.h"
+#include "relight.h"
 #include "world.h"
 #include "renderer.h"
+#include "stream.h"
 #include "texture.h"
+#include "kernels.h"
+#include "trace.h"
 
 INITIALIZE_EASYLOGGINGPP
 
@@ -95,6 +104,99 @@ bool parse_threads(const std::string& s,
 }
 
 
+bool parse_aa_samples(const std::string& s,
+                      RendererConfig* config) {
+    std::stringstream convert(s);
+    convert >> config->aa_samples;
+
+    bool is_parsed;
+    if (!(is_parsed = !convert.fail())) {
+        LOG(ERROR) << "Error parsing anti-aliasing samples";
+        return is_parsed;
+    }
+    if (!(is_parsed = config->aa_samples >= 1 &&
+          config->aa_samples <= 64)) {
+        LOG(ERROR) << "Anti-aliasing samples are out of range";
+    }
+
+    return is_parsed;
+}
+
+
+bool parse_min_contribution(const std::string& s,
+                            RendererConfig* config) {
+    std::stringstream convert(s);
+    convert >> config->min_contribution;
+
+    bool is_parsed;
+    if (!(is_parsed = !convert.fail())) {
+        LOG(ERROR) << "Error parsing minimum contribution";
+        return is_parsed;
+    }
+    if (!(is_parsed = config->min_contribution >= 0 &&
+          config->min_contribution <= 1)) {
+        LOG(ERROR) << "Minimum contribution is out of range";
+    }
+
+    return is_parsed;
+}
+
+
+bool parse_shadow_lights(const std::string& s,
+                         RendererConfig* config) {
+    std::stringstream convert(s);
+    convert >> config->max_shadow_lights;
+
+    bool is_parsed;
+    if (!(is_parsed = !convert.fail())) {
+        LOG(ERROR) << "Error parsing number of shadow lights";
+        return is_parsed;
+    }
+    if (!(is_parsed = config->max_shadow_lights >= 1 &&
+          config->max_shadow_lights <= mrtp::kMaxLightCut)) {
+        LOG(ERROR) << "Number of shadow lights is out of range";
+    }
+
+    return is_parsed;
+}
+
+
+bool parse_shadow_map(const std::string& s,
+                      RendererConfig* config) {
+    std::stringstream convert(s);
+    convert >> config->shadow_map_size;
+
+    bool is_parsed;
+    if (!(is_parsed = !convert.fail())) {
+        LOG(ERROR) << "Error parsing shadow map size";
+        return is_parsed;
+    }
+    if (!(is_parsed = config->shadow_map_size <= 1024)) {
+        LOG(ERROR) << "Shadow map size is out of range";
+    }
+
+    return is_parsed;
+}
+
+
+bool parse_time_budget(const std::string& s,
+                       RendererConfig* config) {
+    std::stringstream convert(s);
+    convert >> config->time_budget;
+
+    bool is_parsed;
+    if (!(is_parsed = !convert.fail())) {
+        LOG(ERROR) << "Error parsing time budget";
+        return is_parsed;
+    }
+    if (!(is_parsed = config->time_budget > 0)) {
+        LOG(ERROR) << "Time budget is out of range";
+    }
+
+    return is_parsed;
+}
+
+
 bool parse_resolution(const std::string& str,
                       RendererConfig* config) {
     bool is_parsed = true;
@@ -163,8 +265,11 @@ bool apply_option_parser(int c,
 void display_help() {
     std::cout << R"(Usage: mrtp_cli [OPTION]... FILE...
   Options:
+    -c   journal finished tiles to OUTPUT.ckpt while rendering
     -d   distance to darken light
     -f   field of vision in degrees
+    -F   output format: png (default), rgb24 or y4m; rgb24 and y4m
+         write all frames to one stream, use -o - for stdout
     -h   print this help screen
     -o   output filename in PNG format
     -q   suppress messages, except errors
@@ -172,9 +277,94 @@ void display_help() {
     -R   levels of recursion for reflected rays
     -s   shadow factor
     -t   rendering threads: 0 (auto), 1, 2, ...
+    --aa N
+         up to N samples for pixels on edges of actors, shadows and
+         textures, rounded down to 4, 9, 16, ... (default 1, off)
+    --deferred
+         shade the hits of each reflection level grouped by texture
+    --isa LEVEL
+         kernels to use: auto (default), base, sse4.2, avx2 or avx512
+    --min-contribution W
+         skip reflected rays that make up less than W of their pixel,
+         0 traces all (default 0.0039, one 8-bit colour step)
+    --precision TYPE
+         float or double (default) for boxes and spheres, float is
+         faster and may move edges of spheres by a fraction of a pixel
+    --raster
+         rasterize spheres, triangles and planes into a buffer of the
+         nearest actor and distance for every tile, primary rays are
+         traced only where other actors may be in front
+    --relight
+         keep primary hits in OUTPUT.hits and reuse them while only
+         the light, -d or -s change; ignores --deferred
+    --resume
+         skip tiles already in OUTPUT.ckpt, implies -c
+    --roulette
+         trace some of the rays --min-contribution skips, with their
+         colour scaled up, so that the image is unbiased but noisy
+    --shadow-lights N
+         shadow rays per hit, for the N strongest lights there, up to
+         32; other lights are dimmed like them (default 4)
+    --shadow-map SIZE
+         build a cube map of SIZE x SIZE texels per face around every
+         light, which answers most shadow rays without tracing them;
+         0 for none (default), takes 144 * SIZE * SIZE bytes per light,
+         the weakest lights get none once the maps would pass 1 GiB
+    --sort-rays
+         sort reflected rays by direction and origin before tracing
+    --time-budget SECONDS
+         finish each frame within SECONDS, lowering anti-aliasing
+         and then reflection depth as needed; not with -c, --relight
+         or --resume
+    --trace FILE
+         write a timeline of threads and tiles to FILE in Chrome
+         trace format, open it in Perfetto or chrome://tracing
 
 Example:
-  mrtp_cli -r 1620x1080 -f 110.0 -o scene2.png scene2.toml)" << std::endl;
+  mrtp_cli -r 1620x1080 -f 110.0 -o scene2.png scene2.toml
+  mrtp_cli -F rgb24 -o - turntable.toml | \
+      ffmpeg -f rawvideo -pix_fmt rgb24 -s 640x480 -i - turntable.mp4)" << std::endl;
+}
+
+
+/*
+Lists the settings a time budget lowered, for the log.
+*/
+std::string describe_quality(const mrtp::QualityReport& quality,
+                             const RendererConfig& config) {
+    std::stringstream convert;
+    std::string separator;
+    if (quality.aa_samples < config.aa_samples) {
+        convert << "anti-aliasing " << config.aa_samples << " -> " << quality.aa_samples << " samples";
+        separator = ", ";
+    }
+    if (quality.max_ray_depth < config.max_ray_depth) {
+        convert << separator << "reflection depth " << config.max_ray_depth << " -> " << quality.max_ray_depth;
+        separator = ", ";
+    }
+    if (quality.num_fallback_tiles > 0) {
+        convert << separator << quality.num_fallback_tiles << " of " << quality.num_tiles
+                << " tiles from the first pass";
+    }
+
+    std::string description = convert.str();
+    return (description.empty()) ? "full quality" : description;
+}
+
+
+std::string create_frame_filename(const std::string& png_file,
+                                  unsigned int frame) {
+    std::string stem(png_file);
+    std::string extension;
+    size_t pos = png_file.rfind('.');
+    if (pos != std::string::npos) {
+        stem = png_file.substr(0, pos);
+        extension = png_file.substr(pos);
+    }
+
+    std::stringstream convert;
+    convert << stem << "_" << std::setfill('0') << std::setw(4) << frame << extension;
+    return convert.str();
 }
 
 
@@ -183,23 +373,119 @@ bool process_command_line(int argc,
                           RendererConfig* renderer_config,
                           std::vector<std::string>* input_files,
                           std::string* output_file,
-                          bool* quiet_mode) {
+                          std::string* output_format,
+                          bool* quiet_mode,
+                          bool* checkpoint_mode,
+                          bool* resume_mode,
+                          bool* relight_mode,
+                          std::string* trace_file,
+                          mrtp::Precision* precision) {
     if (argc < 2) {
         display_help();
         return false;
     }
 
+    static const struct option long_options[] = {
+        {"aa", required_argument, nullptr, 'A'},
+        {"deferred", no_argument, nullptr, 'D'},
+        {"isa", required_argument, nullptr, 'I'},
+        {"min-contribution", required_argument, nullptr, 'W'},
+        {"precision", required_argument, nullptr, 'P'},
+        {"raster", no_argument, nullptr, 'Z'},
+        {"relight", no_argument, nullptr, 'L'},
+        {"resume", no_argument, nullptr, 'u'},
+        {"roulette", no_argument, nullptr, 'O'},
+        {"shadow-lights", required_argument, nullptr, 'K'},
+        {"shadow-map", required_argument, nullptr, 'M'},
+        {"sort-rays", no_argument, nullptr, 'S'},
+        {"time-budget", required_argument, nullptr, 'B'},
+        {"trace", required_argument, nullptr, 'T'},
+        {nullptr, 0, nullptr, 0}
+    };
+
     int c;
     *quiet_mode = false;
+    *checkpoint_mode = false;
+    *resume_mode = false;
+    *relight_mode = false;
 
-    while ((c = getopt(argc, argv, "d:f:ho:qr:R:s:t:")) != -1) {
+    while ((c = getopt_long(argc, argv, "cd:f:F:ho:qr:R:s:t:", long_options, nullptr)) != -1) {
         if (c == 'h') {
             display_help();
             return false;
         }
+        else if (c == 'c') {
+            *checkpoint_mode = true;
+        }
+        else if (c == 'u') {
+            *checkpoint_mode = true;
+            *resume_mode = true;
+        }
+        else if (c == 'L') {
+            *relight_mode = true;
+        }
         else if (c == 'o') {
             *output_file = std::string(optarg);
         }
+        else if (c == 'T') {
+            *trace_file = std::string(optarg);
+        }
+        else if (c == 'D') {
+            renderer_config->deferred_shading = true;
+        }
+        else if (c == 'A') {
+            if (!parse_aa_samples(optarg, renderer_config)) {
+                return false;
+            }
+        }
+        else if (c == 'B') {
+            if (!parse_time_budget(optarg, renderer_config)) {
+                return false;
+            }
+        }
+        else if (c == 'W') {
+            if (!parse_min_contribution(optarg, renderer_config)) {
+                return false;
+            }
+        }
+        else if (c == 'O') {
+            renderer_config->russian_roulette = true;
+        }
+        else if (c == 'K') {
+            if (!parse_shadow_lights(optarg, renderer_config)) {
+                return false;
+            }
+        }
+        else if (c == 'M') {
+            if (!parse_shadow_map(optarg, renderer_config)) {
+                return false;
+            }
+        }
+        else if (c == 'Z') {
+            renderer_config->raster_primary = true;
+        }
+        else if (c == 'S') {
+            renderer_config->sort_reflections = true;
+        }
+        else if (c == 'I') {
+            if (!mrtp::select_kernels(std::string(optarg))) {
+                return false;
+            }
+        }
+        else if (c == 'P') {
+            std::string precision_name(optarg);
+            if (precision_name == "float") {
+                *precision = mrtp::Precision::Float;
+            } else if (precision_name == "double") {
+                *precision = mrtp::Precision::Double;
+            } else {
+                LOG(ERROR) << "Unknown precision " << precision_name;
+                return false;
+            }
+        }
+        else if (c == 'F') {
+            *output_format = std::string(optarg);
+        }
         else if (c == 'q') {
             *quiet_mode = true;
         }
@@ -226,7 +512,13 @@ bool process_command_line(int argc,
 
 int main(int argc, char** argv) {
     bool quiet_flag = false;
+    bool checkpoint_flag = false;
+    bool resume_flag = false;
+    bool relight_flag = false;
     std::string png_file;
+    std::string output_format = "png";
+    std::string trace_file;
+    mrtp::Precision precision = mrtp::Precision::Double;
     std::vector<std::string> toml_files;
     mrtp::RendererConfig renderer_config;
 
@@ -236,11 +528,28 @@ int main(int argc, char** argv) {
               &renderer_config,
               &toml_files,
               &png_file,
-              &quiet_flag
+              &output_format,
+              &quiet_flag,
+              &checkpoint_flag,
+              &resume_flag,
+              &relight_flag,
+              &trace_file,
+              &precision
               ))) {
         return 1;
     }
 
+    // The trace is also written if rendering stops early
+    if (!trace_file.empty()) {
+        mrtp::start_tracing(trace_file);
+    }
+
+    // A budgeted frame renders tiles more than once
+    if (renderer_config.time_budget > 0 && (checkpoint_flag || relight_flag)) {
+        LOG(ERROR) << "Option --time-budget not allowed with -c, --relight or --resume";
+        return 1;
+    }
+
     bool use_auto_name = (toml_files.size() > 1) || (png_file == "");
     if (use_auto_name) {
         if (png_file != "") {
@@ -249,6 +558,29 @@ int main(int argc, char** argv) {
         }
     }
 
+    // Raw frames of all input files go to a single stream
+    std::shared_ptr<mrtp::SceneStreamWriter> stream_writer;
+    if (output_format != "png") {
+        mrtp::StreamFormat stream_format = mrtp::StreamFormat::RGB24;
+        if (output_format == "y4m") {
+            stream_format = mrtp::StreamFormat::Y4M;
+        } else if (output_format != "rgb24") {
+            LOG(ERROR) << "Unknown output format " << output_format;
+            return 1;
+        }
+        if (png_file == "" || checkpoint_flag) {
+            LOG(ERROR) << "Output format " << output_format << " requires -o and no -c";
+            return 1;
+        }
+        if (png_file == "-") {
+            // Keep log messages out of the video stream
+            el::Loggers::reconfigureAllLoggers(el::ConfigurationType::ToStandardOutput, "false");
+        }
+        stream_writer = mrtp::open_stream(png_file, stream_format);
+        if (!stream_writer)
+            return 1;
+    }
+
     // Textures will be shared by all worlds
     mrtp::TextureFactory texture_factory;
 
@@ -256,7 +588,7 @@ int main(int argc, char** argv) {
     for (auto toml_file : toml_files) {
         LOG(INFO) << "Processing " << toml_file << " ...";
 
-        auto world_ptr = mrtp::build_world(toml_file, &texture_factory);
+        auto world_ptr = mrtp::build_world(toml_file, &texture_factory, precision);
         if (!world_ptr)
             return 2;
 
@@ -269,23 +601,84 @@ int main(int argc, char** argv) {
             png_file = foo + ".png";
         }
 
-        float render_t = 0;
-        if (renderer_config.num_threads == 1) {
-            mrtp::SceneRenderer scene_renderer(world_ptr.get(), renderer_config);
-            mrtp::ScenePNGWriter scene_writer(&scene_renderer);
+        auto scene_renderer = mrtp::create_renderer(world_ptr.get(), renderer_config);
 
-            render_t = scene_renderer.do_render();
-            scene_writer.write_to_file(png_file);
+        // Primary hits are kept in memory for all frames of the file
+        std::shared_ptr<mrtp::PrimaryHitCache> hit_cache_ptr;
+        if (relight_flag) {
+            hit_cache_ptr = std::shared_ptr<mrtp::PrimaryHitCache>(
+                        new mrtp::PrimaryHitCache(mrtp::hash_scene_geometry(toml_file, *world_ptr)));
+            scene_renderer->set_hit_cache(hit_cache_ptr.get());
         }
-        else {
-            mrtp::ParallelSceneRenderer scene_renderer(world_ptr.get(), renderer_config, renderer_config.num_threads);
-            mrtp::ScenePNGWriter scene_writer(&scene_renderer);
 
-            render_t = scene_renderer.do_render();
-            scene_writer.write_to_file(png_file);
+        // All frames of an animation are rendered from the same world
+        mrtp::SceneAnimation* animation = world_ptr->get_animation_ptr();
+        unsigned int num_frames = (animation) ? animation->get_num_frames() : 1;
+
+        // Trajectories play until they end, animations then hold their last frame
+        bool has_trajectories = world_ptr->has_trajectories();
+        bool is_sequence = animation || has_trajectories;
+
+        for (unsigned int frame = 0; has_trajectories || frame < num_frames; frame++) {
+            if (has_trajectories && !world_ptr->load_trajectory_frame()) {
+                break;
+            }
+            if (animation) {
+                animation->apply_frame(std::min(frame, num_frames - 1), world_ptr.get());
+            }
+
+            std::string frame_file = png_file;
+            if (is_sequence) {
+                frame_file = create_frame_filename(png_file, frame);
+            }
+
+            std::shared_ptr<mrtp::RenderCheckpoint> checkpoint_ptr;
+            std::string checkpoint_file = frame_file + ".ckpt";
+            if (checkpoint_flag) {
+                checkpoint_ptr = mrtp::open_checkpoint(
+                            checkpoint_file,
+                            mrtp::hash_scene(toml_file, *world_ptr, renderer_config),
+                            renderer_config,
+                            resume_flag);
+                if (!checkpoint_ptr)
+                    return 3;
+            }
+            scene_renderer->set_checkpoint(checkpoint_ptr.get());
+            if (hit_cache_ptr && !stream_writer) {
+                hit_cache_ptr->set_file(frame_file + ".hits");
+            }
+
+            mrtp::TraceSpan frame_span("frame", frame);
+            float render_t = scene_renderer->do_render();
+
+            if (stream_writer) {
+                if (!stream_writer->write_frame(scene_renderer.get())) {
+                    LOG(ERROR) << "Error writing frame to " << png_file;
+                    return 4;
+                }
+            } else {
+                mrtp::ScenePNGWriter scene_writer(scene_renderer.get());
+                scene_writer.write_to_file(frame_file);
+            }
+
+            if (hit_cache_ptr && !hit_cache_ptr->save()) {
+                return 4;
+            }
+
+            // The image is complete, the journal is no longer needed
+            if (checkpoint_ptr) {
+                scene_renderer->set_checkpoint(nullptr);
+                checkpoint_ptr.reset();
+                std::remove(checkpoint_file.c_str());
+            }
+            LOG(INFO) << "Done " << frame_file << " in " << std::setprecision(2) << render_t << "s";
+            if (renderer_config.time_budget > 0) {
+                LOG(INFO) << "Time budget: " << describe_quality(scene_renderer->get_quality_report(),
+                                                                 renderer_config);
+            }
         }
-        LOG(INFO) << "Done in " << std::setprecision(2) << render_t << "s";
     }
-    
+
+    mrtp::finish_tracing();
     return 0;  // All done
 }
@@ -106,9 +106,10 @@ private:
 };
 
 
-std::shared_ptr<TextureMapper> create_texture_mapper(std::shared_ptr<cpptoml::table> actor_items,
-                                                     ActorType actor_type,
-                                                     TextureFactory* texture_factory) {
+TextureMapper* create_texture_mapper(std::shared_ptr<cpptoml::table> actor_items,
+                                     ActorType actor_type,
+                                     TextureFactory* texture_factory,
+                                     SceneArena* arena) {
     double reflect_coef = actor_items->get_as<double>("reflect").value_or(0);
     auto actor_texture = actor_items->get_as<std::string>("texture");
 
@@ -121,7 +122,7 @@ std::shared_ptr<TextureMapper> create_texture_mapper(std::shared_ptr<cpptoml::ta
         std::fstream check(texture_str.c_str());
         if (!check.good()) {
             LOG(ERROR) << "Cannot open texture file " << texture_str;
-            return std::shared_ptr<TextureMapper>();
+            return nullptr;
         }
 
         double scale_coef = actor_items->get_as<double>("scale").value_or(0.15);
@@ -133,14 +134,14 @@ std::shared_ptr<TextureMapper> create_texture_mapper(std::shared_ptr<cpptoml::ta
                                     texture_str, reflect_coef, scale_coef);
 
         if (actor_type == ActorType::Plane) {
-            return std::shared_ptr<TextureMapper>(new PlaneTextureMapper(texture_ptr));
+            return arena->construct<PlaneTextureMapper>(texture_ptr);
         }
         else if (actor_type == ActorType::Sphere) {
-            return std::shared_ptr<TextureMapper>(new SphereTextureMapper(texture_ptr));
+            return arena->construct<SphereTextureMapper>(texture_ptr);
         }
         else {
             double cylinder_radius = actor_items->get_as<double>("radius").value_or(1);
-            return std::shared_ptr<TextureMapper>(new CylinderTextureMapper(texture_ptr, cylinder_radius));
+            return arena->construct<CylinderTextureMapper>(texture_ptr, cylinder_radius);
         }
     }
 
@@ -148,17 +149,18 @@ std::shared_ptr<TextureMapper> create_texture_mapper(std::shared_ptr<cpptoml::ta
     if (actor_color) {
         Vector3d color_vec(actor_color->data());
         TexturePixel color(color_vec);
-        return std::shared_ptr<TextureMapper>(new DummyTextureMapper(color, reflect_coef));
+        return arena->construct<DummyTextureMapper>(color, reflect_coef);
     }
 
     LOG(ERROR) << "Cannot parse texture file and color for texture mapper";
-    return std::shared_ptr<TextureMapper>();
+    return nullptr;
 }
 
 
-std::shared_ptr<TextureMapper> create_dummy_mapper(std::shared_ptr<cpptoml::table> items,
-                                                   const std::string& color_str,
-                                                   const std::string& reflect_str) {
+TextureMapper* create_dummy_mapper(std::shared_ptr<cpptoml::table> items,
+                                   const std::string& color_str,
+                                   const std::string& reflect_str,
+                                   SceneArena* arena) {
     auto actor_color = items->get_array_of<double>(color_str);
 
     if (actor_color) {
@@ -166,11 +168,11 @@ std::shared_ptr<TextureMapper> create_dummy_mapper(std::shared_ptr<cpptoml::tabl
         Vector3d color_vec(actor_color->data());
         TexturePixel color(color_vec);
 
-        return std::shared_ptr<TextureMapper>(new DummyTextureMapper(color, reflect_coef));
+        return arena->construct<DummyTextureMapper>(color, reflect_coef);
     }
 
     LOG(ERROR) << "Color for texture mapper not found";
-    return std::shared_ptr<TextureMapper>();
+    return nullptr;
 }
 
 
@@ -3,6 +3,7 @@
 
 #include <memory>
 #include <Eigen/Core>
+#include "arena.h"
 #include "cpptoml.h"
 #include "common.h"
 #include "texture.h"
@@ -25,11 +26,12 @@ public:
 };
 
 
-std::shared_ptr<TextureMapper> create_texture_mapper(
-        std::shared_ptr<cpptoml::table>, ActorType, TextureFactory*);
+// Mappers are placed in the arena, nullptr on errors
+TextureMapper* create_texture_mapper(
+        std::shared_ptr<cpptoml::table>, ActorType, TextureFactory*, SceneArena*);
 
-std::shared_ptr<TextureMapper> create_dummy_mapper(std::shared_ptr<cpptoml::table>,
-        const std::string&, const std::string&);
+TextureMapper* create_dummy_mapper(std::shared_ptr<cpptoml::table>,
+        const std::string&, const std::string&, SceneArena*);
 
 
 }
@@ -0,0 +1,132 @@
+#include <algorithm>
+#include <easylogging++.h>
+
+#include "animation.h"
+#include "mrtp.h"
+#include "renderer.h"
+#include "texture.h"
+#include "world.h"
+
+
+namespace mrtp {
+
+/*
+Textures are released after the world whose actors use them.
+*/
+class SceneHandle {
+public:
+    TextureFactory texture_factory;
+    std::shared_ptr<SceneWorld> world;
+};
+
+
+class RendererHandle {
+public:
+    std::shared_ptr<SceneHandle> scene;
+    std::shared_ptr<SceneRendererBase> renderer;
+    unsigned int buffer_width;
+};
+
+
+std::shared_ptr<SceneHandle> load_scene(const std::string& world_filename) {
+    auto scene = std::make_shared<SceneHandle>();
+    scene->world = build_world(world_filename, &scene->texture_factory);
+    if (!scene->world) {
+        return std::shared_ptr<SceneHandle>();
+    }
+    return scene;
+}
+
+
+std::shared_ptr<SceneHandle> load_scene_from_string(const std::string& world_description) {
+    auto scene = std::make_shared<SceneHandle>();
+    scene->world = build_world_from_string(world_description, &scene->texture_factory);
+    if (!scene->world) {
+        return std::shared_ptr<SceneHandle>();
+    }
+    return scene;
+}
+
+
+/*
+Zero for scenes without an animation.
+*/
+unsigned int count_animation_frames(SceneHandle* scene) {
+    SceneAnimation* animation = scene->world->get_animation_ptr();
+    return (animation) ? animation->get_num_frames() : 0;
+}
+
+
+/*
+Frames after the last one hold it.
+*/
+void apply_animation_frame(SceneHandle* scene, unsigned int frame) {
+    SceneAnimation* animation = scene->world->get_animation_ptr();
+    if (animation) {
+        animation->apply_frame(std::min(frame, animation->get_num_frames() - 1),
+                               scene->world.get());
+    }
+}
+
+
+/*
+Moves the molecules with a trajectory to their next frame. Returns
+false once a trajectory has ended, or if there are none.
+*/
+bool load_trajectory_frame(SceneHandle* scene) {
+    return scene->world->has_trajectories() && scene->world->load_trajectory_frame();
+}
+
+
+std::shared_ptr<RendererHandle> create_scene_renderer(std::shared_ptr<SceneHandle> scene,
+                                                      const RenderOptions& options) {
+    if (!scene || !options.width || !options.height) {
+        LOG(ERROR) << "Invalid scene or image size";
+        return std::shared_ptr<RendererHandle>();
+    }
+
+    RendererConfig config;
+    config.buffer_width = options.width;
+    config.buffer_height = options.height;
+    config.field_of_vision = options.field_of_vision;
+    config.max_distance = options.max_distance;
+    config.max_ray_depth = options.max_ray_depth;
+    config.aa_samples = options.aa_samples;
+    config.num_threads = options.num_threads;
+
+    auto handle = std::make_shared<RendererHandle>();
+    handle->scene = scene;
+    handle->renderer = create_renderer(scene->world.get(), config);
+    handle->buffer_width = options.width;
+    return handle;
+}
+
+
+bool render_to_buffer(RendererHandle* handle,
+                      const RenderTarget& render_target,
+                      TileReadyCallback tile_callback) {
+    if (!handle || !render_target.data ||
+            render_target.row_stride < 3 * static_cast<std::size_t>(handle->buffer_width)) {
+        LOG(ERROR) << "Invalid render target";
+        return false;
+    }
+
+    SceneRendererBase* renderer = handle->renderer.get();
+    renderer->set_render_target(render_target.data, render_target.row_stride);
+    if (tile_callback) {
+        renderer->set_tile_callback([&](const RenderTile& tile) {
+            tile_callback(tile.x0, tile.y0, tile.width, tile.height);
+        });
+    } else {
+        renderer->set_tile_callback(TileCallback());
+    }
+    renderer->do_render();
+
+    // The target belongs to the caller only for this render
+    renderer->set_render_target(nullptr, 0);
+    renderer->set_tile_callback(TileCallback());
+    return true;
+}
+
+
+}  //namespace mrtp
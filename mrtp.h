@@ -0,0 +1,73 @@
+#ifndef _MRTP_H
+#define _MRTP_H
+
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <string>
+
+
+namespace mrtp {
+
+/*
+Embedding interface of the library.
+
+Scenes are loaded from a TOML file or from a TOML string, and rendered
+into a buffer owned by the caller. The buffer holds RGB24 pixels, rows
+are row_stride bytes apart, so it may be part of a larger image. Tiles
+are converted straight into it as they finish.
+
+Scenes and renderers are opaque handles. A renderer keeps its tiles
+and buffers between renders, so create it once and render every frame
+with it. It keeps its scene alive.
+
+Thread safety:
+  A scene is only read while rendering, so several renderers may render
+  the same scene at the same time, each into its own buffer. Applying
+  animation frames and loading trajectory frames modify the scene and
+  must not run concurrently with each other or with renders of it.
+  Tile callbacks are called from the worker threads, each tile once.
+*/
+struct RenderTarget {
+    unsigned char* data;
+    std::size_t row_stride;
+};
+
+
+struct RenderOptions {
+    unsigned int width = 640;
+    unsigned int height = 480;
+    double field_of_vision = 93;
+    double max_distance = 60;
+    unsigned int max_ray_depth = 3;
+    unsigned int aa_samples = 1;
+    unsigned int num_threads = 1;
+};
+
+
+// Called with x0, y0, width and height of every tile written to the target
+typedef std::function<void(unsigned int, unsigned int, unsigned int, unsigned int)> TileReadyCallback;
+
+
+class SceneHandle;
+class RendererHandle;
+
+
+std::shared_ptr<SceneHandle> load_scene(const std::string&);
+std::shared_ptr<SceneHandle> load_scene_from_string(const std::string&);
+
+unsigned int count_animation_frames(SceneHandle*);
+void apply_animation_frame(SceneHandle*, unsigned int);
+bool load_trajectory_frame(SceneHandle*);
+
+std::shared_ptr<RendererHandle> create_scene_renderer(std::shared_ptr<SceneHandle>,
+                                                      const RenderOptions&);
+
+bool render_to_buffer(RendererHandle*,
+                      const RenderTarget&,
+                      TileReadyCallback = TileReadyCallback());
+
+
+}  //namespace mrtp
+
+#endif  //_MRTP_H
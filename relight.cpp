@@ -0,0 +1,185 @@
+#include <cstring>
+#include <fstream>
+#include <easylogging++.h>
+
+#include "relight.h"
+#include "world.h"
+
+
+namespace mrtp {
+
+const char kHitCacheMagic[8] = {'M', 'R', 'T', 'P', 'H', 'I', 'T', '1'};
+const std::uint32_t kHitCacheVersion = 2;
+
+
+/*
+Hits are stored as they are in memory, so files written by a build
+with another layout of PrimaryHit are rejected.
+*/
+struct HitCacheHeader {
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t hit_size;
+    std::uint64_t key;
+    std::uint64_t num_pixels;
+    double max_distance;
+};
+
+
+PrimaryHitCache::PrimaryHitCache(std::uint64_t scene_key) :
+    scene_key_(scene_key) {
+
+}
+
+
+void PrimaryHitCache::set_file(const std::string& filename) {
+    filename_ = filename;
+}
+
+
+/*
+Called by the renderer before each render. Returns true if the hits
+can be replayed, otherwise the render has to record them.
+*/
+bool PrimaryHitCache::begin_render(std::uint64_t render_key,
+                                   double max_distance,
+                                   unsigned int num_pixels,
+                                   unsigned int num_tiles) {
+    std::uint64_t key = scene_key_ ^ render_key;
+
+    // Tiles restored from a checkpoint are not recorded
+    if (!is_complete_ && num_tiles_ && num_recorded_tiles_.load() == num_tiles_) {
+        is_complete_ = true;
+    }
+    if (is_complete_ && key == key_ && max_distance <= max_distance_) {
+        return true;
+    }
+    if (!filename_.empty() && load(key, max_distance, num_pixels)) {
+        return true;
+    }
+
+    key_ = key;
+    max_distance_ = max_distance;
+    num_tiles_ = num_tiles;
+    num_recorded_tiles_.store(0);
+    is_complete_ = false;
+    is_saved_ = false;
+    hits_.resize(num_pixels);
+    return false;
+}
+
+
+PrimaryHit* PrimaryHitCache::get_hits() {
+    return &hits_[0];
+}
+
+
+void PrimaryHitCache::finish_tile() {
+    num_recorded_tiles_.fetch_add(1, std::memory_order_relaxed);
+}
+
+
+bool PrimaryHitCache::load(std::uint64_t key, double max_distance, unsigned int num_pixels) {
+    std::ifstream in(filename_.c_str(), std::ios::binary);
+    if (!in.good()) {
+        return false;
+    }
+
+    HitCacheHeader header;
+    in.read(reinterpret_cast<char*>(&header), sizeof(header));
+    if (!in.good() || std::memcmp(header.magic, kHitCacheMagic, sizeof(header.magic)) != 0 ||
+            header.version != kHitCacheVersion || header.hit_size != sizeof(PrimaryHit) ||
+            header.key != key || header.num_pixels != num_pixels ||
+            max_distance > header.max_distance) {
+        LOG(WARNING) << "Ignoring stale hit cache " << filename_;
+        return false;
+    }
+
+    std::vector<PrimaryHit> hits(num_pixels);
+    in.read(reinterpret_cast<char*>(&hits[0]), sizeof(PrimaryHit) * num_pixels);
+    if (!in.good()) {
+        LOG(WARNING) << "Ignoring truncated hit cache " << filename_;
+        return false;
+    }
+
+    hits_.swap(hits);
+    key_ = key;
+    max_distance_ = header.max_distance;
+    num_tiles_ = 0;
+    is_complete_ = true;
+    is_saved_ = true;
+    LOG(INFO) << "Reusing primary hits from " << filename_;
+    return true;
+}
+
+
+/*
+Writes complete hits that are not yet in the file.
+*/
+bool PrimaryHitCache::save() {
+    if (num_tiles_ && num_recorded_tiles_.load() == num_tiles_) {
+        is_complete_ = true;
+    }
+    if (filename_.empty() || !is_complete_ || is_saved_) {
+        return true;
+    }
+
+    HitCacheHeader header;
+    std::memcpy(header.magic, kHitCacheMagic, sizeof(header.magic));
+    header.version = kHitCacheVersion;
+    header.hit_size = sizeof(PrimaryHit);
+    header.key = key_;
+    header.num_pixels = hits_.size();
+    header.max_distance = max_distance_;
+
+    std::ofstream out(filename_.c_str(), std::ios::binary | std::ios::trunc);
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char*>(&hits_[0]), sizeof(PrimaryHit) * hits_.size());
+    if (!out.good()) {
+        LOG(ERROR) << "Cannot write hit cache " << filename_;
+        return false;
+    }
+    is_saved_ = true;
+    return true;
+}
+
+
+/*
+FNV-1a hash of the scene file without its [light] and [[lights]]
+tables, so that moving the lights keeps the cached hits, followed by
+the files it refers to and the precision of the world.
+*/
+std::uint64_t hash_scene_geometry(const std::string& world_filename,
+                                  const SceneWorld& world) {
+    std::ifstream world_file(world_filename.c_str());
+
+    std::uint64_t hash = 14695981039346656037ULL;
+    auto hash_line = [&hash](const std::string& line) {
+        for (char c : line) {
+            hash ^= static_cast<unsigned char>(c);
+            hash *= 1099511628211ULL;
+        }
+        hash ^= '\n';
+        hash *= 1099511628211ULL;
+    };
+
+    bool is_light = false;
+    std::string line;
+    while (std::getline(world_file, line)) {
+        std::size_t first = line.find_first_not_of(" \t");
+        if (first != std::string::npos && line[first] == '[') {
+            is_light = line.compare(first, 7, "[light]") == 0 ||
+                       line.compare(first, 10, "[[lights]]") == 0;
+        }
+        if (!is_light) {
+            hash_line(line);
+        }
+    }
+
+    hash_line(world.describe_sources());
+    hash_line(std::to_string(static_cast<int>(world.get_precision())));
+    return hash;
+}
+
+
+}  //namespace mrtp
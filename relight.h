@@ -0,0 +1,81 @@
+#ifndef _RELIGHT_H
+#define _RELIGHT_H
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <Eigen/Core>
+
+#include "texture.h"
+
+
+namespace mrtp {
+
+using Vector3d = Eigen::Vector3d;
+
+class SceneWorld;
+
+
+/*
+Primary hit of one pixel with the colour picked from its texture.
+Nothing about it depends on the light.
+*/
+struct PrimaryHit {
+    double distance;      // Negative for rays that hit nothing
+    Vector3d inter;
+    Vector3d normal;
+    MyPixel pick;
+};
+
+
+/*
+Primary hits of a whole image, kept between renders for relighting.
+A render records the hits while it shades them. Later renders with
+the same scene, camera and resolution replay them and only trace
+shadows and reflections, eg. after the light has moved.
+
+The scene key identifies everything the renderer cannot see itself,
+such as the scene file. Renders with a larger max_distance than the
+recorded one need new hits, a smaller one is applied to the old hits.
+If a file is set, hits are loaded from it and saved back to it.
+*/
+class PrimaryHitCache {
+public:
+    PrimaryHitCache(std::uint64_t);
+    PrimaryHitCache() = delete;
+    PrimaryHitCache(const PrimaryHitCache&) = delete;
+    PrimaryHitCache& operator=(const PrimaryHitCache&) = delete;
+    ~PrimaryHitCache() = default;
+
+    void set_file(const std::string&);
+
+    bool begin_render(std::uint64_t, double, unsigned int, unsigned int);
+    PrimaryHit* get_hits();
+    void finish_tile();
+
+    bool save();
+
+private:
+    std::uint64_t scene_key_;
+    std::string filename_;
+
+    std::uint64_t key_ = 0;
+    double max_distance_ = 0;
+    unsigned int num_tiles_ = 0;
+    std::atomic<unsigned int> num_recorded_tiles_{0};
+    bool is_complete_ = false;
+    bool is_saved_ = false;
+
+    std::vector<PrimaryHit> hits_;
+
+    bool load(std::uint64_t, double, unsigned int);
+};
+
+
+std::uint64_t hash_scene_geometry(const std::string&, const SceneWorld&);
+
+
+}  //namespace mrtp
+
+#endif  //_RELIGHT_H
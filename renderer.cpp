@@ -1,10 +1,21 @@
 #include <Eigen/Geometry>
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
 #include <cstdlib>
 #include <cmath>
-#include <ctime>
+#include <functional>
+#include <numeric>
+#include <random>
+#include <type_traits>
 
 #include "png.hpp"
+#include "arena.h"
+#include "checkpoint.h"
+#include "kernels.h"
+#include "relight.h"
 #include "renderer.h"
+#include "trace.h"
 
 #ifdef _OPENMP
 #include <omp.h>
@@ -13,174 +24,1316 @@
 
 namespace mrtp {
 
+// Memory all occlusion maps of a frame may take
+const std::size_t kMaxShadowMapBytes = std::size_t(1) << 30;
+
+
 SceneRendererBase::SceneRendererBase(SceneWorld* scene_world,
                                      const RendererConfig& config) :
     scene_world_(scene_world),
-    config_(config) {
+    config_(config),
+    camera_(*scene_world->get_camera_ptr()),
+    target_data_(nullptr),
+    target_stride_(0),
+    checkpoint_(nullptr),
+    hit_cache_(nullptr),
+    is_replaying_hits_(false),
+    has_deadline_(false),
+    tile_cost_(0),
+    tile_nanos_(0),
+    num_timed_tiles_(0),
+    render_pass_(0) {
 
     ratio_ = static_cast<double>(config_.buffer_width) / static_cast<double>(config_.buffer_height);
     perspective_ = ratio_ / (2 * std::tan(M_PI / 180 * config_.field_of_vision / 2));
 
-    framebuffer_.reserve(config_.buffer_width * config_.buffer_height);
+    // Split the framebuffer into square tiles, the last row and
+    // column of tiles may be truncated
+    unsigned int tile_size = std::max(config_.tile_size, 1u);
+    for (unsigned int y0 = 0; y0 < config_.buffer_height; y0 += tile_size) {
+        for (unsigned int x0 = 0; x0 < config_.buffer_width; x0 += tile_size) {
+            RenderTile tile{
+                static_cast<unsigned int>(tiles_.size()),
+                x0,
+                y0,
+                std::min(tile_size, config_.buffer_width - x0),
+                std::min(tile_size, config_.buffer_height - y0)
+            };
+            tiles_.push_back(tile);
+        }
+    }
 }
 
 
-bool SceneRendererBase::solve_shadows(const Vector3d& O,
-                                      const Vector3d& D,
-                                      double max_dist) const {
-    ActorIterator actor_iterator = scene_world_->get_actor_iterator();
+void SceneRendererBase::set_checkpoint(RenderCheckpoint* checkpoint) {
+    checkpoint_ = checkpoint;
+}
+
+
+void SceneRendererBase::set_hit_cache(PrimaryHitCache* hit_cache) {
+    hit_cache_ = hit_cache;
+}
+
+
+/*
+The callback runs on the worker thread that finished the tile,
+as soon as its pixels are in the framebuffer. With a time budget
+a tile may be rendered, and reported, once per pass of the frame.
+*/
+void SceneRendererBase::set_tile_callback(TileCallback tile_callback) {
+    tile_callback_ = tile_callback;
+}
+
+
+/*
+Finished tiles are converted straight into the RGB24 rows at data,
+row_stride bytes apart, and the framebuffer is not allocated. Writers
+and journals need the framebuffer, so they cannot be used with a target.
+*/
+void SceneRendererBase::set_render_target(unsigned char* data, std::size_t row_stride) {
+    target_data_ = data;
+    target_stride_ = row_stride;
+}
+
+
+const RenderStats& SceneRendererBase::get_stats() const {
+    return stats_;
+}
 
-    for (; !actor_iterator.is_done(); actor_iterator.next()) {
-        std::shared_ptr<ActorBase> actor = *actor_iterator.current();
-        if (actor->has_shadow()) {
-            double distance = actor->solve_light_ray(O, D, 0, max_dist);
-            if (distance > 0) {
-                return true;
+
+const QualityReport& SceneRendererBase::get_quality_report() const {
+    return quality_;
+}
+
+
+/*
+Each renderer works on its own copy of the world camera, so several
+renderers can share one world without writing to it.
+*/
+void SceneRendererBase::prepare_render() {
+    if (!target_data_) {
+        framebuffer_.resize(config_.buffer_width * config_.buffer_height);
+    }
+
+    camera_ = *scene_world_->get_camera_ptr();
+    camera_.calculate_window(config_.buffer_width, config_.buffer_height, perspective_);
+
+    // Lights may have moved since the last frame
+    std::vector<const Light*> lights;
+    for (unsigned int i = 0; i < scene_world_->get_num_lights(); i++) {
+        lights.push_back(scene_world_->get_light_ptr(i));
+    }
+    light_tree_.build(lights);
+
+    occlusion_maps_.clear();
+    if (config_.shadow_map_size) {
+        std::vector<ActorBase*> actors;
+        for (auto iter = scene_world_->get_actor_iterator(); !iter.is_done(); iter.next()) {
+            actors.push_back(iter.current()->get());
+        }
+        // Clusters of lights have no map, their shadow rays are all traced.
+        // So are the rays of the weakest lights past the memory limit.
+        std::vector<unsigned int> mapped;
+        for (unsigned int i = 0; i < light_tree_.get_num_nodes(); i++) {
+            if (light_tree_.get_light(i)) {
+                mapped.push_back(i);
             }
         }
+        std::size_t max_mapped = kMaxShadowMapBytes /
+            LightOcclusionMap::calculate_num_bytes(config_.shadow_map_size);
+        if (mapped.size() > max_mapped) {
+            std::stable_sort(mapped.begin(), mapped.end(), [&](unsigned int a, unsigned int b) {
+                return light_tree_.get_light(a)->get_intensity() >
+                       light_tree_.get_light(b)->get_intensity();
+            });
+            mapped.resize(max_mapped);
+        }
+
+        occlusion_maps_.resize(light_tree_.get_num_nodes());
+        int num_mapped = static_cast<int>(mapped.size());
+#ifdef _OPENMP
+        int num_threads = (config_.num_threads) ? config_.num_threads : omp_get_max_threads();
+#pragma omp parallel for schedule(dynamic, 1) num_threads(num_threads)
+#endif
+        for (int i = 0; i < num_mapped; i++) {
+            occlusion_maps_[mapped[i]].build(light_tree_.get_light(mapped[i])->get_center(), actors,
+                                             config_.shadow_map_size, config_.ray_bias);
+        }
     }
-    return false;
+
+    stats_ = RenderStats();
+
+    quality_ = QualityReport();
+    quality_.max_ray_depth = config_.max_ray_depth;
+    quality_.aa_samples = config_.aa_samples;
+    quality_.num_tiles = tiles_.size();
+
+    if (hit_cache_) {
+        is_replaying_hits_ = hit_cache_->begin_render(
+                    hash_primary_rays(), config_.max_distance,
+                    config_.buffer_width * config_.buffer_height, tiles_.size());
+    }
+}
+
+
+/*
+FNV-1a hash of everything the renderer knows that changes primary
+hits: the rays of the window corners, the precision and the version
+of the world geometry.
+*/
+std::uint64_t SceneRendererBase::hash_primary_rays() const {
+    unsigned int last_x = config_.buffer_width - 1;
+    unsigned int last_y = config_.buffer_height - 1;
+    Vector3d corner = camera_.calculate_origin(0, 0);
+
+    std::vector<double> values;
+    for (const Vector3d& v : {corner,
+                              camera_.calculate_origin(last_x, 0),
+                              camera_.calculate_origin(0, last_y),
+                              camera_.calculate_direction(corner)}) {
+        values.insert(values.end(), v.data(), v.data() + 3);
+    }
+    values.push_back(config_.buffer_width);
+    values.push_back(config_.buffer_height);
+    values.push_back(static_cast<double>(scene_world_->get_precision() == Precision::Float));
+    values.push_back(scene_world_->get_geometry_version());
+
+    std::uint64_t hash = 14695981039346656037ULL;
+    const unsigned char* bytes = reinterpret_cast<const unsigned char*>(&values[0]);
+    for (std::size_t i = 0; i < values.size() * sizeof(double); i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+
+template <typename T>
+bool SceneRendererBase::solve_shadows(const Vector3d& O,
+                                      const Vector3d& D,
+                                      double max_dist,
+                                      unsigned int* occluder) const {
+    return scene_world_->get_bvh_ptr<T>()->solve_shadows(O, D, max_dist, occluder);
+}
+
+
+/*
+Rays of one level of a tile. Primary rays belong to the pixel with
+the same index, reflected rays are linked from the ray of the level
+above that spawned them.
+*/
+struct WavefrontLevel {
+    unsigned int num_rays;
+    Vector3d* origins;
+    Vector3d* directions;
+    Pixel* pixels;
+    double* reflections;
+    unsigned int* children;   // Reflected ray in the next level, or kNoRay
+
+    // Share of each ray in its pixel, 1 for primary rays, and the
+    // factor of the colour of its reflected ray, 1 unless roulette
+    double* weights;
+    double* gains;
+
+    // Subtrees of the BVH the rays can reach, all if nodes is nullptr
+    const unsigned int* nodes;
+    unsigned int num_nodes;
+
+    // Nearest actor and its distance for every ray from the raster pass,
+    // or nullptr. Rays marked as traced search the BVH in front of that
+    // distance, the others take the raster hit as it is
+    ActorBase* const* raster_actors;
+    const double* depths;
+    const bool* is_traced;
+
+    // Primary rays of the pixels of the tile, which go through the hit cache
+    bool is_cached;
+
+    // Seeds the random draws of the level
+    std::uint64_t seed;
+
+    // First actor hit and its distance, nullptr for misses and cached hits
+    ActorBase** actors;
+    double* distances;
+};
+
+
+/*
+Light seen from a hit, intensity is the cosine of the angle to the
+normal and power the intensity of the light itself.
+*/
+struct WavefrontLightSample {
+    unsigned int light;
+    Vector3d to_light;
+    double light_dist;
+    double intensity;
+    double ambient;
+    double power;
+    bool is_shadow;
+};
+
+
+/*
+Hit of a ray, lit by the lights it faces. Replayed primary hits have
+no actor, their texture colour comes from the hit cache. The strongest
+lights get shadow rays, the others add unshadowed, dimmed as much as
+the sampled lights are on average.
+*/
+struct WavefrontShade {
+    unsigned int ray;
+    ActorBase* actor;
+    const MyPixel* pick;
+    Vector3d inter;
+    Vector3d normal;
+    unsigned int first_sample;
+    unsigned int num_samples;
+    double unshadowed;
+};
+
+
+const unsigned int kNoRay = ~0u;
+const unsigned int kOccluderSlots = 8;
+
+
+/*
+Finalizer of splitmix64, neighbouring inputs give unrelated seeds.
+*/
+static std::uint64_t mix_seed(std::uint64_t x) {
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+
+// Queues are rebuilt for every tile in memory kept by the rendering thread
+static SceneArena* get_wavefront_arena() {
+    static thread_local SceneArena arena(1 << 18);
+    return &arena;
+}
+
+
+static void allocate_level(SceneArena* arena, unsigned int capacity, WavefrontLevel* level) {
+    level->num_rays = 0;
+    level->nodes = nullptr;
+    level->num_nodes = 0;
+    level->raster_actors = nullptr;
+    level->depths = nullptr;
+    level->is_traced = nullptr;
+    level->is_cached = false;
+    level->seed = 0;
+    level->origins = arena->construct_array<Vector3d>(capacity);
+    level->directions = arena->construct_array<Vector3d>(capacity);
+    level->pixels = arena->construct_array<Pixel>(capacity);
+    level->reflections = arena->construct_array<double>(capacity);
+    level->children = arena->construct_array<unsigned int>(capacity);
+    level->weights = arena->construct_array<double>(capacity);
+    level->gains = arena->construct_array<double>(capacity);
+    level->actors = arena->construct_array<ActorBase*>(capacity);
+    level->distances = arena->construct_array<double>(capacity);
 }
 
 
-ActorBase* SceneRendererBase::solve_hits(const Vector3d& O,
-                                         const Vector3d& D,
+template <typename T>
+ActorBase* SceneRendererBase::solve_hits(const WavefrontLevel& level,
+                                         unsigned int ray,
                                          double* curr_dist) const {
-    ActorBase* hit_actor = nullptr;
+    const Vector3d& O = level.origins[ray];
+    const Vector3d& D = level.directions[ray];
+    ActorBVH<T>* bvh = scene_world_->get_bvh_ptr<T>();
 
-    ActorIterator actor_iterator = scene_world_->get_actor_iterator();
+    if (level.raster_actors && !level.is_traced[ray]) {
+        *curr_dist = level.depths[ray];
+        return level.raster_actors[ray];
+    }
 
-    for (; !actor_iterator.is_done(); actor_iterator.next()) {
-        std::shared_ptr<ActorBase> actor = *actor_iterator.current();
-        double distance = actor->solve_light_ray(O, D, 0, config_.max_distance);
-        if (distance > 0 && distance < *curr_dist) {
-            *curr_dist = distance;
-            hit_actor = actor.get();
+    // Otherwise the raster depth, widened a little to bound the hits of
+    // the BVH in either precision, only shortens the search. If nothing
+    // is found within it the ray is traced in full
+    if (level.depths && level.depths[ray] < config_.max_distance) {
+        *curr_dist = level.depths[ray] + 1e-4 * level.depths[ray] + 1e-6;
+        ActorBase* hit_actor = bvh->solve_hits(O, D, config_.max_distance, curr_dist,
+                                               level.nodes, level.num_nodes);
+        if (hit_actor) {
+            return hit_actor;
         }
     }
-    return hit_actor;
+
+    *curr_dist = config_.max_distance;
+    if (level.nodes) {
+        return bvh->solve_hits(O, D, config_.max_distance, curr_dist, level.nodes, level.num_nodes);
+    }
+    return bvh->solve_hits(O, D, config_.max_distance, curr_dist);
 }
 
 
-Pixel SceneRendererBase::trace_ray_r(const Vector3d& O,
-                                     const Vector3d& D,
-                                     unsigned int depth) const {
-    Pixel pixel{0, 0, 0};
+/*
+Same arithmetic as SimplePlane::solve_light_ray.
+*/
+static double solve_plane(const Vector3d& O, const Vector3d& D,
+                          const Vector3d& point, const Vector3d& normal,
+                          double max_dist) {
+    double t = D.dot(normal);
+    if (t > 0.0001 || t < -0.0001) {
+        Vector3d v = O - point;
+        double d = -v.dot(normal) / t;
+        if (d > 0 && d < max_dist) {
+            return d;
+        }
+    }
+    return -1;
+}
+
+
+// Distance to one sphere by the kernel the BVH uses in each precision
+static void intersect_sphere(const KernelTable& kernels, const double* O, const double* D,
+                             const double* sphere, double max_dist, double* distance) {
+    kernels.intersect_spheres(O, D, &sphere[0], &sphere[1], &sphere[2], &sphere[3],
+                              1, 0, max_dist, distance);
+}
+
 
-    double curr_dist = config_.max_distance;
-    ActorBase* hit_actor = solve_hits(O, D, &curr_dist);
+static void intersect_sphere(const KernelTable& kernels, const float* O, const float* D,
+                             const float* sphere, float max_dist, float* distance) {
+    kernels.intersect_spheres_float(O, D, &sphere[0], &sphere[1], &sphere[2], &sphere[3],
+                                    1, 0, max_dist, distance);
+}
 
-    if (hit_actor) {
-        Light* my_light = scene_world_->get_light_ptr();
 
-        Vector3d inter = (D * curr_dist) + O;
-        Vector3d normal = hit_actor->calculate_normal_at_hit(inter);
-        Vector3d to_light = my_light->calculate_ray(inter);
+/*
+Rasterizes the actors that may be seen in a tile into a buffer of the
+nearest actor and its distance for every pixel. Spheres are solved
+with the kernel of the BVH at the pixels of their projection, and
+triangles cover the pixels inside their projected edges, so both get
+the distances of the BVH. Planes cover the whole tile. Pixels on the
+edge of a triangle, with two actors at the same distance, or which
+other actors such as cylinders may cover in front of the raster hit
+are marked to be traced.
+*/
+template <typename T>
+void SceneRendererBase::rasterize_tile(const RenderTile& tile,
+                                       ActorBase* const* actors,
+                                       unsigned int num_actors,
+                                       SceneArena* arena,
+                                       WavefrontLevel* level) const {
+    unsigned int num_pixels = tile.width * tile.height;
+    ActorBase** raster_actors = arena->construct_array<ActorBase*>(num_pixels);
+    double* depths = arena->construct_array<double>(num_pixels);
+    bool* is_traced = arena->construct_array<bool>(num_pixels);
+    std::fill(raster_actors, raster_actors + num_pixels, nullptr);
+    std::fill(depths, depths + num_pixels, config_.max_distance);
+    std::fill(is_traced, is_traced + num_pixels, false);
 
-        // Calculate light intensity
-        double light_dist = to_light.norm();
-        to_light *= (1 / light_dist);
+    // Equal distances of two actors are left to the BVH, which resolves
+    // them in scene order
+    auto store_hit = [&](unsigned int k, ActorBase* actor, double distance) {
+        if (distance > 0 && distance < depths[k]) {
+            depths[k] = distance;
+            raster_actors[k] = actor;
+        } else if (distance > 0 && distance == depths[k]) {
+            is_traced[k] = true;
+        }
+    };
 
-        double intensity = to_light.dot(normal);
+    // Pixels of the tile within a window rectangle, with a margin
+    auto clip_window = [&tile](const double* window, int* rect) {
+        rect[0] = static_cast<int>(std::max(0.0, std::floor(window[0]) - 1 - tile.x0));
+        rect[1] = static_cast<int>(std::max(0.0, std::floor(window[1]) - 1 - tile.y0));
+        rect[2] = static_cast<int>(std::min<double>(tile.width, std::ceil(window[2]) + 2 - tile.x0));
+        rect[3] = static_cast<int>(std::min<double>(tile.height, std::ceil(window[3]) + 2 - tile.y0));
+    };
 
-        if (intensity > 0) {
-            // Prevent self-intersection
-            Vector3d inter_corr = inter + config_.ray_bias * normal;
+    const KernelTable& kernels = get_kernels();
+    ActorBase** others = arena->construct_array<ActorBase*>(num_actors);
+    unsigned int num_others = 0;
+    BoundingBox bounds;
+    double window[4];
+    int rect[4];
 
-            // Check if intersection is in shadow
-            bool is_shadow = solve_shadows(inter_corr, to_light, light_dist);
-            double shadow = (is_shadow) ? config_.shadow_bias : 1;
+    for (unsigned int a = 0; a < num_actors; a++) {
+        ActorBase* actor = actors[a];
+        Vector3d center;
+        double radius;
+        Vector3d point;
+        Vector3d normal;
+        Vector3d vertices[3];
 
-            // Decrease light intensity for actors away from light
-            double ambient = 1 - std::pow(light_dist / config_.max_distance, 2);
-
-            // Combine pixels
-            double lambda = intensity * shadow * ambient;
-
-            // TODO Clean up!
-            MyPixel my_pick = hit_actor->pick_pixel(inter, normal);
-            Vector3d pick = my_pick.pixel.to_vec();
-            pixel = (1 - lambda) * pixel + lambda * pick;
-
-            // If hit actor is reflective, trace reflected ray
-            if (depth < config_.max_ray_depth) {
-                if (my_pick.reflection_coeff > 0) {
-                    Vector3d reflected_ray = D - (2 * D.dot(normal)) * normal;
-                    Pixel reflected_pixel = trace_ray_r(inter_corr, reflected_ray, depth + 1);
-                    pixel = (1 - my_pick.reflection_coeff) * reflected_pixel + my_pick.reflection_coeff * pixel;
+        if (actor->get_sphere(&center, &radius)) {
+            actor->calculate_bounds(&bounds);
+            if (!camera_.project_bounds(bounds, window)) {
+                others[num_others++] = actor;
+                continue;
+            }
+            clip_window(window, rect);
+            T sphere[4] = {static_cast<T>(center[0]), static_cast<T>(center[1]),
+                           static_cast<T>(center[2]), static_cast<T>(radius)};
+            for (int j = rect[1]; j < rect[3]; j++) {
+                for (int i = rect[0]; i < rect[2]; i++) {
+                    unsigned int k = j * tile.width + i;
+                    const Vector3d& O = level->origins[k];
+                    const Vector3d& D = level->directions[k];
+                    T O_t[3] = {static_cast<T>(O[0]), static_cast<T>(O[1]), static_cast<T>(O[2])};
+                    T D_t[3] = {static_cast<T>(D[0]), static_cast<T>(D[1]), static_cast<T>(D[2])};
+                    T distance;
+                    intersect_sphere(kernels, O_t, D_t, sphere,
+                                     static_cast<T>(config_.max_distance), &distance);
+                    store_hit(k, actor, distance);
+                }
+            }
+        } else if (actor->get_triangle(vertices)) {
+            actor->get_plane(&point, &normal);
+            double x[3];
+            double y[3];
+            bool is_projected = true;
+            for (unsigned int v = 0; v < 3; v++) {
+                is_projected = is_projected && camera_.project_point(vertices[v], &x[v], &y[v]);
+            }
+            double area = (x[1] - x[0]) * (y[2] - y[0]) - (y[1] - y[0]) * (x[2] - x[0]);
+            if (!is_projected || std::abs(area) < 1e-9) {
+                others[num_others++] = actor;
+                continue;
+            }
+
+            // Edge functions scaled to the distance from the edge in pixels,
+            // positive inside whatever the winding
+            double edges[3][3];
+            for (unsigned int v = 0; v < 3; v++) {
+                unsigned int w = (v + 1) % 3;
+                double scale = ((area > 0) ? 1 : -1) / std::hypot(x[w] - x[v], y[w] - y[v]);
+                edges[v][0] = -(y[w] - y[v]) * scale;
+                edges[v][1] = (x[w] - x[v]) * scale;
+                edges[v][2] = -(edges[v][0] * x[v] + edges[v][1] * y[v]);
+            }
+
+            window[0] = std::min({x[0], x[1], x[2]});
+            window[1] = std::min({y[0], y[1], y[2]});
+            window[2] = std::max({x[0], x[1], x[2]});
+            window[3] = std::max({y[0], y[1], y[2]});
+            clip_window(window, rect);
+            for (int j = rect[1]; j < rect[3]; j++) {
+                for (int i = rect[0]; i < rect[2]; i++) {
+                    double px = tile.x0 + i;
+                    double py = tile.y0 + j;
+                    bool is_inside = true;
+                    bool is_edge = false;
+                    for (unsigned int v = 0; v < 3 && is_inside; v++) {
+                        double e = edges[v][0] * px + edges[v][1] * py + edges[v][2];
+                        is_inside = e > -1e-6;
+                        is_edge = is_edge || e < 1e-6;
+                    }
+                    unsigned int k = j * tile.width + i;
+                    if (is_inside && is_edge) {
+                        is_traced[k] = true;
+                    } else if (is_inside) {
+                        store_hit(k, actor, solve_plane(level->origins[k], level->directions[k],
+                                                        point, normal, config_.max_distance));
+                    }
+                }
+            }
+        } else if (actor->get_plane(&point, &normal)) {
+            for (unsigned int k = 0; k < num_pixels; k++) {
+                store_hit(k, actor, solve_plane(level->origins[k], level->directions[k],
+                                                point, normal, config_.max_distance));
+            }
+        } else {
+            others[num_others++] = actor;
+        }
+    }
+
+    // Rays start on the window, at most reach away from the eye
+    const Vector3d& eye = camera_.get_eye();
+    double reach = 0;
+    for (unsigned int k : {0u, tile.width - 1, num_pixels - tile.width, num_pixels - 1}) {
+        reach = std::max(reach, (level->origins[k] - eye).norm());
+    }
+
+    for (unsigned int a = 0; a < num_others; a++) {
+        if (!others[a]->calculate_bounds(&bounds) || !camera_.project_bounds(bounds, window)) {
+            std::fill(is_traced, is_traced + num_pixels, true);
+            break;
+        }
+        clip_window(window, rect);
+
+        // Nearest distance along the rays at which the actor can be hit
+        Vector3d nearest = eye.cwiseMax(bounds.lower).cwiseMin(bounds.upper);
+        double near_dist = (nearest - eye).norm() - reach;
+        for (int j = rect[1]; j < rect[3]; j++) {
+            for (int i = rect[0]; i < rect[2]; i++) {
+                unsigned int k = j * tile.width + i;
+                is_traced[k] = is_traced[k] || near_dist < depths[k];
+            }
+        }
+    }
+
+    // Like the BVH, float sphere hits are solved again in double
+    if (std::is_same<T, float>::value) {
+        for (unsigned int k = 0; k < num_pixels; k++) {
+            Vector3d center;
+            double radius;
+            if (raster_actors[k] && raster_actors[k]->get_sphere(&center, &radius)) {
+                double distance = raster_actors[k]->solve_light_ray(level->origins[k],
+                                                                    level->directions[k],
+                                                                    0, config_.max_distance);
+                if (distance > 0) {
+                    depths[k] = distance;
                 }
             }
         }
     }
 
-    return pixel;
+    level->raster_actors = raster_actors;
+    level->depths = depths;
+    level->is_traced = is_traced;
+}
+
+
+// Interleaves the lower 10 bits of v with two zero bits each
+static std::uint32_t spread_bits(std::uint32_t v) {
+    v = (v | (v << 16)) & 0x030000ff;
+    v = (v | (v << 8)) & 0x0300f00f;
+    v = (v | (v << 4)) & 0x030c30c3;
+    v = (v | (v << 2)) & 0x09249249;
+    return v;
 }
 
 
-void SceneRendererBase::render_block(unsigned int block_index,
-                                     unsigned int num_lines) {
-    Camera* my_camera = scene_world_->get_camera_ptr();
+/*
+Reorders the reflected rays in next by the octant of their direction,
+then along a Morton curve through the bounds of their origins, and
+relinks them from level. Neighbouring rays then mostly walk the same
+boxes of the BVH and read the same texels.
+*/
+static void sort_level(SceneArena* arena, WavefrontLevel* level, WavefrontLevel* next) {
+    unsigned int num_rays = next->num_rays;
+    if (num_rays < 2) {
+        return;
+    }
+
+    Vector3d lower = next->origins[0];
+    Vector3d upper = next->origins[0];
+    for (unsigned int c = 1; c < num_rays; c++) {
+        lower = lower.cwiseMin(next->origins[c]);
+        upper = upper.cwiseMax(next->origins[c]);
+    }
+    Vector3d extent = (upper - lower).cwiseMax(Vector3d::Constant(1e-12));
+    Vector3d scale = Vector3d::Constant(1023).cwiseQuotient(extent);
+
+    // Octant in the top 3 bits, then 30 bits of Morton code, then the
+    // ray index in the lower 31 bits, ample for the rays of a tile
+    std::uint64_t* keys = arena->construct_array<std::uint64_t>(num_rays);
+    for (unsigned int c = 0; c < num_rays; c++) {
+        const Vector3d& D = next->directions[c];
+        std::uint32_t octant = (D(0) < 0) | ((D(1) < 0) << 1) | ((D(2) < 0) << 2);
+
+        Vector3d cell = (next->origins[c] - lower).cwiseProduct(scale);
+        std::uint32_t morton = 0;
+        for (unsigned int axis = 0; axis < 3; axis++) {
+            std::uint32_t x = static_cast<std::uint32_t>(std::min(std::max(cell(axis), 0.0), 1023.0));
+            morton |= spread_bits(x) << axis;
+        }
+        keys[c] = (static_cast<std::uint64_t>(octant) << 61) |
+                  (static_cast<std::uint64_t>(morton) << 31) | c;
+    }
+    std::sort(keys, keys + num_rays);
 
-    Pixel* pixel = &framebuffer_[block_index * num_lines * config_.buffer_width];
+    unsigned int* positions = arena->construct_array<unsigned int>(num_rays);
+    Vector3d* origins = arena->construct_array<Vector3d>(num_rays);
+    Vector3d* directions = arena->construct_array<Vector3d>(num_rays);
+    double* weights = arena->construct_array<double>(num_rays);
+    for (unsigned int p = 0; p < num_rays; p++) {
+        unsigned int c = static_cast<unsigned int>(keys[p] & 0x7fffffff);
+        origins[p] = next->origins[c];
+        directions[p] = next->directions[c];
+        weights[p] = next->weights[c];
+        positions[c] = p;
+    }
+    next->origins = origins;
+    next->directions = directions;
+    next->weights = weights;
 
-    for (unsigned int j = 0; j < num_lines; j++) {
-        for (unsigned int i = 0; i < config_.buffer_width; i++, pixel++) {
-            Vector3d origin = my_camera->calculate_origin(i, j + block_index * num_lines);
-            Vector3d direction = my_camera->calculate_direction(origin);
-            *pixel = trace_ray_r(origin, direction, 0);
+    for (unsigned int k = 0; k < level->num_rays; k++) {
+        if (level->children[k] != kNoRay) {
+            level->children[k] = positions[level->children[k]];
         }
     }
 }
 
 
-ParallelSceneRenderer::ParallelSceneRenderer(SceneWorld* scene_world,
-                                             const RendererConfig& render_config,
-                                             unsigned int num_threads) :
-    SceneRendererBase(scene_world, render_config),
-    num_threads_(num_threads) {
+/*
+Traces one level of rays as a batch: all intersections first, then all
+shadow rays, then the shading, which queues the reflected rays into
+next. Returns true if next has rays to trace.
+*/
+template <typename T>
+bool SceneRendererBase::trace_wavefront(const RenderTile& tile,
+                                        unsigned int depth,
+                                        WavefrontLevel* level,
+                                        WavefrontLevel* next,
+                                        SceneArena* arena,
+                                        RenderStats* stats) {
+    WavefrontShade* shades = arena->construct_array<WavefrontShade>(level->num_rays);
+    unsigned int num_shades = 0;
+
+    unsigned int max_samples = std::min(std::max(config_.max_shadow_lights, 1u), kMaxLightCut);
+    WavefrontLightSample* samples = arena->construct_array<WavefrontLightSample>(level->num_rays * max_samples);
+    unsigned int num_samples = 0;
+    LightPoint lights[kMaxLightCut];
+    WavefrontLightSample candidates[kMaxLightCut];
+    bool is_cached = level->is_cached;
+    PrimaryHit* hits = (is_cached) ? hit_cache_->get_hits() : nullptr;
+    ActorBase* previous_actor = nullptr;
+
+    for (unsigned int k = 0; k < level->num_rays; k++) {
+        const Vector3d& O = level->origins[k];
+        const Vector3d& D = level->directions[k];
+        level->pixels[k] = Pixel{0, 0, 0};
+        level->children[k] = kNoRay;
+        level->actors[k] = nullptr;
+        level->distances[k] = config_.max_distance;
+
+        WavefrontShade& shade = shades[num_shades];
+        shade.ray = k;
+        shade.actor = nullptr;
+        shade.pick = nullptr;
+
+        if (is_cached) {
+            // Replayed hits at or beyond the current max_distance are misses
+            PrimaryHit* hit = &hits[(tile.y0 + k / tile.width) * config_.buffer_width +
+                                    tile.x0 + k % tile.width];
+            if (!is_replaying_hits_) {
+                double curr_dist;
+                ActorBase* hit_actor = solve_hits<T>(*level, k, &curr_dist);
+                hit->distance = -1;
+                if (hit_actor) {
+                    hit->distance = curr_dist;
+                    hit->inter = (D * curr_dist) + O;
+                    hit->normal = hit_actor->calculate_normal_at_hit(hit->inter);
+                    hit->pick = hit_actor->pick_pixel(hit->inter, hit->normal);
+                }
+            }
+            if (!(hit->distance > 0 && hit->distance < config_.max_distance)) {
+                continue;
+            }
+            level->distances[k] = hit->distance;
+            shade.inter = hit->inter;
+            shade.normal = hit->normal;
+            shade.pick = &hit->pick;
+        } else {
+            double curr_dist;
+            shade.actor = solve_hits<T>(*level, k, &curr_dist);
+            if (depth > 0 && k > 0 && shade.actor != previous_actor) {
+                stats->divergent_rays++;
+            }
+            previous_actor = shade.actor;
+            if (!shade.actor) {
+                continue;
+            }
+            level->actors[k] = shade.actor;
+            level->distances[k] = curr_dist;
+            shade.inter = (D * curr_dist) + O;
+            shade.normal = shade.actor->calculate_normal_at_hit(shade.inter);
+        }
+
+        // Calculate light intensity of the lights in reach
+        unsigned int num_lights = light_tree_.collect_lights(shade.inter, shade.normal,
+                                                             config_.max_distance, lights);
+        unsigned int num_candidates = 0;
+        for (unsigned int i = 0; i < num_lights; i++) {
+            WavefrontLightSample& sample = candidates[num_candidates];
+            sample.to_light = lights[i].center - shade.inter;
+            sample.light_dist = sample.to_light.norm();
+            sample.to_light *= (1 / sample.light_dist);
+            sample.intensity = sample.to_light.dot(shade.normal);
+
+            // Decrease light intensity for actors away from light
+            sample.ambient = 1 - std::pow(sample.light_dist / config_.max_distance, 2);
+            sample.light = lights[i].index;
+            sample.power = lights[i].intensity;
+            sample.is_shadow = false;
+            if (sample.intensity > 0 && sample.ambient > 0) {
+                num_candidates++;
+            }
+        }
+        // Hits no light reaches keep their colour, but still reflect
+
+        shade.unshadowed = 0;
+        if (num_candidates > max_samples) {
+            auto is_stronger = [](const WavefrontLightSample& a, const WavefrontLightSample& b) {
+                return a.intensity * a.ambient * a.power > b.intensity * b.ambient * b.power;
+            };
+            std::nth_element(candidates, candidates + max_samples, candidates + num_candidates, is_stronger);
+            for (unsigned int i = max_samples; i < num_candidates; i++) {
+                shade.unshadowed += candidates[i].intensity * candidates[i].ambient * candidates[i].power;
+            }
+            num_candidates = max_samples;
+        }
+        shade.first_sample = num_samples;
+        shade.num_samples = num_candidates;
+        std::copy(candidates, candidates + num_candidates, samples + num_samples);
+        num_samples += num_candidates;
+        num_shades++;
+    }
+
+    // Last occluder towards each light, in slots picked by the light
+    unsigned int occluders[kOccluderSlots];
+    unsigned int occluder_lights[kOccluderSlots];
+    std::fill(occluder_lights, occluder_lights + kOccluderSlots, kNoOccluder);
+    unsigned int num_mapped = 0;
+
+    for (unsigned int s = 0; s < num_shades; s++) {
+        const WavefrontShade& shade = shades[s];
+        // Prevent self-intersection
+        Vector3d inter_corr = shade.inter + config_.ray_bias * shade.normal;
+        for (unsigned int i = shade.first_sample; i < shade.first_sample + shade.num_samples; i++) {
+            WavefrontLightSample& sample = samples[i];
+            int occlusion = 0;
+            if (!occlusion_maps_.empty() && !occlusion_maps_[sample.light].is_empty()) {
+                occlusion = occlusion_maps_[sample.light].classify(-sample.to_light, sample.light_dist,
+                                                                  shade.actor);
+            }
+            if (occlusion) {
+                // Actors without bounds are not in the maps
+                sample.is_shadow = occlusion < 0 || scene_world_->get_bvh_ptr<T>()->solve_unbounded_shadows(
+                            inter_corr, sample.to_light, sample.light_dist);
+                num_mapped++;
+                continue;
+            }
+            unsigned int slot = sample.light % kOccluderSlots;
+            if (occluder_lights[slot] != sample.light) {
+                occluder_lights[slot] = sample.light;
+                occluders[slot] = kNoOccluder;
+            }
+            unsigned int last_occluder = occluders[slot];
+            sample.is_shadow = solve_shadows<T>(inter_corr, sample.to_light, sample.light_dist,
+                                                &occluders[slot]);
+            if (sample.is_shadow && last_occluder != kNoOccluder && occluders[slot] == last_occluder) {
+                stats->cached_shadow_rays++;
+            }
+        }
+    }
+    stats->shadow_rays += num_samples - num_mapped;
+    stats->mapped_shadow_rays += num_mapped;
 
+    if (config_.deferred_shading && !is_cached) {
+        // Read each texture in one run, the pixels do not depend on the order
+        std::less<const TextureMapper*> mapper_order;
+        std::sort(shades, shades + num_shades,
+                  [&mapper_order](const WavefrontShade& a, const WavefrontShade& b) {
+            const TextureMapper* mapper_a = a.actor->get_texture_mapper();
+            const TextureMapper* mapper_b = b.actor->get_texture_mapper();
+            if (mapper_a != mapper_b) {
+                return mapper_order(mapper_a, mapper_b);
+            }
+            return a.ray < b.ray;
+        });
+    }
+
+    if (next) {
+        allocate_level(arena, num_shades, next);
+        next->seed = mix_seed(level->seed);
+    }
+
+    // Roulette draws are seeded per tile, pass and level, so images do
+    // not depend on the order threads take the tiles in
+    std::minstd_rand rng(static_cast<std::minstd_rand::result_type>(level->seed >> 32));
+    std::uniform_real_distribution<double> unit(0, 1);
+
+    for (unsigned int s = 0; s < num_shades; s++) {
+        const WavefrontShade& shade = shades[s];
+        double lambda = 0;
+        double sampled = 0;
+        for (unsigned int i = shade.first_sample; i < shade.first_sample + shade.num_samples; i++) {
+            const WavefrontLightSample& sample = samples[i];
+            double shadow = (sample.is_shadow) ? config_.shadow_bias : 1;
+            lambda += sample.intensity * shadow * sample.ambient * sample.power;
+            sampled += sample.intensity * sample.ambient * sample.power;
+        }
+        if (shade.unshadowed > 0) {
+            lambda += shade.unshadowed * lambda / sampled;
+        }
+
+        // Several lights may add up to more than the colour of the actor
+        lambda = std::min(lambda, 1.0);
+
+        MyPixel my_pick = (shade.pick) ? *shade.pick : shade.actor->pick_pixel(shade.inter, shade.normal);
+        Vector3d pick = my_pick.pixel.to_vec();
+        Pixel& pixel = level->pixels[shade.ray];
+        pixel = (1 - lambda) * pixel + lambda * pick;
+
+        // If hit actor is reflective, queue reflected ray
+        if (next && my_pick.reflection_coeff > 0) {
+            double weight = ((depth > 0) ? level->weights[shade.ray] : 1) * (1 - my_pick.reflection_coeff);
+            double gain = 1;
+            if (weight < config_.min_contribution) {
+                if (!config_.russian_roulette || unit(rng) * config_.min_contribution >= weight) {
+                    // Unbiased roulette counts the lost rays as black
+                    if (config_.russian_roulette) {
+                        pixel = my_pick.reflection_coeff * pixel;
+                    }
+                    stats->pruned_rays++;
+                    continue;
+                }
+                gain = config_.min_contribution / weight;
+                weight = config_.min_contribution;
+            }
+
+            const Vector3d& D = level->directions[shade.ray];
+            unsigned int child = next->num_rays++;
+            next->origins[child] = shade.inter + config_.ray_bias * shade.normal;
+            next->directions[child] = D - (2 * D.dot(shade.normal)) * shade.normal;
+            next->weights[child] = weight;
+            level->reflections[shade.ray] = my_pick.reflection_coeff;
+            level->gains[shade.ray] = gain;
+            level->children[shade.ray] = child;
+        }
+    }
+
+    if (!next) {
+        return false;
+    }
+    if (config_.sort_reflections) {
+        sort_level(arena, level, next);
+    }
+    stats->reflected_rays += next->num_rays;
+    return next->num_rays > 0;
+}
+
+
+/*
+Traces the primary rays in the first level and all the rays they
+spawn, then blends the colours from the deepest level upwards, in
+the same order as a recursive tracer would. levels must hold
+max_ray_depth + 1 entries.
+*/
+template <typename T>
+void SceneRendererBase::trace_levels(const RenderTile& tile,
+                                     WavefrontLevel* levels,
+                                     SceneArena* arena,
+                                     RenderStats* stats) {
+    unsigned int depth = 0;
+    while (trace_wavefront<T>(tile, depth,
+                              &levels[depth],
+                              (depth < config_.max_ray_depth) ? &levels[depth + 1] : nullptr,
+                              arena, stats)) {
+        depth++;
+    }
+
+    for (unsigned int d = depth; d-- > 0;) {
+        const WavefrontLevel& level = levels[d];
+        const Pixel* reflected_pixels = levels[d + 1].pixels;
+        for (unsigned int k = 0; k < level.num_rays; k++) {
+            if (level.children[k] != kNoRay) {
+                double reflection = level.reflections[k];
+                level.pixels[k] = ((1 - reflection) * level.gains[k]) * reflected_pixels[level.children[k]] +
+                                  reflection * level.pixels[k];
+            }
+        }
+    }
 }
 
 
-float ParallelSceneRenderer::do_render() {
-    Camera* my_camera = scene_world_->get_camera_ptr();
+/*
+Pixels that differ from a neighbour in actor, depth or colour are
+traced again with a grid of stratified samples, whose mean replaces
+their single sample. Neighbours outside the tile are compared by actor
+and depth only.
+*/
+template <typename T>
+void SceneRendererBase::supersample_edges(const RenderTile& tile,
+                                          WavefrontLevel* primary,
+                                          SceneArena* arena,
+                                          RenderStats* stats) {
+    unsigned int grid = static_cast<unsigned int>(std::sqrt(static_cast<double>(config_.aa_samples)));
+    if (grid < 2) {
+        return;
+    }
+    unsigned int num_samples = grid * grid;
+    unsigned int num_pixels = tile.width * tile.height;
 
-    my_camera->calculate_window(config_.buffer_width, config_.buffer_height, perspective_);
-    
-    long time_start = clock();
+    auto is_edge = [this](ActorBase* actor_a, double dist_a, ActorBase* actor_b, double dist_b) {
+        return actor_a != actor_b ||
+                std::abs(dist_a - dist_b) > config_.aa_threshold * std::min(dist_a, dist_b);
+    };
 
-#ifdef _OPENMP
-    if (num_threads_ == 1) {
-        // Serial execution
-        render_block(0, config_.buffer_height);
+    // Cached hits have no actors, so edges are found the same way when
+    // they are recorded and when they are replayed
+    ActorBVH<T>* bvh = scene_world_->get_bvh_ptr<T>();
+    auto solve_outside = [&](unsigned int x, unsigned int y, double* dist) -> ActorBase* {
+        *dist = config_.max_distance;
+        if (hit_cache_ && is_replaying_hits_) {
+            const PrimaryHit& hit = hit_cache_->get_hits()[y * config_.buffer_width + x];
+            if (hit.distance > 0 && hit.distance < config_.max_distance) {
+                *dist = hit.distance;
+            }
+            return nullptr;
+        }
+        Vector3d O;
+        Vector3d D;
+        camera_.calculate_rays(x, y, 1, &O, &D);
+        stats->primary_rays++;
+        ActorBase* hit_actor = bvh->solve_hits(O, D, config_.max_distance, dist);
+        return (hit_cache_) ? nullptr : hit_actor;
+    };
+
+    const int offsets[4][2] = {{-1, 0}, {1, 0}, {0, -1}, {0, 1}};
+    unsigned int* edge_pixels = arena->construct_array<unsigned int>(num_pixels);
+    unsigned int num_edges = 0;
+
+    for (unsigned int k = 0; k < num_pixels; k++) {
+        int i = k % tile.width;
+        int j = k / tile.width;
+        ActorBase* actor = primary->actors[k];
+        double dist = primary->distances[k];
+
+        bool is_edge_pixel = false;
+        for (unsigned int n = 0; n < 4 && !is_edge_pixel; n++) {
+            int ni = i + offsets[n][0];
+            int nj = j + offsets[n][1];
+            int x = tile.x0 + ni;
+            int y = tile.y0 + nj;
+            if (x < 0 || y < 0 ||
+                x >= static_cast<int>(config_.buffer_width) ||
+                y >= static_cast<int>(config_.buffer_height)) {
+                continue;
+            }
+
+            if (ni >= 0 && nj >= 0 &&
+                ni < static_cast<int>(tile.width) && nj < static_cast<int>(tile.height)) {
+                unsigned int neighbour = nj * tile.width + ni;
+                Pixel diff = (primary->pixels[k] - primary->pixels[neighbour]).cwiseAbs();
+                is_edge_pixel = diff.maxCoeff() > config_.aa_threshold ||
+                        is_edge(actor, dist, primary->actors[neighbour], primary->distances[neighbour]);
+            } else {
+                double outside_dist;
+                ActorBase* outside_actor = solve_outside(x, y, &outside_dist);
+                is_edge_pixel = is_edge(actor, dist, outside_actor, outside_dist);
+            }
+        }
+        if (is_edge_pixel) {
+            edge_pixels[num_edges++] = k;
+        }
+    }
+
+    if (!num_edges) {
+        return;
+    }
+
+    // Samples stay within half a pixel, so the culled nodes still hold
+    WavefrontLevel* levels = arena->construct_array<WavefrontLevel>(config_.max_ray_depth + 1);
+    allocate_level(arena, num_edges * num_samples, &levels[0]);
+    levels[0].num_rays = num_edges * num_samples;
+    levels[0].nodes = primary->nodes;
+    levels[0].num_nodes = primary->num_nodes;
+    levels[0].seed = mix_seed(primary->seed ^ 1);
+
+    for (unsigned int e = 0; e < num_edges; e++) {
+        double x = tile.x0 + edge_pixels[e] % tile.width;
+        double y = tile.y0 + edge_pixels[e] / tile.width;
+        for (unsigned int s = 0; s < num_samples; s++) {
+            unsigned int r = e * num_samples + s;
+            camera_.calculate_ray(x + (s % grid + 0.5) / grid - 0.5,
+                                  y + (s / grid + 0.5) / grid - 0.5,
+                                  &levels[0].origins[r], &levels[0].directions[r]);
+        }
+    }
+
+    trace_levels<T>(tile, levels, arena, stats);
+
+    for (unsigned int e = 0; e < num_edges; e++) {
+        Pixel sum{0, 0, 0};
+        for (unsigned int s = 0; s < num_samples; s++) {
+            sum += levels[0].pixels[e * num_samples + s];
+        }
+        primary->pixels[edge_pixels[e]] = sum / num_samples;
+    }
+    stats->primary_rays += num_edges * num_samples;
+    stats->supersampled_pixels += num_edges;
+}
+
+
+/*
+Breadth-first rendering of a tile, each level of reflection is traced
+as one batch. With anti-aliasing, pixels on edges are traced again.
+*/
+template <typename T>
+void SceneRendererBase::render_wavefront(const RenderTile& tile, RenderStats* stats) {
+    SceneArena* arena = get_wavefront_arena();
+    arena->reset();
+
+    unsigned int num_pixels = tile.width * tile.height;
+    WavefrontLevel* levels = arena->construct_array<WavefrontLevel>(config_.max_ray_depth + 1);
+
+    allocate_level(arena, num_pixels, &levels[0]);
+    levels[0].num_rays = num_pixels;
+    levels[0].seed = mix_seed(mix_seed(tile.index) ^ (static_cast<std::uint64_t>(render_pass_) << 1));
+    for (unsigned int j = 0; j < tile.height; j++) {
+        unsigned int row = j * tile.width;
+        camera_.calculate_rays(tile.x0, tile.y0 + j, tile.width,
+                               &levels[0].origins[row], &levels[0].directions[row]);
+    }
+
+    // Primary rays only test the actors that may be seen in this tile
+    if (!hit_cache_ || !is_replaying_hits_) {
+        Frustum frustum;
+        camera_.calculate_frustum(tile.x0, tile.y0, tile.width, tile.height,
+                                  config_.max_distance, &frustum);
+        ActorBVH<T>* bvh = scene_world_->get_bvh_ptr<T>();
+        unsigned int* nodes = arena->construct_array<unsigned int>(bvh->get_num_nodes());
+        levels[0].num_nodes = bvh->cull_nodes(frustum, nodes);
+        levels[0].nodes = nodes;
+
+        if (config_.raster_primary) {
+            ActorBase** actors = arena->construct_array<ActorBase*>(bvh->get_num_actors());
+            unsigned int num_actors = bvh->collect_actors(nodes, levels[0].num_nodes, actors);
+            rasterize_tile<T>(tile, actors, num_actors, arena, &levels[0]);
+        }
+    }
+
+    levels[0].is_cached = hit_cache_ != nullptr;
+    trace_levels<T>(tile, levels, arena, stats);
+
+    if (config_.aa_samples > 1) {
+        supersample_edges<T>(tile, &levels[0], arena, stats);
+    }
+
+    if (target_data_) {
+        const KernelTable& kernels = get_kernels();
+        for (unsigned int j = 0; j < tile.height; j++) {
+            unsigned char* out = target_data_ + (tile.y0 + j) * target_stride_ + 3 * tile.x0;
+            kernels.convert_pixels(levels[0].pixels[j * tile.width].data(), 3 * tile.width, out);
+        }
     } else {
-        // Parallel execution
-        if (num_threads_ != 0) {
-            omp_set_num_threads(num_threads_);
+        for (unsigned int j = 0; j < tile.height; j++) {
+            std::copy(&levels[0].pixels[j * tile.width], &levels[0].pixels[(j + 1) * tile.width],
+                      &framebuffer_[(tile.y0 + j) * config_.buffer_width + tile.x0]);
         }
-        unsigned int num_lines = config_.buffer_height / num_threads_;
-        unsigned int block_index;
+    }
 
-#pragma omp parallel for
-        for (block_index = 0; block_index < num_threads_; block_index++) {
-            render_block(block_index, num_lines);
+    if (!hit_cache_ || !is_replaying_hits_) {
+        stats->primary_rays += num_pixels;
+    }
+    if (hit_cache_ && !is_replaying_hits_) {
+        hit_cache_->finish_tile();
+    }
+}
+
+
+void SceneRendererBase::render_block(const RenderTile& tile, RenderStats* stats) {
+    if (scene_world_->get_precision() == Precision::Float) {
+        render_wavefront<float>(tile, stats);
+    } else {
+        render_wavefront<double>(tile, stats);
+    }
+}
+
+
+void SceneRendererBase::process_tile(const RenderTile& tile) {
+    auto time_start = std::chrono::steady_clock::now();
+    if (has_deadline_ && time_start + tile_cost_ > deadline_) {
+        // The tile keeps the pixels of an earlier pass
+        return;
+    }
+
+    TraceSpan span("render_tile", tile.index);
+    RenderStats stats;
+
+    if (checkpoint_ && !target_data_) {
+        // Tiles finished before a restart are copied from the journal
+        if (!checkpoint_->restore_tile(tile, &framebuffer_[0])) {
+            render_block(tile, &stats);
+            checkpoint_->store_tile(tile, &framebuffer_[0]);
         }
+    } else {
+        render_block(tile, &stats);
+    }
+
+    // Counters are collected per tile to keep atomics out of the inner loop
+    __atomic_fetch_add(&stats_.primary_rays, stats.primary_rays, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats_.reflected_rays, stats.reflected_rays, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats_.shadow_rays, stats.shadow_rays, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats_.divergent_rays, stats.divergent_rays, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats_.supersampled_pixels, stats.supersampled_pixels, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats_.pruned_rays, stats.pruned_rays, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats_.cached_shadow_rays, stats.cached_shadow_rays, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats_.mapped_shadow_rays, stats.mapped_shadow_rays, __ATOMIC_RELAXED);
+
+    if (has_deadline_) {
+        std::chrono::nanoseconds time_used = std::chrono::steady_clock::now() - time_start;
+        __atomic_fetch_add(&tile_nanos_, static_cast<std::uint64_t>(time_used.count()), __ATOMIC_RELAXED);
+        __atomic_fetch_add(&num_timed_tiles_, 1u, __ATOMIC_RELAXED);
+    }
+
+    if (tile_callback_) {
+        tile_callback_(tile);
+    }
+}
+
+
+float SceneRendererBase::do_render() {
+    TraceSpan span("render");
+    prepare_render();
+
+    auto time_start = std::chrono::steady_clock::now();
+
+    // Journals and hit caches expect every tile to be rendered once
+    if (config_.time_budget > 0 && !checkpoint_ && !hit_cache_) {
+        render_budgeted(time_start);
+    } else {
+        std::vector<unsigned int> tile_indices(tiles_.size());
+        std::iota(tile_indices.begin(), tile_indices.end(), 0);
+        render_tiles(tile_indices);
+    }
+
+    std::chrono::duration<float> time_used = std::chrono::steady_clock::now() - time_start;
 
-        unsigned int num_fill = config_.buffer_height % num_threads_;
-        if (num_fill) {
-            render_block(block_index + 1, num_fill);
+    return time_used.count();
+}
+
+
+/*
+Meets config_.time_budget with an image that is always complete. A
+first pass renders all tiles with shadows, but one primary ray per
+pixel and no reflections. Every 16th tile then tries the quality
+levels from the cheapest up, while the level below still fits the time
+left, so that no probe costs much more than the one before. The best
+level that fits renders the probe tiles again, even past the deadline,
+so that none is left at another level, and then the other tiles. Those
+that would end after the deadline keep their first pass.
+*/
+void SceneRendererBase::render_budgeted(std::chrono::steady_clock::time_point time_start) {
+    typedef std::chrono::steady_clock Clock;
+    const unsigned int kSampleStride = 16;
+
+    // Reflections come first, anti-aliasing only changes pixels on edges
+    const RendererConfig best_config = config_;
+    RendererConfig level = best_config;
+    level.max_ray_depth = 0;
+    level.aa_samples = 1;
+    std::vector<RendererConfig> levels(1, level);
+    while (level.max_ray_depth < best_config.max_ray_depth) {
+        level.max_ray_depth++;
+        levels.push_back(level);
+    }
+    unsigned int max_grid = static_cast<unsigned int>(std::sqrt(static_cast<double>(best_config.aa_samples)));
+    for (unsigned int grid = 2; grid <= max_grid; grid++) {
+        level.aa_samples = (grid == max_grid) ? best_config.aa_samples : grid * grid;
+        levels.push_back(level);
+    }
+
+    std::vector<unsigned int> all_tiles(tiles_.size());
+    std::iota(all_tiles.begin(), all_tiles.end(), 0);
+    std::vector<unsigned int> samples;
+    std::vector<unsigned int> others;
+    for (unsigned int tile_index : all_tiles) {
+        if (tile_index % kSampleStride == 0) {
+            samples.push_back(tile_index);
+        } else {
+            others.push_back(tile_index);
         }
     }
-#else
-    // No OpenMP compiled in, always do serial execution
-    render_block(0, config_.buffer_height);
 
-#endif  // !_OPENMP
+    // The first pass is never skipped, its tile time over its wall
+    // time tells how many tiles run at once
+    has_deadline_ = true;
+    deadline_ = Clock::time_point::max();
+    tile_cost_ = Clock::duration::zero();
+    tile_nanos_ = 0;
+    num_timed_tiles_ = 0;
+    config_ = levels[0];
+    auto pass_start = Clock::now();
+    render_tiles(all_tiles);
+    std::chrono::nanoseconds pass_time = Clock::now() - pass_start;
+    double parallelism = std::max(1.0, static_cast<double>(tile_nanos_) / std::max<std::int64_t>(pass_time.count(), 1));
+
+    std::vector<Clock::duration> costs(levels.size(), Clock::duration::zero());
+    costs[0] = std::chrono::nanoseconds(tile_nanos_ / std::max(num_timed_tiles_, 1u));
+
+    deadline_ = time_start + std::chrono::duration_cast<Clock::duration>(
+                std::chrono::duration<double>(best_config.time_budget));
+    auto fits = [&](std::size_t i, std::size_t num_tiles) {
+        double time_needed = std::chrono::duration<double>(costs[i]).count() * num_tiles / parallelism;
+        return Clock::now() + std::chrono::duration_cast<Clock::duration>(
+                    std::chrono::duration<double>(time_needed)) <= deadline_;
+    };
+
+    // A level is probed only if the other tiles would still fit the level
+    // below afterwards, probe tiles are skipped unless they fit its cost
+    std::size_t num_probed = 1;
+    bool has_probes = false;
+    while (num_probed < levels.size() && fits(num_probed - 1, samples.size() + others.size())) {
+        config_ = levels[num_probed];
+        render_pass_++;
+        tile_cost_ = costs[num_probed - 1];
+        tile_nanos_ = 0;
+        num_timed_tiles_ = 0;
+        render_tiles(samples);
+        has_probes = has_probes || num_timed_tiles_ > 0;
+        if (num_timed_tiles_ < samples.size()) {
+            // Out of time already
+            break;
+        }
+        costs[num_probed] = std::chrono::nanoseconds(tile_nanos_ / num_timed_tiles_);
+        num_probed++;
+    }
+
+    std::size_t level_index = num_probed - 1;
+    while (level_index > 0 && !fits(level_index, samples.size() + others.size())) {
+        level_index--;
+    }
+    config_ = levels[level_index];
+    render_pass_++;
+    if (has_probes) {
+        auto deadline = deadline_;
+        deadline_ = Clock::time_point::max();
+        tile_cost_ = Clock::duration::zero();
+        render_tiles(samples);
+        deadline_ = deadline;
+    }
+    unsigned int num_fallback_tiles = 0;
+    if (level_index > 0) {
+        tile_cost_ = costs[level_index];
+        num_timed_tiles_ = 0;
+        render_tiles(others);
+        num_fallback_tiles = others.size() - num_timed_tiles_;
+    }
+
+    quality_.max_ray_depth = levels[level_index].max_ray_depth;
+    quality_.aa_samples = levels[level_index].aa_samples;
+    quality_.num_fallback_tiles = num_fallback_tiles;
+
+    has_deadline_ = false;
+    render_pass_ = 0;
+    config_ = best_config;
+}
+
+
+ParallelSceneRenderer::ParallelSceneRenderer(SceneWorld* scene_world,
+                                             const RendererConfig& render_config,
+                                             unsigned int num_threads) :
+    SceneRendererBase(scene_world, render_config),
+    num_threads_(num_threads) {
 
-    long time_elapsed = std::clock() - time_start;
-    float time_used = static_cast<float>(time_elapsed) / CLOCKS_PER_SEC / num_threads_;
+}
 
-    return time_used;
+
+void ParallelSceneRenderer::render_tiles(const std::vector<unsigned int>& tile_indices) {
+#ifdef _OPENMP
+    if (num_threads_ != 0) {
+        omp_set_num_threads(num_threads_);
+    }
+    int num_tiles = static_cast<int>(tile_indices.size());
+
+    // Tiles differ in cost, so they are handed out one by one
+#pragma omp parallel for schedule(dynamic, 1)
+    for (int i = 0; i < num_tiles; i++) {
+        process_tile(tiles_[tile_indices[i]]);
+    }
+#else
+    // No OpenMP compiled in, always do serial execution
+    for (unsigned int tile_index : tile_indices) {
+        process_tile(tiles_[tile_index]);
+    }
+#endif  // !_OPENMP
 }
 
 
@@ -191,15 +1344,21 @@ SceneRenderer::SceneRenderer(SceneWorld* scene_world,
 }
 
 
-float SceneRenderer::do_render() {
-    Camera* my_camera = scene_world_->get_camera_ptr();
-    my_camera->calculate_window(config_.buffer_width, config_.buffer_height, perspective_);
-
-    long time_start = clock();
+void SceneRenderer::render_tiles(const std::vector<unsigned int>& tile_indices) {
+    for (unsigned int tile_index : tile_indices) {
+        process_tile(tiles_[tile_index]);
+    }
+}
 
-    render_block(0, config_.buffer_height);
 
-    return static_cast<float>(std::clock() - time_start) / CLOCKS_PER_SEC;
+std::shared_ptr<SceneRendererBase> create_renderer(SceneWorld* scene_world,
+                                                   const RendererConfig& config) {
+    if (config.num_threads == 1) {
+        return std::shared_ptr<SceneRendererBase>(
+                    new SceneRenderer(scene_world, config));
+    }
+    return std::shared_ptr<SceneRendererBase>(
+                new ParallelSceneRenderer(scene_world, config, config.num_threads));
 }
 
 
@@ -210,18 +1369,23 @@ ScenePNGWriter::ScenePNGWriter(SceneRendererBase* scene_renderer) :
 
 
 void ScenePNGWriter::write_to_file(const std::string& png_filename) {
+    TraceSpan span("write_png");
+
     png::image<png::rgb_pixel> image(
                 scene_renderer_->config_.buffer_width, scene_renderer_->config_.buffer_height);
 
-    Pixel* in = &scene_renderer_->framebuffer_[0];
+    unsigned int buffer_width = scene_renderer_->config_.buffer_width;
+    std::vector<unsigned char> row(3 * buffer_width);
 
     for (unsigned int i = 0; i < scene_renderer_->config_.buffer_height; i++) {
+        const Pixel* in = &scene_renderer_->framebuffer_[i * buffer_width];
+        get_kernels().convert_pixels(in->data(), row.size(), &row[0]);
+
         png::rgb_pixel* out = &image[i][0];
-        for (unsigned int j = 0; j < scene_renderer_->config_.buffer_width; j++, in++, out++) {
-            Pixel bytes = 255 * (*in);
-            out->red = static_cast<unsigned char>(bytes[0]);
-            out->green = static_cast<unsigned char>(bytes[1]);
-            out->blue = static_cast<unsigned char>(bytes[2]);
+        for (unsigned int j = 0; j < buffer_width; j++, out++) {
+            out->red = row[3 * j];
+            out->green = row[3 * j + 1];
+            out->blue = row[3 * j + 2];
         }
     }
 
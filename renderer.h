@@ -2,12 +2,17 @@
 #define _RENDERER_H
 
 #include <Eigen/Core>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
 #include <vector>
 
 #include "actors.h"
 #include "camera.h"
 #include "light.h"
 #include "pixel.h"
+#include "shadowmap.h"
 #include "world.h"
 
 
@@ -16,6 +21,10 @@ namespace mrtp {
 using Vector3d = Eigen::Vector3d;
 
 class ScenePNGWriter;
+class RenderCheckpoint;
+class PrimaryHitCache;
+class SceneArena;
+struct WavefrontLevel;
 
 
 struct RendererConfig {
@@ -29,18 +38,121 @@ struct RendererConfig {
 
     unsigned int max_ray_depth = 3;
     unsigned int num_threads = 1;
+
+    unsigned int tile_size = 32;
+
+    // Shade the hits of each level grouped by texture mapper
+    bool deferred_shading = false;
+
+    // Samples for pixels on edges, rounded down to a square, 1 turns
+    // anti-aliasing off. Neighbours differing by more than aa_threshold
+    // in a colour channel or in relative depth make an edge.
+    unsigned int aa_samples = 1;
+    double aa_threshold = 0.1;
+
+    // Take primary hits from a buffer of actors and depths rasterized
+    // for every tile
+    bool raster_primary = false;
+
+    // Order reflected rays by direction octant and origin, helps scenes
+    // whose reflections scatter, such as cubes and planes
+    bool sort_reflections = false;
+
+    // Reflected rays whose share in their pixel falls below
+    // min_contribution are not traced. With russian_roulette some of
+    // them are, with their colour scaled up so the image is unbiased.
+    double min_contribution = 1.0 / 255;
+    bool russian_roulette = false;
+
+    // Lights that cast shadow rays from a hit, the strongest ones there
+    unsigned int max_shadow_lights = 4;
+
+    // Texels along the edge of the occlusion cube map built around every
+    // light, 0 for none. Shadow rays only decide what the maps cannot.
+    // Weaker lights go without a map once the maps would pass 1 GiB.
+    unsigned int shadow_map_size = 0;
+
+    // Seconds a frame may take, 0 for no limit. Anti-aliasing and then
+    // reflection depth are given up to meet it, shadows are kept.
+    double time_budget = 0;
+};
+
+
+struct RenderTile {
+    unsigned int index;
+    unsigned int x0;
+    unsigned int y0;
+    unsigned int width;
+    unsigned int height;
+};
+
+
+/*
+Rays traced by one render, shadow rays include those blocked
+by the first actor found.
+*/
+struct RenderStats {
+    std::uint64_t primary_rays = 0;
+    std::uint64_t reflected_rays = 0;
+    std::uint64_t shadow_rays = 0;
+
+    // Reflected rays that hit another actor than the ray traced
+    // before them, fewer means more coherent batches
+    std::uint64_t divergent_rays = 0;
+
+    // Pixels on edges that got more than one sample
+    std::uint64_t supersampled_pixels = 0;
+
+    // Reflected rays not traced for their small contribution
+    std::uint64_t pruned_rays = 0;
+
+    // Shadow rays blocked by the actor that blocked the ray before
+    // them towards the same light, found with one intersection test
+    std::uint64_t cached_shadow_rays = 0;
+
+    // Shadows answered by the occlusion map of their light, these
+    // are not counted in shadow_rays
+    std::uint64_t mapped_shadow_rays = 0;
+};
+
+
+/*
+Settings a time-budgeted render finished most tiles with. Fallback
+tiles are those the deadline left no time for, they keep the quality
+of the first pass, one primary ray per pixel with shadows but no
+reflections.
+*/
+struct QualityReport {
+    unsigned int max_ray_depth = 0;
+    unsigned int aa_samples = 1;
+    unsigned int num_tiles = 0;
+    unsigned int num_fallback_tiles = 0;
 };
 
 
+// Called for every tile rendered, more than once per frame for tiles
+// that a time budget renders again
+typedef std::function<void(const RenderTile&)> TileCallback;
+
+
 class SceneRendererBase {
     friend class ScenePNGWriter;
+    friend class SceneStreamWriter;
 
 public:
     SceneRendererBase(SceneWorld*, const RendererConfig&);
     SceneRendererBase() = delete;
     virtual ~SceneRendererBase() = default;
 
-    virtual float do_render() = 0;
+    float do_render();
+
+    void set_checkpoint(RenderCheckpoint*);
+    void set_hit_cache(PrimaryHitCache*);
+    void set_tile_callback(TileCallback);
+    void set_render_target(unsigned char*, std::size_t);
+
+    const RenderStats& get_stats() const;
+    const QualityReport& get_quality_report() const;
 
 protected:
     double ratio_;
@@ -48,12 +160,58 @@ protected:
 
     SceneWorld* scene_world_;
     RendererConfig config_;
+    Camera camera_;
+    LightTree light_tree_;
+    std::vector<LightOcclusionMap> occlusion_maps_;   // By light tree node
     std::vector<Pixel> framebuffer_;
+    unsigned char* target_data_;       // RGB24 rows replacing the framebuffer
+    std::size_t target_stride_;
+    std::vector<RenderTile> tiles_;
+    RenderCheckpoint* checkpoint_;
+    PrimaryHitCache* hit_cache_;
+    bool is_replaying_hits_;
+    TileCallback tile_callback_;
+    RenderStats stats_;
+    QualityReport quality_;
 
-    Pixel trace_ray_r(const Vector3d&, const Vector3d&, unsigned int) const;
-    ActorBase* solve_hits(const Vector3d&, const Vector3d&, double*) const;
-    bool solve_shadows(const Vector3d&, const Vector3d&, double) const;
-    void render_block(unsigned int, unsigned int);
+    // Tiles that would end after the deadline are skipped, the
+    // others add their time to tile_nanos_ and count in num_timed_tiles_
+    bool has_deadline_;
+    std::chrono::steady_clock::time_point deadline_;
+    std::chrono::steady_clock::duration tile_cost_;
+    std::uint64_t tile_nanos_;
+    unsigned int num_timed_tiles_;
+
+    // Tiles rendered again in one frame draw other random numbers
+    unsigned int render_pass_;
+
+    // Instantiated for the precision of the world, float or double
+    template <typename T>
+    ActorBase* solve_hits(const WavefrontLevel&, unsigned int, double*) const;
+    template <typename T>
+    bool solve_shadows(const Vector3d&, const Vector3d&, double, unsigned int*) const;
+    template <typename T>
+    bool trace_wavefront(const RenderTile&, unsigned int, WavefrontLevel*, WavefrontLevel*,
+                         SceneArena*, RenderStats*);
+    template <typename T>
+    void trace_levels(const RenderTile&, WavefrontLevel*, SceneArena*, RenderStats*);
+    template <typename T>
+    void supersample_edges(const RenderTile&, WavefrontLevel*, SceneArena*, RenderStats*);
+    template <typename T>
+    void render_wavefront(const RenderTile&, RenderStats*);
+    template <typename T>
+    void rasterize_tile(const RenderTile&, ActorBase* const*, unsigned int,
+                        SceneArena*, WavefrontLevel*) const;
+
+    std::uint64_t hash_primary_rays() const;
+
+    void render_block(const RenderTile&, RenderStats*);
+    void process_tile(const RenderTile&);
+    void prepare_render();
+    void render_budgeted(std::chrono::steady_clock::time_point);
+
+    // Renders the tiles of the given indices, in any order
+    virtual void render_tiles(const std::vector<unsigned int>&) = 0;
 };
 
 
@@ -63,7 +221,8 @@ public:
     ParallelSceneRenderer() = delete;
     ~ParallelSceneRenderer() override = default;
 
-    float do_render() override;
+protected:
+    void render_tiles(const std::vector<unsigned int>&) override;
 
 private:
     unsigned int num_threads_;
@@ -76,7 +235,8 @@ public:
     SceneRenderer() = delete;
     ~SceneRenderer() override = default;
 
-    float do_render() override;
+protected:
+    void render_tiles(const std::vector<unsigned int>&) override;
 };
 
 
@@ -93,6 +253,9 @@ private:
 };
 
 
+std::shared_ptr<SceneRendererBase> create_renderer(SceneWorld*, const RendererConfig&);
+
+
 }  //namespace mrtp
 
 #endif  //_RENDERER_H
@@ -0,0 +1,446 @@
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <easylogging++.h>
+
+#include "renderer.h"
+#include "scenegen.h"
+#include "texture.h"
+#include "world.h"
+
+INITIALIZE_EASYLOGGINGPP
+
+
+struct SceneBenchConfig {
+    std::vector<mrtp::SceneKind> kinds{
+        mrtp::SceneKind::Spheres,
+        mrtp::SceneKind::Molecule,
+        mrtp::SceneKind::Planes,
+        mrtp::SceneKind::Cubes,
+        mrtp::SceneKind::MoleculeGrid
+    };
+    std::vector<unsigned int> sizes{10, 100, 1000};
+    std::vector<unsigned int> depths{3};
+    std::vector<std::pair<unsigned int, unsigned int>> resolutions{{640, 480}};
+    std::vector<unsigned int> threads{1};
+    unsigned int seed = 1;
+    bool sort_reflections = false;
+    unsigned int shadow_map_size = 0;
+    std::string output_format = "csv";
+    std::string output_file = "-";
+    std::string work_directory;
+};
+
+
+struct SceneBenchRun {
+    mrtp::SceneKind kind;
+    unsigned int size;
+    unsigned int depth;
+    unsigned int width;
+    unsigned int height;
+    unsigned int threads;
+};
+
+
+struct SceneBenchResult {
+    bool is_done;
+    unsigned int num_actors;
+    double build_time;
+    double render_time;
+    double write_time;
+    mrtp::RenderStats stats;
+    long peak_rss_kb;
+};
+
+
+static double seconds_since(std::chrono::steady_clock::time_point time_start) {
+    std::chrono::duration<double> time_used = std::chrono::steady_clock::now() - time_start;
+    return time_used.count();
+}
+
+
+static SceneBenchResult run_pipeline(const std::string& toml_file,
+                                     const std::string& png_file,
+                                     const SceneBenchRun& run,
+                                     const SceneBenchConfig& config) {
+    SceneBenchResult result{};
+
+    mrtp::RendererConfig renderer_config;
+    renderer_config.buffer_width = run.width;
+    renderer_config.buffer_height = run.height;
+    renderer_config.max_ray_depth = run.depth;
+    renderer_config.num_threads = run.threads;
+    renderer_config.sort_reflections = config.sort_reflections;
+    renderer_config.shadow_map_size = config.shadow_map_size;
+
+    auto time_start = std::chrono::steady_clock::now();
+    mrtp::TextureFactory texture_factory;
+    auto world_ptr = mrtp::build_world(toml_file, &texture_factory);
+    if (!world_ptr) {
+        return result;
+    }
+    result.build_time = seconds_since(time_start);
+
+    for (auto iter = world_ptr->get_actor_iterator(); !iter.is_done(); iter.next()) {
+        result.num_actors++;
+    }
+
+    auto scene_renderer = mrtp::create_renderer(world_ptr.get(), renderer_config);
+    result.render_time = scene_renderer->do_render();
+    result.stats = scene_renderer->get_stats();
+
+    time_start = std::chrono::steady_clock::now();
+    mrtp::ScenePNGWriter scene_writer(scene_renderer.get());
+    scene_writer.write_to_file(png_file);
+    result.write_time = seconds_since(time_start);
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    result.peak_rss_kb = usage.ru_maxrss;
+
+    result.is_done = true;
+    return result;
+}
+
+
+/*
+Every run gets its own process, so the peak RSS belongs to that
+run alone and OpenMP thread pools do not carry over.
+*/
+static SceneBenchResult run_isolated(const std::string& toml_file,
+                                     const std::string& png_file,
+                                     const SceneBenchRun& run,
+                                     const SceneBenchConfig& config) {
+    SceneBenchResult result{};
+
+    int fds[2];
+    if (pipe(fds) != 0) {
+        LOG(ERROR) << "Cannot create pipe";
+        return result;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        LOG(ERROR) << "Cannot fork benchmark run";
+        close(fds[0]);
+        close(fds[1]);
+        return result;
+    }
+
+    if (pid == 0) {
+        close(fds[0]);
+        SceneBenchResult child_result = run_pipeline(toml_file, png_file, run, config);
+        ssize_t num_written = write(fds[1], &child_result, sizeof(child_result));
+        close(fds[1]);
+        _exit(num_written == sizeof(child_result) ? 0 : 1);
+    }
+
+    close(fds[1]);
+    if (read(fds[0], &result, sizeof(result)) != sizeof(result)) {
+        result.is_done = false;
+    }
+    close(fds[0]);
+
+    int status;
+    waitpid(pid, &status, 0);
+    return result;
+}
+
+
+static void write_csv_header(std::ostream& out) {
+    out << "scene,size,actors,depth,width,height,threads,build_s,render_s,write_s,"
+        << "primary_rays,reflected_rays,shadow_rays,divergent_rays,pruned_rays,cached_shadow_rays,mapped_shadow_rays,mrays_per_s,peak_rss_kb" << std::endl;
+}
+
+
+static void write_result(std::ostream& out,
+                         const std::string& output_format,
+                         bool is_first,
+                         const SceneBenchRun& run,
+                         const SceneBenchResult& result) {
+    const mrtp::RenderStats& stats = result.stats;
+    double num_rays = static_cast<double>(stats.primary_rays + stats.reflected_rays + stats.shadow_rays);
+    double mrays_per_s = (result.render_time > 0) ? num_rays / result.render_time / 1e6 : 0;
+
+    std::stringstream line;
+    line << std::fixed << std::setprecision(6);
+
+    if (output_format == "json") {
+        line << (is_first ? "  {" : ",\n  {")
+             << "\"scene\": \"" << mrtp::get_scene_kind_name(run.kind) << "\", "
+             << "\"size\": " << run.size << ", "
+             << "\"actors\": " << result.num_actors << ", "
+             << "\"depth\": " << run.depth << ", "
+             << "\"width\": " << run.width << ", "
+             << "\"height\": " << run.height << ", "
+             << "\"threads\": " << run.threads << ", "
+             << "\"build_s\": " << result.build_time << ", "
+             << "\"render_s\": " << result.render_time << ", "
+             << "\"write_s\": " << result.write_time << ", "
+             << "\"primary_rays\": " << stats.primary_rays << ", "
+             << "\"reflected_rays\": " << stats.reflected_rays << ", "
+             << "\"shadow_rays\": " << stats.shadow_rays << ", "
+             << "\"divergent_rays\": " << stats.divergent_rays << ", "
+             << "\"pruned_rays\": " << stats.pruned_rays << ", "
+             << "\"cached_shadow_rays\": " << stats.cached_shadow_rays << ", "
+             << "\"mapped_shadow_rays\": " << stats.mapped_shadow_rays << ", "
+             << "\"mrays_per_s\": " << mrays_per_s << ", "
+             << "\"peak_rss_kb\": " << result.peak_rss_kb << "}";
+        out << line.str() << std::flush;
+        return;
+    }
+
+    line << mrtp::get_scene_kind_name(run.kind) << ','
+         << run.size << ','
+         << result.num_actors << ','
+         << run.depth << ','
+         << run.width << ','
+         << run.height << ','
+         << run.threads << ','
+         << result.build_time << ','
+         << result.render_time << ','
+         << result.write_time << ','
+         << stats.primary_rays << ','
+         << stats.reflected_rays << ','
+         << stats.shadow_rays << ','
+         << stats.divergent_rays << ','
+         << stats.pruned_rays << ','
+         << stats.cached_shadow_rays << ','
+         << stats.mapped_shadow_rays << ','
+         << mrays_per_s << ','
+         << result.peak_rss_kb;
+    out << line.str() << std::endl;
+}
+
+
+static bool run_benchmarks(const SceneBenchConfig& config, std::ostream& out) {
+    if (config.output_format == "json") {
+        out << "[\n";
+    } else {
+        write_csv_header(out);
+    }
+
+    bool is_first = true;
+    for (auto kind : config.kinds) {
+        for (auto size : config.sizes) {
+            std::string toml_file = mrtp::generate_scene(
+                        kind, size, config.seed, config.work_directory);
+            if (toml_file.empty()) {
+                return false;
+            }
+            std::string png_file = toml_file.substr(0, toml_file.rfind(".toml")) + ".png";
+
+            for (auto depth : config.depths) {
+                for (const auto& resolution : config.resolutions) {
+                    for (auto threads : config.threads) {
+                        SceneBenchRun run{kind, size, depth,
+                                    resolution.first, resolution.second, threads};
+
+                        SceneBenchResult result = run_isolated(toml_file, png_file, run, config);
+                        if (!result.is_done) {
+                            LOG(ERROR) << "Benchmark failed for " << toml_file;
+                            return false;
+                        }
+                        write_result(out, config.output_format, is_first, run, result);
+                        is_first = false;
+                    }
+                }
+            }
+        }
+    }
+
+    if (config.output_format == "json") {
+        out << "\n]" << std::endl;
+    }
+    return true;
+}
+
+
+void display_help() {
+    std::cout << R"(Usage: mrtp_scenebench [OPTION]...
+  Options:
+    -F   output format: csv (default) or json
+    -h   print this help screen
+    -k   scene kinds: spheres,molecule,planes,cubes,molecule-grid
+         (default all), molecule-grid is the molecule in a uniform grid
+    -m   texels per face of occlusion cube maps around the lights,
+         mapped_shadow_rays counts shadows they answer (default 0, none)
+    -n   actors per scene, eg. 10,100,1000 (default)
+    -o   output filename, - for stdout (default)
+    -r   resolutions, eg. 640x480 (default)
+    -R   levels of recursion for reflected rays (default 3)
+    -s   random seed (default 1)
+    -S   sort reflected rays by direction and origin, divergent_rays
+         counts reflected rays that hit another actor than the one before
+    -t   rendering threads: 0 (auto), 1 (default), 2, ...
+    -w   directory for generated scenes and images
+         (default /tmp/mrtp_scenebench_PID)
+
+Every combination of the lists runs build_world, do_render and the
+PNG writer in a separate process.
+
+Example:
+  mrtp_scenebench -k spheres,cubes -n 100,1000,10000 -t 1,2,4 -F json)" << std::endl;
+}
+
+
+static std::vector<std::string> split_list(const std::string& s) {
+    std::vector<std::string> items;
+    std::stringstream stream(s);
+    std::string item;
+    while (std::getline(stream, item, ',')) {
+        items.push_back(item);
+    }
+    return items;
+}
+
+
+static bool parse_unsigned_list(const std::string& s, std::vector<unsigned int>* values) {
+    values->clear();
+    for (const auto& item : split_list(s)) {
+        std::stringstream convert(item);
+        unsigned int value;
+        convert >> value;
+        if (convert.fail() || !convert.eof()) {
+            return false;
+        }
+        values->push_back(value);
+    }
+    return !values->empty();
+}
+
+
+static bool parse_resolution_list(const std::string& s,
+                                  std::vector<std::pair<unsigned int, unsigned int>>* values) {
+    values->clear();
+    for (const auto& item : split_list(s)) {
+        std::stringstream convert(item);
+        unsigned int width, height;
+        char x;
+        convert >> width >> x >> height;
+        if (convert.fail() || !convert.eof() || x != 'x' || !width || !height) {
+            return false;
+        }
+        values->push_back(std::make_pair(width, height));
+    }
+    return !values->empty();
+}
+
+
+static bool parse_kind_list(const std::string& s, std::vector<mrtp::SceneKind>* values) {
+    values->clear();
+    for (const auto& item : split_list(s)) {
+        mrtp::SceneKind kind;
+        if (!mrtp::parse_scene_kind(item, &kind)) {
+            return false;
+        }
+        values->push_back(kind);
+    }
+    return !values->empty();
+}
+
+
+bool process_command_line(int argc, char** argv, SceneBenchConfig* config) {
+    int c;
+    bool is_parsed = true;
+    std::vector<unsigned int> seeds;
+    std::vector<unsigned int> map_sizes;
+
+    while ((c = getopt(argc, argv, "F:hk:m:n:o:r:R:s:St:w:")) != -1) {
+        if (c == 'h') {
+            display_help();
+            return false;
+        }
+        else if (c == 'F') {
+            config->output_format = std::string(optarg);
+            is_parsed = config->output_format == "csv" || config->output_format == "json";
+        }
+        else if (c == 'k') {
+            is_parsed = parse_kind_list(optarg, &config->kinds);
+        }
+        else if (c == 'm') {
+            is_parsed = parse_unsigned_list(optarg, &map_sizes) && map_sizes.size() == 1;
+            config->shadow_map_size = is_parsed ? map_sizes[0] : 0;
+        }
+        else if (c == 'n') {
+            is_parsed = parse_unsigned_list(optarg, &config->sizes);
+        }
+        else if (c == 'o') {
+            config->output_file = std::string(optarg);
+        }
+        else if (c == 'r') {
+            is_parsed = parse_resolution_list(optarg, &config->resolutions);
+        }
+        else if (c == 'R') {
+            is_parsed = parse_unsigned_list(optarg, &config->depths);
+        }
+        else if (c == 's') {
+            is_parsed = parse_unsigned_list(optarg, &seeds) && seeds.size() == 1;
+            config->seed = is_parsed ? seeds[0] : 0;
+        }
+        else if (c == 't') {
+            is_parsed = parse_unsigned_list(optarg, &config->threads);
+        }
+        else if (c == 'S') {
+            config->sort_reflections = true;
+        }
+        else if (c == 'w') {
+            config->work_directory = std::string(optarg);
+        }
+        else {
+            return false;
+        }
+
+        if (!is_parsed) {
+            LOG(ERROR) << "Invalid value for option -" << static_cast<char>(c);
+            return false;
+        }
+    }
+    return true;
+}
+
+
+int main(int argc, char** argv) {
+    SceneBenchConfig config;
+    if (!process_command_line(argc, argv, &config)) {
+        return 1;
+    }
+
+    // Only errors, the results may go to stdout
+    el::Loggers::reconfigureAllLoggers(el::Level::Info, el::ConfigurationType::Enabled, "false");
+    el::Loggers::reconfigureAllLoggers(el::Level::Warning, el::ConfigurationType::Enabled, "false");
+
+    if (config.work_directory.empty()) {
+        std::stringstream convert;
+        convert << "/tmp/mrtp_scenebench_" << getpid();
+        config.work_directory = convert.str();
+    }
+    if (mkdir(config.work_directory.c_str(), 0755) != 0 && errno != EEXIST) {
+        LOG(ERROR) << "Cannot create directory " << config.work_directory;
+        return 1;
+    }
+
+    bool is_done;
+    if (config.output_file == "-") {
+        is_done = run_benchmarks(config, std::cout);
+    } else {
+        std::ofstream out(config.output_file.c_str());
+        if (!out.good()) {
+            LOG(ERROR) << "Cannot open output file " << config.output_file;
+            return 1;
+        }
+        is_done = run_benchmarks(config, out);
+    }
+    return is_done ? 0 : 1;
+}
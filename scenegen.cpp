@@ -0,0 +1,290 @@
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <random>
+#include <sstream>
+#include <easylogging++.h>
+
+#include "png.hpp"
+#include "scenegen.h"
+
+
+namespace mrtp {
+
+const char* kSceneKindNames[] = {"spheres", "molecule", "planes", "cubes", "molecule-grid"};
+
+// Room of the generated scenes, actors stay within this distance of the z axis
+const double kSceneExtent = 6;
+
+
+bool parse_scene_kind(const std::string& name, SceneKind* kind) {
+    for (unsigned int i = 0; i < 5; i++) {
+        if (name == kSceneKindNames[i]) {
+            *kind = static_cast<SceneKind>(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+
+std::string get_scene_kind_name(SceneKind kind) {
+    return kSceneKindNames[static_cast<unsigned int>(kind)];
+}
+
+
+/*
+Checkerboard with a pattern inside the fields, so neighbouring
+texels differ and lookups cannot be answered from one cache line.
+*/
+bool write_checker_texture(const std::string& texture_filename, unsigned int size) {
+    png::image<png::rgb_pixel> image(size, size);
+    for (unsigned int i = 0; i < size; i++) {
+        for (unsigned int j = 0; j < size; j++) {
+            unsigned char c = (((i / 32) + (j / 32)) % 2) ? 200 : 55;
+            image[i][j] = png::rgb_pixel(c, static_cast<unsigned char>(i ^ j), 255 - c);
+        }
+    }
+    image.write(texture_filename.c_str());
+
+    std::fstream check(texture_filename.c_str());
+    return check.good();
+}
+
+
+static std::string format_vector(double x, double y, double z) {
+    std::stringstream convert;
+    convert << std::fixed << std::setprecision(4) << "[" << x << ", " << y << ", " << z << "]";
+    return convert.str();
+}
+
+
+static void write_scene_header(std::ostream& out) {
+    out << "[camera]\n"
+        << "center = [14.0, 0.0, 9.0]\n"
+        << "target = [0.0, 0.0, 2.0]\n"
+        << "roll = 0.0\n\n"
+        << "[light]\n"
+        << "center = [5.0, -5.0, 12.0]\n\n";
+}
+
+
+static void write_floor(std::ostream& out) {
+    out << "[[planes]]\n"
+        << "center = [0.0, 0.0, 0.0]\n"
+        << "normal = [0.0, 0.0, 1.0]\n"
+        << "reflect = 0.3\n"
+        << "color = [0.8, 0.8, 0.7]\n\n";
+}
+
+
+static void write_spheres(unsigned int size, std::mt19937_64* rng, std::ostream& out) {
+    std::uniform_real_distribution<double> position(-kSceneExtent, kSceneExtent);
+    std::uniform_real_distribution<double> height(0.5, kSceneExtent);
+    std::uniform_real_distribution<double> unit(0, 1);
+
+    // Keep the total volume roughly constant
+    double radius = std::min(0.8, 3 / std::cbrt(static_cast<double>(size)));
+
+    write_floor(out);
+    for (unsigned int i = 0; i < size; i++) {
+        out << "[[spheres]]\n"
+            << "center = " << format_vector(position(*rng), position(*rng), height(*rng)) << "\n"
+            << "radius = " << radius * (0.5 + unit(*rng)) << "\n"
+            << "color = " << format_vector(unit(*rng), unit(*rng), unit(*rng)) << "\n"
+            << "reflect = " << ((i % 3 == 0) ? 0.4 : 0.0) << "\n\n";
+    }
+}
+
+
+/*
+Atoms on a simple cubic lattice, each bonded to its neighbours
+along the axes. The lattice is filled in x, y, z order.
+*/
+static bool write_lattice_molecule(unsigned int size,
+                                   const std::string& mol2_filename,
+                                   unsigned int* lattice_size) {
+    unsigned int n = static_cast<unsigned int>(std::ceil(std::cbrt(static_cast<double>(size)) - 1e-9));
+    const double spacing = 1.5;
+
+    std::vector<std::pair<unsigned int, unsigned int>> bonds;
+    for (unsigned int i = 0; i < size; i++) {
+        unsigned int x = i % n;
+        unsigned int y = (i / n) % n;
+        if (x + 1 < n && i + 1 < size)
+            bonds.push_back(std::make_pair(i, i + 1));
+        if (y + 1 < n && i + n < size)
+            bonds.push_back(std::make_pair(i, i + n));
+        if (i + n * n < size)
+            bonds.push_back(std::make_pair(i, i + n * n));
+    }
+
+    std::ofstream out(mol2_filename.c_str());
+    out << "@<TRIPOS>MOLECULE\n"
+        << "lattice\n"
+        << size << " " << bonds.size() << " 0 0 0\n"
+        << "SMALL\n"
+        << "NO_CHARGES\n\n"
+        << "@<TRIPOS>ATOM\n"
+        << std::fixed << std::setprecision(4);
+
+    for (unsigned int i = 0; i < size; i++) {
+        out << (i + 1) << " C" << (i + 1) << " "
+            << spacing * (i % n) << " "
+            << spacing * ((i / n) % n) << " "
+            << spacing * (i / (n * n)) << " C.3 1 LAT 0.0000\n";
+    }
+
+    out << "@<TRIPOS>BOND\n";
+    for (unsigned int i = 0; i < bonds.size(); i++) {
+        out << (i + 1) << " " << (bonds[i].first + 1) << " " << (bonds[i].second + 1) << " 1\n";
+    }
+
+    *lattice_size = n;
+    return out.good();
+}
+
+
+static bool write_molecule(unsigned int size,
+                           bool has_grid,
+                           const std::string& directory,
+                           std::ostream& out) {
+    std::stringstream convert;
+    convert << directory << "/lattice_" << size << ".mol2";
+    std::string mol2_filename = convert.str();
+
+    unsigned int n;
+    if (!write_lattice_molecule(size, mol2_filename, &n)) {
+        LOG(ERROR) << "Cannot write molecule file " << mol2_filename;
+        return false;
+    }
+
+    // Fit the lattice into the room, the spacing is 1.5
+    double scale = kSceneExtent / (1.5 * n);
+
+    write_floor(out);
+    out << "[[molecules]]\n"
+        << "mol2file = \"" << mol2_filename << "\"\n"
+        << "acceleration = \"" << (has_grid ? "grid" : "bvh") << "\"\n"
+        << "center = [0.0, 0.0, " << kSceneExtent / 2 + 1 << "]\n"
+        << "atom_color = [0.0, 0.0, 1.0]\n"
+        << "bond_color = [0.6, 0.6, 0.6]\n"
+        << "atom_reflect = 0.3\n"
+        << "scale = " << scale << "\n"
+        << "atom_scale = " << 0.45 * scale << "\n"
+        << "bond_scale = " << 0.18 * scale << "\n"
+        << "angle_z = 30.0\n\n";
+    return true;
+}
+
+
+/*
+Planes face the origin from growing distances, so all of them
+are in front of the camera but only the nearest ones are seen.
+*/
+static bool write_planes(unsigned int size,
+                         const std::string& directory,
+                         std::mt19937_64* rng,
+                         std::ostream& out) {
+    std::string texture_filename = directory + "/checker.png";
+    if (!write_checker_texture(texture_filename, 512)) {
+        LOG(ERROR) << "Cannot write texture file " << texture_filename;
+        return false;
+    }
+
+    std::uniform_real_distribution<double> angle(0, 2 * M_PI);
+    std::uniform_real_distribution<double> tilt(-0.3, 0.3);
+
+    for (unsigned int i = 0; i < size; i++) {
+        double phi = angle(*rng);
+        double distance = 2 * kSceneExtent + i;
+        double nx = std::cos(phi);
+        double ny = std::sin(phi);
+        double nz = (i == 0) ? 1 : tilt(*rng);
+
+        out << "[[planes]]\n";
+        if (i == 0) {
+            out << "center = [0.0, 0.0, 0.0]\n";
+            nx = ny = 0;
+        } else {
+            out << "center = " << format_vector(-distance * nx, -distance * ny, 0) << "\n";
+        }
+        out << "normal = " << format_vector(nx, ny, nz) << "\n"
+            << "scale = 0.15\n"
+            << "reflect = " << ((i % 2 == 0) ? 0.3 : 0.0) << "\n"
+            << "texture = \"" << texture_filename << "\"\n\n";
+    }
+    return true;
+}
+
+
+static void write_cubes(unsigned int size, std::mt19937_64* rng, std::ostream& out) {
+    std::uniform_real_distribution<double> angle(0, 90);
+    std::uniform_real_distribution<double> unit(0, 1);
+
+    unsigned int n = static_cast<unsigned int>(std::ceil(std::sqrt(static_cast<double>(size)) - 1e-9));
+    double spacing = 2 * kSceneExtent / n;
+    double scale = 0.6 * spacing;
+
+    write_floor(out);
+    for (unsigned int i = 0; i < size; i++) {
+        double x = -kSceneExtent + spacing * (i % n + 0.5);
+        double y = -kSceneExtent + spacing * (i / n + 0.5);
+
+        out << "[[cubes]]\n"
+            << "center = " << format_vector(x, y, scale / 2) << "\n"
+            << "direction = [0.0, 0.0, 1.0]\n"
+            << "scale = " << scale << "\n"
+            << "angle_z = " << angle(*rng) << "\n"
+            << "color = " << format_vector(unit(*rng), unit(*rng), unit(*rng)) << "\n"
+            << "reflect = " << ((i % 4 == 0) ? 0.3 : 0.0) << "\n\n";
+    }
+}
+
+
+/*
+Writes a synthetic scene with about size actors of the given kind into
+directory and returns the name of its TOML file, or an empty string.
+Scenes of one kind and seed differ only in the number of actors.
+*/
+std::string generate_scene(SceneKind kind,
+                           unsigned int size,
+                           unsigned int seed,
+                           const std::string& directory) {
+    std::stringstream convert;
+    convert << directory << "/" << get_scene_kind_name(kind) << "_" << size << ".toml";
+    std::string toml_filename = convert.str();
+
+    std::mt19937_64 rng(seed);
+    std::stringstream scene;
+    write_scene_header(scene);
+
+    bool is_written = true;
+    if (kind == SceneKind::Spheres) {
+        write_spheres(size, &rng, scene);
+    } else if (kind == SceneKind::Molecule || kind == SceneKind::MoleculeGrid) {
+        // Molecules need at least one bond
+        is_written = write_molecule(std::max(size, 2u), kind == SceneKind::MoleculeGrid,
+                                    directory, scene);
+    } else if (kind == SceneKind::Planes) {
+        is_written = write_planes(std::max(size, 1u), directory, &rng, scene);
+    } else {
+        write_cubes(size, &rng, scene);
+    }
+
+    if (!is_written) {
+        return std::string();
+    }
+
+    std::ofstream out(toml_filename.c_str());
+    out << scene.str();
+    if (!out.good()) {
+        LOG(ERROR) << "Cannot write scene file " << toml_filename;
+        return std::string();
+    }
+    return toml_filename;
+}
+
+
+}  //namespace mrtp
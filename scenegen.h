@@ -0,0 +1,29 @@
+#ifndef _SCENEGEN_H
+#define _SCENEGEN_H
+
+#include <string>
+
+
+namespace mrtp {
+
+enum class SceneKind {
+    Spheres,
+    Molecule,
+    Planes,
+    Cubes,
+    MoleculeGrid    // Same molecule, traced through a uniform grid
+};
+
+
+bool parse_scene_kind(const std::string&, SceneKind*);
+
+std::string get_scene_kind_name(SceneKind);
+
+bool write_checker_texture(const std::string&, unsigned int);
+
+std::string generate_scene(SceneKind, unsigned int, unsigned int, const std::string&);
+
+
+}  //namespace mrtp
+
+#endif  //_SCENEGEN_H
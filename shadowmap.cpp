@@ -0,0 +1,245 @@
+#include <Eigen/Geometry>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include "shadowmap.h"
+
+
+namespace mrtp {
+
+// Relative error allowed for actors, covers float scenes
+const double kMapTolerance = 1e-5;
+
+// Slack of projected windows on a face, whose side is 2
+const double kWindowTolerance = 1e-9;
+
+
+static float round_down(double x) {
+    float f = static_cast<float>(x);
+    return (f > x) ? std::nextafter(f, -std::numeric_limits<float>::infinity()) : f;
+}
+
+
+static float round_up(double x) {
+    float f = static_cast<float>(x);
+    return (f < x) ? std::nextafter(f, std::numeric_limits<float>::infinity()) : f;
+}
+
+
+static unsigned int to_texel(double u, unsigned int size) {
+    double x = std::floor((u + 1) / 2 * size);
+    return static_cast<unsigned int>(std::min(std::max(x, 0.0), size - 1.0));
+}
+
+
+static double calculate_angle(const Vector3d& a, const Vector3d& b) {
+    return std::atan2(a.cross(b).norm(), a.dot(b));
+}
+
+
+/*
+Faces are numbered 2 * axis for the positive and 2 * axis + 1 for
+the negative direction along the axis, u and v follow the axis
+cyclically. Every direction falls on the face of its largest component.
+*/
+Vector3d LightOcclusionMap::calculate_direction(unsigned int face, double u, double v) const {
+    unsigned int k = face / 2;
+    Vector3d direction;
+    direction[k] = (face % 2) ? -1 : 1;
+    direction[(k + 1) % 3] = u;
+    direction[(k + 2) % 3] = v;
+    return direction;
+}
+
+
+/*
+Texels of a face the box may be seen in, as the inclusive window
+x0, y0, x1, y1. Boxes reaching behind the face cover all of it.
+*/
+bool LightOcclusionMap::project_bounds(const BoundingBox& bounds,
+                                       unsigned int face,
+                                       unsigned int* window) const {
+    unsigned int k = face / 2;
+    unsigned int ku = (k + 1) % 3;
+    unsigned int kv = (k + 2) % 3;
+    double sign = (face % 2) ? -1 : 1;
+
+    const double highest = std::numeric_limits<double>::infinity();
+    double u0 = highest, v0 = highest;
+    double u1 = -highest, v1 = -highest;
+    bool is_front = false;
+    bool is_crossing = false;
+
+    for (unsigned int c = 0; c < 8; c++) {
+        Vector3d corner{(c & 1) ? bounds.upper[0] : bounds.lower[0],
+                        (c & 2) ? bounds.upper[1] : bounds.lower[1],
+                        (c & 4) ? bounds.upper[2] : bounds.lower[2]};
+        corner -= light_;
+        double w = sign * corner[k];
+        if (w <= 0) {
+            is_crossing = true;
+            continue;
+        }
+        is_front = true;
+        u0 = std::min(u0, corner[ku] / w);
+        u1 = std::max(u1, corner[ku] / w);
+        v0 = std::min(v0, corner[kv] / w);
+        v1 = std::max(v1, corner[kv] / w);
+    }
+
+    if (!is_front) {
+        return false;
+    }
+    if (is_crossing) {
+        u0 = v0 = -1;
+        u1 = v1 = 1;
+    }
+    u0 -= kWindowTolerance;
+    v0 -= kWindowTolerance;
+    u1 += kWindowTolerance;
+    v1 += kWindowTolerance;
+    if (u0 > 1 || v0 > 1 || u1 < -1 || v1 < -1) {
+        return false;
+    }
+
+    window[0] = to_texel(u0, size_);
+    window[1] = to_texel(v0, size_);
+    window[2] = to_texel(u1, size_);
+    window[3] = to_texel(v1, size_);
+    return true;
+}
+
+
+/*
+True if every direction through the texel is within cone_angle of
+axis. Texel edges are great circles, so the cap around its center
+through the farthest corner holds the whole texel.
+*/
+bool LightOcclusionMap::is_texel_covered(unsigned int face,
+                                         unsigned int i,
+                                         unsigned int j,
+                                         const Vector3d& axis,
+                                         double cone_angle) const {
+    double step = 2.0 / size_;
+    double u0 = -1 + i * step;
+    double v0 = -1 + j * step;
+    Vector3d center = calculate_direction(face, u0 + step / 2, v0 + step / 2);
+
+    double spread = 0;
+    for (unsigned int c = 0; c < 4; c++) {
+        Vector3d corner = calculate_direction(face, u0 + (c & 1) * step, v0 + (c >> 1) * step);
+        spread = std::max(spread, calculate_angle(center, corner));
+    }
+    return calculate_angle(center, axis) + spread < cone_angle;
+}
+
+
+/*
+Every actor marks the texels its bounds project to with the distance
+of their nearest corner. Spheres additionally mark the texels they
+cover whole with the distance of their far side. Boxes are padded by
+margin, which moves shadow rays by at most that much off the line to
+the light, and spheres shrunk by it.
+*/
+void LightOcclusionMap::build(const Vector3d& light,
+                              const std::vector<ActorBase*>& actors,
+                              unsigned int size,
+                              double margin) {
+    const float farthest = std::numeric_limits<float>::infinity();
+    light_ = light;
+    size_ = size;
+    texels_.assign(6 * size * size, OcclusionTexel{farthest, farthest, farthest, nullptr});
+
+    BoundingBox bounds;
+    Vector3d center;
+    double radius;
+    for (ActorBase* actor : actors) {
+        if (!actor->has_shadow() || !actor->calculate_bounds(&bounds)) {
+            continue;
+        }
+        double scale = (bounds.lower - light_).cwiseAbs().maxCoeff() +
+                (bounds.upper - light_).cwiseAbs().maxCoeff();
+        double pad = margin + kMapTolerance * scale;
+        bounds.lower -= Vector3d::Constant(pad);
+        bounds.upper += Vector3d::Constant(pad);
+
+        Vector3d nearest = light_.cwiseMax(bounds.lower).cwiseMin(bounds.upper);
+        float lit_depth = round_down((nearest - light_).norm());
+
+        // A sphere does not shadow its own hits facing the light
+        bool is_sphere = actor->get_sphere(&center, &radius);
+        const ActorBase* lit_actor = is_sphere ? actor : nullptr;
+
+        double center_dist = is_sphere ? (center - light_).norm() : 0;
+        bool can_cover = is_sphere && radius > pad && center_dist > radius + pad;
+        Vector3d axis = Vector3d::Zero();
+        double cone_angle = 0;
+        float shadow_depth = farthest;
+        if (can_cover) {
+            axis = (center - light_) / center_dist;
+            cone_angle = std::asin((radius - pad) / center_dist);
+            shadow_depth = round_up(center_dist + radius + pad);
+        }
+
+        for (unsigned int face = 0; face < 6; face++) {
+            unsigned int window[4];
+            if (!project_bounds(bounds, face, window)) {
+                continue;
+            }
+            for (unsigned int j = window[1]; j <= window[3]; j++) {
+                for (unsigned int i = window[0]; i <= window[2]; i++) {
+                    OcclusionTexel& texel = texels_[(face * size_ + j) * size_ + i];
+                    if (lit_depth < texel.lit_depth) {
+                        texel.other_lit_depth = texel.lit_depth;
+                        texel.lit_depth = lit_depth;
+                        texel.lit_actor = lit_actor;
+                    } else {
+                        texel.other_lit_depth = std::min(texel.other_lit_depth, lit_depth);
+                    }
+                    if (can_cover && shadow_depth < texel.shadow_depth &&
+                            is_texel_covered(face, i, j, axis, cone_angle)) {
+                        texel.shadow_depth = shadow_depth;
+                    }
+                }
+            }
+        }
+    }
+}
+
+
+bool LightOcclusionMap::is_empty() const {
+    return texels_.empty();
+}
+
+
+std::size_t LightOcclusionMap::calculate_num_bytes(unsigned int size) {
+    return 6 * static_cast<std::size_t>(size) * size * sizeof(OcclusionTexel);
+}
+
+
+int LightOcclusionMap::classify(const Vector3d& direction,
+                                double distance,
+                                const ActorBase* actor) const {
+    int k;
+    double w = direction.cwiseAbs().maxCoeff(&k);
+    if (!(w > 0)) {
+        return 0;
+    }
+    unsigned int face = 2 * k + ((direction[k] < 0) ? 1 : 0);
+    unsigned int i = to_texel(direction[(k + 1) % 3] / w, size_);
+    unsigned int j = to_texel(direction[(k + 2) % 3] / w, size_);
+    const OcclusionTexel& texel = texels_[(face * size_ + j) * size_ + i];
+
+    double lit_depth = (actor && actor == texel.lit_actor) ? texel.other_lit_depth : texel.lit_depth;
+    if (distance < lit_depth) {
+        return 1;
+    }
+    if (distance > texel.shadow_depth) {
+        return -1;
+    }
+    return 0;
+}
+
+
+}  //namespace mrtp
@@ -0,0 +1,59 @@
+#ifndef _SHADOWMAP_H
+#define _SHADOWMAP_H
+
+#include <cstddef>
+#include <vector>
+#include <Eigen/Core>
+
+#include "actors.h"
+
+
+namespace mrtp {
+
+using Vector3d = Eigen::Vector3d;
+
+
+/*
+Cube map around a point light over the actors with shadows. Each texel
+keeps the distance from the light up to which no actor can block it,
+and the distance beyond which a sphere covering the whole texel does.
+Points in between still need a shadow ray. Both distances hold for
+shadow rays starting up to margin away from the point.
+*/
+class LightOcclusionMap {
+public:
+    LightOcclusionMap() = default;
+    ~LightOcclusionMap() = default;
+
+    void build(const Vector3d&, const std::vector<ActorBase*>&, unsigned int, double);
+    bool is_empty() const;
+
+    // Bytes taken by a map with the given edge
+    static std::size_t calculate_num_bytes(unsigned int);
+
+    // 1 if the light reaches the point at distance along direction from
+    // the light, -1 if an actor blocks it and 0 if a shadow ray must
+    // decide. A sphere the point is on does not count as blocking.
+    int classify(const Vector3d&, double, const ActorBase*) const;
+
+private:
+    struct OcclusionTexel {
+        float lit_depth;          // Nearest actor that may block
+        float other_lit_depth;    // Nearest actor other than lit_actor
+        float shadow_depth;
+        const ActorBase* lit_actor;   // Sphere at lit_depth, or nullptr
+    };
+
+    Vector3d light_;
+    unsigned int size_ = 0;
+    std::vector<OcclusionTexel> texels_;
+
+    bool project_bounds(const BoundingBox&, unsigned int, unsigned int*) const;
+    bool is_texel_covered(unsigned int, unsigned int, unsigned int, const Vector3d&, double) const;
+    Vector3d calculate_direction(unsigned int, double, double) const;
+};
+
+
+}  //namespace mrtp
+
+#endif  //_SHADOWMAP_H
@@ -0,0 +1,185 @@
+#include <cerrno>
+#include <fcntl.h>
+#include <sstream>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <easylogging++.h>
+
+#include "kernels.h"
+#include "stream.h"
+#include "trace.h"
+
+
+namespace mrtp {
+
+SceneStreamWriter::SceneStreamWriter(int file_descriptor, StreamFormat format) :
+    file_descriptor_(file_descriptor),
+    format_(format),
+    pipe_size_(0),
+    is_header_written_(false),
+    use_splice_(false),
+    buffer_index_(0) {
+
+#ifdef F_GETPIPE_SZ
+    struct stat file_stat;
+    if (fstat(file_descriptor_, &file_stat) == 0 && S_ISFIFO(file_stat.st_mode)) {
+        int pipe_size = fcntl(file_descriptor_, F_GETPIPE_SZ);
+        if (pipe_size > 0) {
+            pipe_size_ = static_cast<std::size_t>(pipe_size);
+            use_splice_ = true;
+        }
+    }
+#endif
+}
+
+
+SceneStreamWriter::~SceneStreamWriter() {
+    if (file_descriptor_ != STDOUT_FILENO) {
+        close(file_descriptor_);
+    }
+}
+
+
+void SceneStreamWriter::convert_rgb(SceneRendererBase* scene_renderer,
+                                    unsigned char* out) const {
+    const RendererConfig& config = scene_renderer->config_;
+    const Pixel* in = &scene_renderer->framebuffer_[0];
+
+    std::size_t num_pixels = config.buffer_width * config.buffer_height;
+    get_kernels().convert_pixels(in->data(), 3 * num_pixels, out);
+}
+
+
+/*
+Planar 4:4:4 with BT.601 limited range coefficients, which is what
+encoders assume for Y4M input without colour tags.
+*/
+void SceneStreamWriter::convert_yuv(SceneRendererBase* scene_renderer,
+                                    unsigned char* out) const {
+    const RendererConfig& config = scene_renderer->config_;
+    const Pixel* in = &scene_renderer->framebuffer_[0];
+
+    std::size_t num_pixels = config.buffer_width * config.buffer_height;
+    unsigned char* out_y = out;
+    unsigned char* out_u = out + num_pixels;
+    unsigned char* out_v = out + 2 * num_pixels;
+
+    for (std::size_t i = 0; i < num_pixels; i++, in++) {
+        Pixel bytes = 255 * in->cwiseMax(0.0).cwiseMin(1.0);
+        double r = static_cast<unsigned char>(bytes[0]);
+        double g = static_cast<unsigned char>(bytes[1]);
+        double b = static_cast<unsigned char>(bytes[2]);
+
+        out_y[i] = static_cast<unsigned char>(16.5 + 0.257 * r + 0.504 * g + 0.098 * b);
+        out_u[i] = static_cast<unsigned char>(128.5 - 0.148 * r - 0.291 * g + 0.439 * b);
+        out_v[i] = static_cast<unsigned char>(128.5 + 0.439 * r - 0.368 * g - 0.071 * b);
+    }
+}
+
+
+bool SceneStreamWriter::write_buffers(struct iovec* parts, int num_parts) {
+    while (num_parts) {
+        ssize_t num_written = writev(file_descriptor_, parts, num_parts);
+        if (num_written < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+
+        // Skip what was written, writev may stop in the middle of a part
+        std::size_t remaining = static_cast<std::size_t>(num_written);
+        while (num_parts && remaining >= parts->iov_len) {
+            remaining -= parts->iov_len;
+            parts++;
+            num_parts--;
+        }
+        if (num_parts) {
+            parts->iov_base = static_cast<char*>(parts->iov_base) + remaining;
+            parts->iov_len -= remaining;
+        }
+    }
+    return true;
+}
+
+
+bool SceneStreamWriter::splice_buffer(struct iovec* part) {
+#ifdef SPLICE_F_MORE
+    while (part->iov_len) {
+        ssize_t num_spliced = vmsplice(file_descriptor_, part, 1, 0);
+        if (num_spliced < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EINVAL || errno == ENOSYS) {
+                // Not supported here, copy this and all following frames
+                use_splice_ = false;
+                return write_buffers(part, 1);
+            }
+            return false;
+        }
+        part->iov_base = static_cast<char*>(part->iov_base) + num_spliced;
+        part->iov_len -= static_cast<std::size_t>(num_spliced);
+    }
+    return true;
+#else
+    return write_buffers(part, 1);
+#endif
+}
+
+
+bool SceneStreamWriter::write_frame(SceneRendererBase* scene_renderer) {
+    TraceSpan span("write_frame");
+    const RendererConfig& config = scene_renderer->config_;
+
+    std::vector<unsigned char>& frame_buffer = frame_buffers_[buffer_index_];
+    buffer_index_ ^= 1;
+
+    std::size_t frame_size = 3 * config.buffer_width * config.buffer_height;
+    frame_buffer.resize(frame_size);
+
+    std::stringstream header;
+    if (format_ == StreamFormat::Y4M) {
+        if (!is_header_written_) {
+            header << "YUV4MPEG2 W" << config.buffer_width << " H" << config.buffer_height
+                   << " F25:1 Ip A1:1 C444\n";
+        }
+        header << "FRAME\n";
+        convert_yuv(scene_renderer, &frame_buffer[0]);
+    } else {
+        convert_rgb(scene_renderer, &frame_buffer[0]);
+    }
+    is_header_written_ = true;
+
+    std::string header_str = header.str();
+    struct iovec parts[2] = {
+        {const_cast<char*>(header_str.data()), header_str.size()},
+        {&frame_buffer[0], frame_size}
+    };
+
+    // A frame filling the whole pipe pushes the frame before it out of the
+    // pipe, only then its buffer can be reused without copying
+    if (use_splice_ && frame_size >= pipe_size_) {
+        return write_buffers(&parts[0], 1) && splice_buffer(&parts[1]);
+    }
+
+    if (header_str.empty()) {
+        return write_buffers(&parts[1], 1);
+    }
+    return write_buffers(parts, 2);
+}
+
+
+std::shared_ptr<SceneStreamWriter> open_stream(const std::string& stream_filename,
+                                               StreamFormat format) {
+    int fd = STDOUT_FILENO;
+    if (stream_filename != "-") {
+        fd = open(stream_filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            LOG(ERROR) << "Cannot open output stream " << stream_filename;
+            return std::shared_ptr<SceneStreamWriter>();
+        }
+    }
+    return std::shared_ptr<SceneStreamWriter>(new SceneStreamWriter(fd, format));
+}
+
+
+}  //namespace mrtp
@@ -0,0 +1,59 @@
+#ifndef _STREAM_H
+#define _STREAM_H
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <sys/uio.h>
+
+#include "renderer.h"
+
+
+namespace mrtp {
+
+enum class StreamFormat {
+    RGB24,
+    Y4M
+};
+
+
+/*
+Writes uncompressed frames to a file descriptor, typically stdout or a
+FIFO read by a video encoder. Frames at least as large as the pipe
+buffer are spliced into the pipe without copying.
+*/
+class SceneStreamWriter {
+public:
+    SceneStreamWriter(int, StreamFormat);
+    SceneStreamWriter() = delete;
+    SceneStreamWriter(const SceneStreamWriter&) = delete;
+    SceneStreamWriter& operator=(const SceneStreamWriter&) = delete;
+    ~SceneStreamWriter();
+
+    bool write_frame(SceneRendererBase*);
+
+private:
+    int file_descriptor_;
+    StreamFormat format_;
+    std::size_t pipe_size_;
+    bool is_header_written_;
+    bool use_splice_;
+
+    // Spliced pages stay referenced by the pipe until they are read,
+    // so consecutive frames alternate between two buffers
+    std::vector<unsigned char> frame_buffers_[2];
+    unsigned int buffer_index_;
+
+    void convert_rgb(SceneRendererBase*, unsigned char*) const;
+    void convert_yuv(SceneRendererBase*, unsigned char*) const;
+    bool write_buffers(struct iovec*, int);
+    bool splice_buffer(struct iovec*);
+};
+
+
+std::shared_ptr<SceneStreamWriter> open_stream(const std::string&, StreamFormat);
+
+
+}  //namespace mrtp
+
+#endif  //_STREAM_H
@@ -38,7 +38,8 @@ Vector3d TexturePixel::to_vec() const {
 }
 
 
-TextureSharedState::TextureSharedState(const std::string& texture_filename) {
+TextureSharedState::TextureSharedState(const std::string& texture_filename) :
+    texture_filename_(texture_filename) {
     png::image<png::rgb_pixel> image(texture_filename.c_str());
 
     texture_width_ = image.get_width();
@@ -94,23 +95,25 @@ MyPixel MyTexture::pick_pixel(double frac_x, double frac_y) const {
 }
 
 
+TextureFactory::TextureFactory() :
+    arena_(create_arena()) {
+
+}
+
+
 MyTexture* TextureFactory::create_texture(const std::string& texture_filename,
                                           double reflection_coeff,
                                           double scale_coeff) {
-    for (auto& shared_state : shared_states_) {
-        if (shared_state.is_same_texture(texture_filename)) {
-            MyTexture new_texture(&shared_state, reflection_coeff, scale_coeff);
-            textures_.push_back(new_texture);
-            return &textures_.back();
+    for (auto shared_state : shared_states_) {
+        if (shared_state->is_same_texture(texture_filename)) {
+            return arena_->construct<MyTexture>(shared_state, reflection_coeff, scale_coeff);
         }
     }
 
-    TextureSharedState new_shared_state(texture_filename);
-    shared_states_.push_back(new_shared_state);
+    auto shared_state = arena_->construct<TextureSharedState>(texture_filename);
+    shared_states_.push_back(shared_state);
 
-    MyTexture new_texture(&shared_states_.back(), reflection_coeff, scale_coeff);
-    textures_.push_back(new_texture);
-    return &textures_.back();
+    return arena_->construct<MyTexture>(shared_state, reflection_coeff, scale_coeff);
 }
 
 
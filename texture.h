@@ -2,10 +2,12 @@
 #define _TEXTURE_H
 
 #include <Eigen/Core>
-#include <list>
+#include <memory>
 #include <vector>
 #include <string>
 
+#include "arena.h"
+
 
 namespace mrtp {
 
@@ -64,16 +66,20 @@ private:
 };
 
 
+/*
+Textures live in the arena of the factory, each image file is
+loaded once and shared by all textures using it.
+*/
 class TextureFactory {
 public:
-    TextureFactory() = default;
+    TextureFactory();
     ~TextureFactory() = default;
 
     MyTexture* create_texture(const std::string&, double, double);
 
 private:
-    std::list<TextureSharedState> shared_states_;
-    std::list<MyTexture> textures_;
+    std::shared_ptr<SceneArena> arena_;
+    std::vector<TextureSharedState*> shared_states_;
 };
 
 
@@ -0,0 +1,194 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <easylogging++.h>
+
+#include "trace.h"
+
+
+namespace mrtp {
+
+std::atomic<bool> trace_enabled(false);
+
+
+struct TraceEvent {
+    const char* name;
+    std::uint64_t start_ns;
+    std::uint64_t duration_ns;
+    long arg;
+};
+
+
+/*
+Written only by its own thread, while is_recording is set. Once
+tracing is off and is_recording is clear, the thread records nothing
+until tracing starts again, so the writer of the trace file reads
+the events without a lock.
+*/
+struct TraceBuffer {
+    long thread_id;
+    std::vector<TraceEvent> events;
+    std::atomic<std::uint64_t> num_events;
+    std::atomic<bool> is_recording;
+    std::uint64_t num_written;      // Events in earlier trace files, under trace_mutex
+};
+
+
+static std::mutex trace_mutex;
+static std::vector<std::unique_ptr<TraceBuffer>> trace_buffers;
+static std::size_t trace_capacity = 0;
+static std::string trace_filename;
+static bool is_exit_registered = false;
+
+static thread_local TraceBuffer* local_buffer = nullptr;
+
+
+std::uint64_t trace_clock_ns() {
+    static const auto clock_start = std::chrono::steady_clock::now();
+    std::chrono::nanoseconds time_used = std::chrono::steady_clock::now() - clock_start;
+    // Zero marks spans started while tracing was off
+    return time_used.count() + 1;
+}
+
+
+static TraceBuffer* register_buffer() {
+    std::lock_guard<std::mutex> lock(trace_mutex);
+
+    std::unique_ptr<TraceBuffer> buffer(new TraceBuffer);
+    buffer->thread_id = syscall(SYS_gettid);
+    buffer->events.resize(trace_capacity);
+    buffer->num_events.store(0, std::memory_order_relaxed);
+    buffer->is_recording.store(false, std::memory_order_relaxed);
+    buffer->num_written = 0;
+
+    trace_buffers.push_back(std::move(buffer));
+    return trace_buffers.back().get();
+}
+
+
+void record_trace_span(const char* name, std::uint64_t start_ns, long arg) {
+    if (!local_buffer) {
+        local_buffer = register_buffer();
+    }
+
+    // Sequentially consistent with the flag turned off by finish_tracing,
+    // so either this span sees tracing off or finish_tracing waits for it
+    local_buffer->is_recording.store(true);
+    if (trace_enabled.load()) {
+        // When the ring is full the oldest spans are overwritten
+        std::uint64_t index = local_buffer->num_events.load(std::memory_order_relaxed);
+        local_buffer->events[index % trace_capacity] =
+                TraceEvent{name, start_ns, trace_clock_ns() - start_ns, arg};
+        local_buffer->num_events.store(index + 1, std::memory_order_release);
+    }
+    local_buffer->is_recording.store(false, std::memory_order_release);
+}
+
+
+static void finish_tracing_at_exit() {
+    finish_tracing();
+}
+
+
+/*
+Spans are kept from now on and written to filename by finish_tracing,
+which also runs when the program exits.
+*/
+bool start_tracing(const std::string& filename, std::size_t capacity) {
+    std::lock_guard<std::mutex> lock(trace_mutex);
+
+    if (trace_enabled.load() || capacity == 0) {
+        return false;
+    }
+    if (trace_capacity != capacity) {
+        // Buffers of threads seen before are sized for the old capacity
+        if (!trace_buffers.empty()) {
+            LOG(ERROR) << "Trace capacity cannot change";
+            return false;
+        }
+        trace_capacity = capacity;
+    }
+    trace_filename = filename;
+    trace_clock_ns();
+
+    if (!is_exit_registered) {
+        std::atexit(finish_tracing_at_exit);
+        is_exit_registered = true;
+    }
+    trace_enabled.store(true);
+    return true;
+}
+
+
+static void write_trace_event(std::ostream& out,
+                              const TraceEvent& event,
+                              long thread_id,
+                              bool* is_first) {
+    out << (*is_first ? "\n" : ",\n")
+        << "{\"name\":\"" << event.name << "\",\"cat\":\"mrtp\",\"ph\":\"X\""
+        << ",\"pid\":" << getpid() << ",\"tid\":" << thread_id
+        << ",\"ts\":" << event.start_ns / 1e3
+        << ",\"dur\":" << event.duration_ns / 1e3;
+    if (event.arg >= 0) {
+        out << ",\"args\":{\"index\":" << event.arg << "}";
+    }
+    out << "}";
+    *is_first = false;
+}
+
+
+/*
+Stops tracing, waits for spans being recorded and writes all spans
+kept in the ring buffers since the last trace file. Spans still open
+in other threads are lost, so call it after rendering.
+*/
+bool finish_tracing() {
+    std::lock_guard<std::mutex> lock(trace_mutex);
+
+    if (!trace_enabled.exchange(false)) {
+        return false;
+    }
+
+    std::ofstream out(trace_filename.c_str());
+    out << std::fixed << std::setprecision(3) << "{\"traceEvents\":[";
+
+    bool is_first = true;
+    for (const auto& buffer : trace_buffers) {
+        while (buffer->is_recording.load(std::memory_order_acquire)) {
+            std::this_thread::yield();
+        }
+        std::uint64_t num_events = buffer->num_events.load(std::memory_order_acquire);
+        std::uint64_t first = (num_events > trace_capacity) ? num_events - trace_capacity : 0;
+        first = std::max(first, buffer->num_written);
+
+        const char* thread_name = (buffer->thread_id == getpid()) ? "main" : "worker";
+        out << (is_first ? "\n" : ",\n")
+            << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" << getpid()
+            << ",\"tid\":" << buffer->thread_id
+            << ",\"args\":{\"name\":\"" << thread_name << " " << buffer->thread_id << "\"}}";
+        is_first = false;
+
+        for (std::uint64_t i = first; i < num_events; i++) {
+            write_trace_event(out, buffer->events[i % trace_capacity], buffer->thread_id, &is_first);
+        }
+        buffer->num_written = num_events;
+    }
+    out << "\n],\"displayTimeUnit\":\"ms\"}\n";
+
+    if (!out.good()) {
+        LOG(ERROR) << "Cannot write trace file " << trace_filename;
+        return false;
+    }
+    return true;
+}
+
+
+}  //namespace mrtp
@@ -0,0 +1,66 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+
+namespace mrtp {
+
+/*
+Timeline of spans per thread, written as Chrome trace-event JSON that
+can be opened in Perfetto or chrome://tracing. Every thread records
+into its own ring buffer, so recording takes no locks. While tracing
+is off a span costs one relaxed load. Building with -DMRTP_NO_TRACING
+removes the spans altogether.
+*/
+extern std::atomic<bool> trace_enabled;
+
+std::uint64_t trace_clock_ns();
+
+void record_trace_span(const char*, std::uint64_t, long);
+
+bool start_tracing(const std::string&, std::size_t = 1 << 16);
+
+bool finish_tracing();
+
+
+class TraceSpan {
+public:
+#ifndef MRTP_NO_TRACING
+    TraceSpan(const char* name, long arg = -1) :
+        name_(name),
+        arg_(arg),
+        start_ns_(0) {
+        if (trace_enabled.load(std::memory_order_relaxed)) {
+            start_ns_ = trace_clock_ns();
+        }
+    }
+
+    ~TraceSpan() {
+        if (start_ns_) {
+            record_trace_span(name_, start_ns_, arg_);
+        }
+    }
+#else
+    TraceSpan(const char*, long = -1) {}
+    ~TraceSpan() = default;
+#endif  // MRTP_NO_TRACING
+
+    TraceSpan() = delete;
+    TraceSpan(const TraceSpan&) = delete;
+    TraceSpan& operator=(const TraceSpan&) = delete;
+
+#ifndef MRTP_NO_TRACING
+private:
+    const char* name_;
+    long arg_;
+    std::uint64_t start_ns_;
+#endif  // MRTP_NO_TRACING
+};
+
+
+}  //namespace mrtp
+
+#endif  //_TRACE_H
@@ -0,0 +1,234 @@
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <easylogging++.h>
+
+#include "babel.h"
+#include "trajectory.h"
+
+
+namespace mrtp {
+
+static std::uint32_t swap_bytes(std::uint32_t value) {
+    return ((value & 0xff) << 24) | ((value & 0xff00) << 8) |
+            ((value >> 8) & 0xff00) | (value >> 24);
+}
+
+
+/*
+Binary DCD trajectories as written by CHARMM, NAMD and most MD engines.
+Every block is a Fortran record framed by its length in bytes. Files
+with fixed atoms or a fourth dimension are not supported.
+*/
+class DCDTrajectoryReader : public TrajectoryReader {
+public:
+    DCDTrajectoryReader(const std::string& dcd_filename) :
+        dcd_file_(dcd_filename.c_str(), std::ios::binary),
+        file_size_(0),
+        is_valid_(false),
+        is_swapped_(false),
+        has_unit_cell_(false),
+        num_atoms_(0) {
+
+        dcd_file_.seekg(0, std::ios::end);
+        file_size_ = static_cast<std::streamoff>(dcd_file_.tellg());
+        dcd_file_.seekg(0);
+
+        std::uint32_t marker = 0;
+        if (!dcd_file_.read(reinterpret_cast<char*>(&marker), sizeof(marker))) {
+            return;
+        }
+        if (marker != 84) {
+            if (swap_bytes(marker) != 84) {
+                return;
+            }
+            is_swapped_ = true;
+        }
+        dcd_file_.seekg(0);
+
+        std::vector<char> record;
+        if (!read_record(&record, 84) || std::strncmp(&record[0], "CORD", 4) != 0) {
+            return;
+        }
+        std::int32_t control[20];
+        for (unsigned int i = 0; i < 20; i++) {
+            control[i] = read_int(&record[4 + 4 * i]);
+        }
+        bool is_charmm = control[19] != 0;
+        if (control[8] != 0 || (is_charmm && control[11] != 0)) {
+            LOG(ERROR) << "DCD files with fixed atoms or 4D coordinates are not supported";
+            return;
+        }
+        has_unit_cell_ = is_charmm && control[10] != 0;
+
+        // Title, a count of 80 character lines and the lines
+        std::uint32_t title_size;
+        if (!peek_marker(&title_size) || title_size < 4 || (title_size - 4) % 80 != 0 ||
+                !read_record(&record, title_size) ||
+                read_int(&record[0]) != (title_size - 4) / 80) {
+            return;
+        }
+
+        if (!read_record(&record, 4)) {
+            return;
+        }
+        std::int32_t num_atoms = read_int(&record[0]);
+
+        // Coordinate records must fit their size into a marker
+        is_valid_ = num_atoms > 0 && num_atoms <= 0x3fffffff;
+        if (is_valid_) {
+            num_atoms_ = num_atoms;
+        }
+    }
+
+    ~DCDTrajectoryReader() override = default;
+
+    bool is_valid() const {
+        return is_valid_;
+    }
+
+    bool read_frame(std::vector<Eigen::Vector3d>* positions) override {
+        std::vector<char> record;
+        if (has_unit_cell_ && !read_record(&record, 48)) {
+            return false;
+        }
+
+        for (unsigned int axis = 0; axis < 3; axis++) {
+            if (!read_record(&record, 4 * num_atoms_)) {
+                return false;
+            }
+            // Allocated once the file has shown to hold a frame of that size
+            if (axis == 0) {
+                positions->assign(num_atoms_, Eigen::Vector3d{0, 0, 0});
+            }
+            for (unsigned int i = 0; i < num_atoms_; i++) {
+                std::uint32_t bits = read_int(&record[4 * i]);
+                float coordinate;
+                std::memcpy(&coordinate, &bits, sizeof(coordinate));
+                (*positions)[i][axis] = coordinate;
+            }
+        }
+        return true;
+    }
+
+private:
+    std::ifstream dcd_file_;
+    std::streamoff file_size_;
+    bool is_valid_;
+    bool is_swapped_;
+    bool has_unit_cell_;
+    unsigned int num_atoms_;
+
+    std::uint32_t read_int(const char* bytes) const {
+        std::uint32_t value;
+        std::memcpy(&value, bytes, sizeof(value));
+        return (is_swapped_) ? swap_bytes(value) : value;
+    }
+
+    bool peek_marker(std::uint32_t* size) {
+        char marker[4];
+        if (!dcd_file_.read(marker, sizeof(marker))) {
+            return false;
+        }
+        dcd_file_.seekg(-4, std::ios::cur);
+        *size = read_int(marker);
+        return true;
+    }
+
+    /*
+    Reads a record of the given size. Both markers must hold that size,
+    and the record must fit into the rest of the file before any memory
+    is taken for it.
+    */
+    bool read_record(std::vector<char>* record, std::uint32_t size) {
+        char marker[4];
+        if (!dcd_file_.read(marker, sizeof(marker)) || read_int(marker) != size) {
+            return false;
+        }
+        std::streamoff end = static_cast<std::streamoff>(dcd_file_.tellg()) + size + 4;
+        if (end > file_size_) {
+            return false;
+        }
+
+        record->resize(size);
+        if (size && !dcd_file_.read(&(*record)[0], size)) {
+            return false;
+        }
+        if (!dcd_file_.read(marker, sizeof(marker))) {
+            return false;
+        }
+        return read_int(marker) == size;
+    }
+};
+
+
+MoleculeTrajectory::MoleculeTrajectory(std::shared_ptr<TrajectoryReader> reader,
+                                       std::shared_ptr<MoleculeActors> molecule) :
+    reader_(reader),
+    molecule_(molecule) {
+
+    start_read();
+}
+
+
+MoleculeTrajectory::~MoleculeTrajectory() {
+    if (pending_read_.valid()) {
+        pending_read_.wait();
+    }
+}
+
+
+void MoleculeTrajectory::start_read() {
+    pending_read_ = std::async(std::launch::async, [this]() {
+        return reader_->read_frame(&back_positions_);
+    });
+}
+
+
+bool MoleculeTrajectory::load_next_frame() {
+    if (!pending_read_.valid() || !pending_read_.get()) {
+        return false;
+    }
+
+    if (back_positions_.size() != molecule_->get_num_atoms()) {
+        LOG(ERROR) << "Trajectory frame does not match molecule " << molecule_->get_name();
+        return false;
+    }
+
+    // The background thread fills one buffer while the other one is in use
+    std::swap(front_positions_, back_positions_);
+    start_read();
+
+    molecule_->set_positions(front_positions_);
+    return true;
+}
+
+
+std::shared_ptr<TrajectoryReader> open_trajectory(const std::string& trajectory_filename) {
+    std::fstream check(trajectory_filename.c_str());
+    if (!check.good()) {
+        LOG(ERROR) << "Cannot open trajectory file " << trajectory_filename;
+        return std::shared_ptr<TrajectoryReader>();
+    }
+
+    size_t pos = trajectory_filename.rfind(".dcd");
+    if (pos != std::string::npos && pos + 4 == trajectory_filename.size()) {
+        auto dcd_reader = std::shared_ptr<DCDTrajectoryReader>(
+                    new DCDTrajectoryReader(trajectory_filename));
+        if (!dcd_reader->is_valid()) {
+            LOG(ERROR) << "Error parsing DCD file " << trajectory_filename;
+            return std::shared_ptr<TrajectoryReader>();
+        }
+        return dcd_reader;
+    }
+
+    // Multi-model PDB, multi-frame XYZ and other formats known to Open Babel
+    auto babel_reader = create_babel_trajectory(trajectory_filename);
+    if (!babel_reader) {
+        LOG(ERROR) << "Unknown format of trajectory file " << trajectory_filename;
+    }
+    return babel_reader;
+}
+
+
+}  //namespace mrtp
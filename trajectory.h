@@ -0,0 +1,55 @@
+#ifndef _TRAJECTORY_H
+#define _TRAJECTORY_H
+
+#include <future>
+#include <memory>
+#include <string>
+#include <vector>
+#include <Eigen/Core>
+
+#include "actors.h"
+
+
+namespace mrtp {
+
+class TrajectoryReader {
+public:
+    TrajectoryReader() = default;
+    virtual ~TrajectoryReader() = default;
+
+    // Returns false at the end of the trajectory
+    virtual bool read_frame(std::vector<Eigen::Vector3d>*) = 0;
+};
+
+
+/*
+Streams coordinates of a trajectory into the atoms and bonds of a molecule.
+The next frame is read on a background thread while the current one is
+being rendered.
+*/
+class MoleculeTrajectory {
+public:
+    MoleculeTrajectory(std::shared_ptr<TrajectoryReader>, std::shared_ptr<MoleculeActors>);
+    MoleculeTrajectory() = delete;
+    ~MoleculeTrajectory();
+
+    bool load_next_frame();
+
+private:
+    std::shared_ptr<TrajectoryReader> reader_;
+    std::shared_ptr<MoleculeActors> molecule_;
+
+    std::vector<Eigen::Vector3d> front_positions_;
+    std::vector<Eigen::Vector3d> back_positions_;
+    std::future<bool> pending_read_;
+
+    void start_read();
+};
+
+
+std::shared_ptr<TrajectoryReader> open_trajectory(const std::string&);
+
+
+}  //namespace mrtp
+
+#endif  //_TRAJECTORY_H
@@ -1,9 +1,14 @@
 #include <fstream>
 #include <iostream>
+#include <sstream>
 #include <Eigen/Geometry>
+#include <sys/stat.h>
 #include <easylogging++.h>
 
+#include "animation.h"
 #include "cpptoml.h"
+#include "trace.h"
+#include "trajectory.h"
 #include "world.h"
 
 
@@ -13,7 +18,7 @@ using Vector3d = Eigen::Vector3d;
 
 
 void SceneWorld::add_light(std::shared_ptr<Light> light_ptr) {
-    light_ = light_ptr;
+    light_ptrs_.push_back(light_ptr);
 }
 
 
@@ -27,8 +32,153 @@ void SceneWorld::add_actor(std::shared_ptr<ActorBase> actor_ptr) {
 }
 
 
-Light* SceneWorld::get_light_ptr() {
-    return light_.get();  // FIXME
+void SceneWorld::add_molecule(std::shared_ptr<MoleculeActors> molecule_ptr) {
+    molecule_ptrs_.push_back(molecule_ptr);
+}
+
+
+void SceneWorld::add_animation(std::shared_ptr<SceneAnimation> animation_ptr) {
+    animation_ = animation_ptr;
+}
+
+
+/*
+The world keeps the arena of its actors, it is released together
+with the last of them.
+*/
+void SceneWorld::set_arena(std::shared_ptr<SceneArena> arena_ptr) {
+    arena_ = arena_ptr;
+}
+
+
+void SceneWorld::add_trajectory(std::shared_ptr<MoleculeTrajectory> trajectory_ptr) {
+    trajectory_ptrs_.push_back(trajectory_ptr);
+}
+
+
+/*
+Files read while building the world, such as textures, molecules
+and trajectories.
+*/
+void SceneWorld::add_source_file(const std::string& filename) {
+    source_files_.push_back(filename);
+}
+
+
+/*
+Name, size and modification time of every source file, one per line,
+so that caches of the world notice when any of them is edited.
+*/
+std::string SceneWorld::describe_sources() const {
+    std::ostringstream description;
+    for (const auto& filename : source_files_) {
+        struct stat file_stat;
+        description << filename;
+        if (stat(filename.c_str(), &file_stat) == 0) {
+            description << ' ' << file_stat.st_size
+                        << ' ' << file_stat.st_mtim.tv_sec
+                        << ' ' << file_stat.st_mtim.tv_nsec;
+        }
+        description << '\n';
+    }
+    return description.str();
+}
+
+
+void SceneWorld::build_acceleration() {
+    TraceSpan span("build_acceleration");
+
+    std::vector<ActorBase*> actors;
+    for (const auto& actor_ptr : actor_ptrs_) {
+        actors.push_back(actor_ptr.get());
+    }
+    geometry_version_++;
+
+    // Molecule grids intersect their spheres in the precision of the tree
+    for (auto& molecule_ptr : molecule_ptrs_) {
+        molecule_ptr->set_precision(precision_);
+    }
+
+    // Only the tree of the current precision is kept
+    bvh_.reset();
+    float_bvh_.reset();
+    if (precision_ == Precision::Float) {
+        float_bvh_ = std::shared_ptr<ActorBVH<float>>(new ActorBVH<float>(actors));
+    } else {
+        bvh_ = std::shared_ptr<ActorBVH<double>>(new ActorBVH<double>(actors));
+    }
+}
+
+
+void SceneWorld::refit_acceleration() {
+    TraceSpan span("refit_acceleration");
+    geometry_version_++;
+    bool is_refit = (float_bvh_) ? float_bvh_->refit() : bvh_->refit();
+    if (!is_refit) {
+        // Actors without bounds move to the list tested by every ray
+        build_acceleration();
+    }
+}
+
+
+/*
+Float traversal halves the size of boxes and spheres and doubles the
+width of the sphere kernel. Hits may move by the rounding error of
+float, which is fine for most scenes. Rebuilds the tree if one was
+built in the other precision.
+*/
+void SceneWorld::set_precision(Precision precision) {
+    if (precision != precision_) {
+        precision_ = precision;
+        if (bvh_ || float_bvh_) {
+            build_acceleration();
+        }
+    }
+}
+
+
+Precision SceneWorld::get_precision() const {
+    return precision_;
+}
+
+
+/*
+Changes whenever actors are built or moved.
+*/
+unsigned int SceneWorld::get_geometry_version() const {
+    return geometry_version_;
+}
+
+
+/*
+Moves all molecules with a trajectory to their next frame.
+Returns false once any of the trajectories has ended.
+*/
+bool SceneWorld::load_trajectory_frame() {
+    TraceSpan span("load_trajectory_frame");
+
+    for (auto& trajectory_ptr : trajectory_ptrs_) {
+        if (!trajectory_ptr->load_next_frame()) {
+            return false;
+        }
+    }
+    refit_acceleration();
+    return true;
+}
+
+
+bool SceneWorld::has_trajectories() const {
+    return !trajectory_ptrs_.empty();
+}
+
+
+Light* SceneWorld::get_light_ptr(unsigned int index) {
+    return light_ptrs_[index].get();
+}
+
+
+unsigned int SceneWorld::get_num_lights() const {
+    return light_ptrs_.size();
 }
 
 
@@ -37,6 +187,44 @@ Camera* SceneWorld::get_camera_ptr() {
 }
 
 
+SceneArena* SceneWorld::get_arena_ptr() {
+    return arena_.get();
+}
+
+
+SceneAnimation* SceneWorld::get_animation_ptr() {
+    return animation_.get();
+}
+
+
+template <>
+ActorBVH<double>* SceneWorld::get_bvh_ptr<double>() {
+    return bvh_.get();
+}
+
+
+template <>
+ActorBVH<float>* SceneWorld::get_bvh_ptr<float>() {
+    return float_bvh_.get();
+}
+
+
+/*
+Unnamed molecules are never found, they all share the empty name.
+*/
+MoleculeActors* SceneWorld::find_molecule(const std::string& name) {
+    if (name.empty()) {
+        return nullptr;
+    }
+    for (auto& molecule_ptr : molecule_ptrs_) {
+        if (molecule_ptr->get_name() == name) {
+            return molecule_ptr.get();
+        }
+    }
+    return nullptr;
+}
+
+
 ActorIterator SceneWorld::get_actor_iterator() {
     return ActorIterator(&actor_ptrs_);
 }
@@ -70,10 +258,9 @@ std::vector<std::shared_ptr<ActorBase>>::iterator ActorIterator::current() {
 
 class WorldBuilder {
 public:
-    WorldBuilder(const std::string& world_filename,
-                 TextureFactory* texture_factory) :
-        world_filename_(world_filename),
-        texture_factory_(texture_factory) {
+    WorldBuilder(TextureFactory* texture_factory, Precision precision) :
+        texture_factory_(texture_factory),
+        precision_(precision) {
 
     }
 
@@ -82,16 +269,88 @@ public:
 
     void process_actor_array(ActorType actor_type,
                              std::shared_ptr<cpptoml::table_array> actor_array,
-                             std::vector<std::shared_ptr<ActorBase>>* actor_ptrs) const {
+                             SceneArena* arena,
+                             std::vector<std::shared_ptr<ActorBase>>* actor_ptrs,
+                             std::vector<std::shared_ptr<MoleculeActors>>* molecule_ptrs) const {
         if (actor_array) {
             for (const auto& actor_items : *actor_array) {
-                create_actors(actor_type, texture_factory_, actor_items, actor_ptrs);
+                create_actors(actor_type, texture_factory_, arena, actor_items,
+                              actor_ptrs, molecule_ptrs);
             }
         }
     }
 
-    std::shared_ptr<SceneWorld> build() const {
-        std::fstream check(world_filename_.c_str());
+    bool process_molecule_array(std::shared_ptr<cpptoml::table_array> molecule_array,
+                                SceneArena* arena,
+                                std::vector<std::shared_ptr<ActorBase>>* actor_ptrs,
+                                std::vector<std::shared_ptr<MoleculeActors>>* molecule_ptrs,
+                                std::vector<std::shared_ptr<MoleculeTrajectory>>* trajectory_ptrs) const {
+        if (!molecule_array) {
+            return true;
+        }
+        TraceSpan span("create_molecules");
+
+        for (const auto& molecule_items : *molecule_array) {
+            unsigned int num_molecules = molecule_ptrs->size();
+            create_actors(ActorType::Molecule, texture_factory_, arena, molecule_items,
+                          actor_ptrs, molecule_ptrs);
+
+            auto trajectory_file = molecule_items->get_as<std::string>("trajectory");
+            if (!trajectory_file || molecule_ptrs->size() == num_molecules) {
+                continue;
+            }
+            auto reader_ptr = open_trajectory(*trajectory_file);
+            if (!reader_ptr) {
+                return false;
+            }
+            trajectory_ptrs->push_back(std::shared_ptr<MoleculeTrajectory>(
+                                           new MoleculeTrajectory(reader_ptr, molecule_ptrs->back())));
+        }
+        return true;
+    }
+
+    void add_source_files(std::shared_ptr<cpptoml::table> world_config,
+                          SceneWorld* world_ptr) const {
+        const char* array_names[] = {"planes", "spheres", "cylinders", "triangles", "cubes", "molecules"};
+        const char* file_keys[] = {"texture", "mol2file", "trajectory"};
+
+        for (const char* array_name : array_names) {
+            auto actor_array = world_config->get_table_array(array_name);
+            if (!actor_array) {
+                continue;
+            }
+            for (const auto& actor_items : *actor_array) {
+                for (const char* file_key : file_keys) {
+                    auto filename = actor_items->get_as<std::string>(file_key);
+                    if (filename) {
+                        world_ptr->add_source_file(*filename);
+                    }
+                }
+            }
+        }
+    }
+
+    bool process_light(std::shared_ptr<cpptoml::table> light_items,
+                       SceneWorld* world_ptr) const {
+        auto raw_center = light_items->get_array_of<double>("center");
+        if (!raw_center) {
+            LOG(ERROR) << "Error parsing light center";
+            return false;
+        }
+        double intensity = light_items->get_as<double>("intensity").value_or(1);
+        if (intensity < 0) {
+            LOG(ERROR) << "Light intensity is out of range";
+            return false;
+        }
+
+        Vector3d temp_center(raw_center->data());
+        Vector3d light_center = temp_center.cast<double>();
+        world_ptr->add_light(std::shared_ptr<Light>(new Light(light_center, intensity)));
+        return true;
+    }
+
+    std::shared_ptr<SceneWorld> build_from_file(const std::string& world_filename) const {
+        std::fstream check(world_filename.c_str());
         if (!check.good()) {
             LOG(ERROR) << "Cannot open world file";
             return std::shared_ptr<SceneWorld>();
@@ -99,31 +358,67 @@ public:
 
         std::shared_ptr<cpptoml::table> world_config;
         try {
-            world_config = cpptoml::parse_file(world_filename_.c_str());
+            TraceSpan span("parse_world");
+            world_config = cpptoml::parse_file(world_filename.c_str());
         } catch (...) {
             LOG(ERROR) << "Error parsing world file";
             return std::shared_ptr<SceneWorld>();
         }
+        return build(world_config);
+    }
+
+    std::shared_ptr<SceneWorld> build_from_string(const std::string& world_description) const {
+        std::shared_ptr<cpptoml::table> world_config;
+        try {
+            TraceSpan span("parse_world");
+            std::istringstream world_stream(world_description);
+            cpptoml::parser world_parser(world_stream);
+            world_config = world_parser.parse();
+        } catch (...) {
+            LOG(ERROR) << "Error parsing world description";
+            return std::shared_ptr<SceneWorld>();
+        }
+        return build(world_config);
+    }
+
+    std::shared_ptr<SceneWorld> build(std::shared_ptr<cpptoml::table> world_config) const {
 
+        // Actors, molecules and mappers of the world share one arena
+        auto arena = create_arena();
         std::vector<std::shared_ptr<ActorBase>> new_actors;
+        std::vector<std::shared_ptr<MoleculeActors>> new_molecules;
 
-        auto planes_array = world_config->get_table_array("planes");
-        process_actor_array(ActorType::Plane, planes_array, &new_actors);
+        {
+            TraceSpan span("create_actors");
 
-        auto spheres_array = world_config->get_table_array("spheres");
-        process_actor_array(ActorType::Sphere, spheres_array, &new_actors);
+            auto planes_array = world_config->get_table_array("planes");
+            process_actor_array(ActorType::Plane, planes_array, arena.get(),
+                                &new_actors, &new_molecules);
 
-        auto cylinders_array = world_config->get_table_array("cylinders");
-        process_actor_array(ActorType::Cylinder, cylinders_array, &new_actors);
+            auto spheres_array = world_config->get_table_array("spheres");
+            process_actor_array(ActorType::Sphere, spheres_array, arena.get(),
+                                &new_actors, &new_molecules);
 
-        auto triangles_array = world_config->get_table_array("triangles");
-        process_actor_array(ActorType::Triangle, triangles_array, &new_actors);
+            auto cylinders_array = world_config->get_table_array("cylinders");
+            process_actor_array(ActorType::Cylinder, cylinders_array, arena.get(),
+                                &new_actors, &new_molecules);
 
-        auto cubes_array = world_config->get_table_array("cubes");
-        process_actor_array(ActorType::Cube, cubes_array, &new_actors);
+            auto triangles_array = world_config->get_table_array("triangles");
+            process_actor_array(ActorType::Triangle, triangles_array, arena.get(),
+                                &new_actors, &new_molecules);
+
+            auto cubes_array = world_config->get_table_array("cubes");
+            process_actor_array(ActorType::Cube, cubes_array, arena.get(),
+                                &new_actors, &new_molecules);
+        }
 
+        // Molecules may come with a trajectory
+        std::vector<std::shared_ptr<MoleculeTrajectory>> new_trajectories;
         auto molecules_array = world_config->get_table_array("molecules");
-        process_actor_array(ActorType::Molecule, molecules_array, &new_actors);
+        if (!process_molecule_array(molecules_array, arena.get(), &new_actors,
+                                    &new_molecules, &new_trajectories)) {
+            return std::shared_ptr<SceneWorld>();
+        }
 
         if (new_actors.size() < 1) {
             LOG(ERROR) << "No actors found";
@@ -131,9 +426,19 @@ public:
         }
 
         auto world_ptr = std::shared_ptr<SceneWorld>(new SceneWorld());
+        world_ptr->set_arena(arena);
         for (const auto& actor : new_actors) {
             world_ptr->add_actor(actor);
         }
+        for (const auto& molecule : new_molecules) {
+            world_ptr->add_molecule(molecule);
+        }
+        for (const auto& trajectory : new_trajectories) {
+            world_ptr->add_trajectory(trajectory);
+        }
+        add_source_files(world_config, world_ptr.get());
+        world_ptr->set_precision(precision_);
+        world_ptr->build_acceleration();
 
         auto tab_camera = world_config->get_table("camera");
         if (!tab_camera) {
@@ -158,40 +463,61 @@ public:
         Vector3d temp_lookat(raw_lookat->data());
         Vector3d camera_lookat = temp_lookat.cast<double>();
 
+        world_ptr->add_camera(std::shared_ptr<Camera>(
+                                 new Camera(camera_eye, camera_lookat, camera_roll)));
+
+        // A single [light] table, [[lights]] for more, or both
         auto tab_light = world_config->get_table("light");
-        if (!tab_light) {
-            LOG(ERROR) << "No light found";
+        if (tab_light && !process_light(tab_light, world_ptr.get())) {
             return std::shared_ptr<SceneWorld>();
         }
-        auto raw_center = tab_light->get_array_of<double>("center");
-        if (!raw_center) {
-            LOG(ERROR) << "Error parsing light center";
+        auto lights_array = world_config->get_table_array("lights");
+        if (lights_array) {
+            for (const auto& light_table : *lights_array) {
+                if (!process_light(light_table, world_ptr.get())) {
+                    return std::shared_ptr<SceneWorld>();
+                }
+            }
+        }
+        if (world_ptr->get_num_lights() == 0) {
+            LOG(ERROR) << "No light found";
             return std::shared_ptr<SceneWorld>();
         }
 
-        Vector3d temp_center(raw_center->data());
-        Vector3d light_center = temp_center.cast<double>();
-
-        world_ptr->add_camera(std::shared_ptr<Camera>(
-                                 new Camera(camera_eye, camera_lookat, camera_roll)));
-
-        world_ptr->add_light(std::shared_ptr<Light>(new Light(light_center)));
+        auto tab_animation = world_config->get_table("animation");
+        if (tab_animation) {
+            TraceSpan span("create_animation");
+            auto animation_ptr = create_animation(tab_animation);
+            if (!animation_ptr) {
+                LOG(ERROR) << "Error parsing animation";
+                return std::shared_ptr<SceneWorld>();
+            }
+            world_ptr->add_animation(animation_ptr);
+        }
 
         return world_ptr;
     }
 
 private:
-    std::string world_filename_;
     TextureFactory* texture_factory_;
+    Precision precision_;
 };
 
 
+/*
+The tree is built once, in the given precision.
+*/
 std::shared_ptr<SceneWorld> build_world(const std::string& world_filename,
-                                        TextureFactory* texture_factory) {
-    return WorldBuilder(
-                world_filename,
-                texture_factory
-                ).build();
+                                        TextureFactory* texture_factory,
+                                        Precision precision) {
+    return WorldBuilder(texture_factory, precision).build_from_file(world_filename);
+}
+
+
+std::shared_ptr<SceneWorld> build_world_from_string(const std::string& world_description,
+                                                    TextureFactory* texture_factory,
+                                                    Precision precision) {
+    return WorldBuilder(texture_factory, precision).build_from_string(world_description);
 }
 
 
@@ -2,9 +2,12 @@
 #define _WORLD_H
 
 #include <memory>
+#include <string>
 #include <vector>
 
 #include "actors.h"
+#include "arena.h"
+#include "bvh.h"
 #include "camera.h"
 #include "light.h"
 #include "texture.h"
@@ -12,6 +15,10 @@
 
 namespace mrtp {
 
+class SceneAnimation;
+class MoleculeTrajectory;
+
+
 class ActorIterator {
 public:
     ActorIterator(std::vector<std::shared_ptr<ActorBase>>*);
@@ -37,21 +44,64 @@ public:
     void add_light(std::shared_ptr<Light>);
     void add_camera(std::shared_ptr<Camera>);
     void add_actor(std::shared_ptr<ActorBase>);
-
-    Light* get_light_ptr();
+    void add_molecule(std::shared_ptr<MoleculeActors>);
+    void add_animation(std::shared_ptr<SceneAnimation>);
+    void add_trajectory(std::shared_ptr<MoleculeTrajectory>);
+    void set_arena(std::shared_ptr<SceneArena>);
+    void add_source_file(const std::string&);
+
+    void build_acceleration();
+    void refit_acceleration();
+    void set_precision(Precision);
+    bool load_trajectory_frame();
+    bool has_trajectories() const;
+
+    Light* get_light_ptr(unsigned int);
+    unsigned int get_num_lights() const;
     Camera* get_camera_ptr();
+    SceneAnimation* get_animation_ptr();
+    SceneArena* get_arena_ptr();
+    Precision get_precision() const;
+    unsigned int get_geometry_version() const;
+    std::string describe_sources() const;
+
+    template <typename T>
+    ActorBVH<T>* get_bvh_ptr();
+    MoleculeActors* find_molecule(const std::string&);
 
     ActorIterator get_actor_iterator();
 
 private:
-    std::shared_ptr<Light> light_;
+    std::shared_ptr<SceneArena> arena_;
+    std::vector<std::shared_ptr<Light>> light_ptrs_;
     std::shared_ptr<Camera> camera_;
+    std::shared_ptr<SceneAnimation> animation_;
+    Precision precision_ = Precision::Double;
+    unsigned int geometry_version_ = 0;
+    std::shared_ptr<ActorBVH<double>> bvh_;
+    std::shared_ptr<ActorBVH<float>> float_bvh_;
 
     std::vector<std::shared_ptr<ActorBase>> actor_ptrs_;
+    std::vector<std::shared_ptr<MoleculeActors>> molecule_ptrs_;
+    std::vector<std::shared_ptr<MoleculeTrajectory>> trajectory_ptrs_;
+    std::vector<std::string> source_files_;
 };
 
 
-std::shared_ptr<SceneWorld> build_world(const std::string&, TextureFactory*);
+template <>
+ActorBVH<double>* SceneWorld::get_bvh_ptr<double>();
+
+template <>
+ActorBVH<float>* SceneWorld::get_bvh_ptr<float>();
+
+
+std::shared_ptr<SceneWorld> build_world(const std::string&,
+                                        TextureFactory*,
+                                        Precision = Precision::Double);
+
+std::shared_ptr<SceneWorld> build_world_from_string(const std::string&,
+                                                    TextureFactory*,
+                                                    Precision = Precision::Double);
 
 
 } //namespace mrtp